@@ -0,0 +1,577 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// AdaptivePoller.cpp: ozwd's own value polling
+//
+
+#include "AdaptivePoller.h"
+
+#include <algorithm>
+#include <iostream>
+
+using OpenZWave::RemoteValueID;
+using OpenZWave::AdaptivePollEntry;
+using OpenZWave::AdaptivePollPlan;
+
+// node statistics sampling period
+static const uint64_t c_sampleMs = 60000;
+// max. time the poller thread sleeps between checks
+static const uint64_t c_idleMs = 1000;
+// messages a node must have sent since the last sample to be judged
+static const uint32_t c_minMessages = 4;
+static const uint32_t c_maxBackoff = 8;
+
+uint32_t const AdaptivePoller::c_minIntervalMs;
+uint64_t const AdaptivePoller::c_unknownAge;
+
+//-----------------------------------------------------------------------------
+// <NowMs>
+// Never 0, which stands for "never" in the entries
+//-----------------------------------------------------------------------------
+static uint64_t NowMs()
+{
+	static boost::posix_time::ptime const start = boost::posix_time::microsec_clock::universal_time();
+	return 1 + (uint64_t)( boost::posix_time::microsec_clock::universal_time() - start ).total_milliseconds();
+}
+
+//-----------------------------------------------------------------------------
+// <Delta>
+// Growth of a counter since the last sample, 0 if it was reset
+//-----------------------------------------------------------------------------
+static uint32_t Delta
+(
+	uint32_t _now,
+	uint32_t _before
+)
+{
+	return ( _now >= _before ) ? _now - _before : 0;
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::AdaptivePoller>
+//-----------------------------------------------------------------------------
+AdaptivePoller::AdaptivePoller
+(
+	Poll _poll,
+	Health _health
+):
+	m_poll( _poll ),
+	m_health( _health ),
+	m_nextSample( 0 ),
+	m_running( false )
+{
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::~AdaptivePoller>
+//-----------------------------------------------------------------------------
+AdaptivePoller::~AdaptivePoller()
+{
+	Stop();
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Start>
+//-----------------------------------------------------------------------------
+void AdaptivePoller::Start()
+{
+	m_running = true;
+	m_thread = boost::thread( boost::bind( &AdaptivePoller::Run, this ) );
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Stop>
+//-----------------------------------------------------------------------------
+void AdaptivePoller::Stop()
+{
+	if( !m_running.exchange( false ) )
+	{
+		return;
+	}
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		m_cond.notify_one();
+	}
+	m_thread.join();
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Key>
+//-----------------------------------------------------------------------------
+AdaptivePoller::ValueKey AdaptivePoller::Key
+(
+	RemoteValueID const& _id
+)
+{
+	return ValueKey( (uint32_t)_id._homeId, _id.toValueID().GetId() );
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Enable>
+//-----------------------------------------------------------------------------
+bool AdaptivePoller::Enable
+(
+	RemoteValueID const& _id,
+	uint32_t _intervalMs,
+	uint64_t _ageMs
+)
+{
+	if( _intervalMs < c_minIntervalMs )
+	{
+		return false;
+	}
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	uint64_t const now = NowMs();
+	ValueKey const key = Key( _id );
+	HomeState& home = m_homes[key.first];
+	std::map<ValueKey, Entry>::iterator it = m_entries.find( key );
+	if( it == m_entries.end() )
+	{
+		it = m_entries.insert( std::make_pair( key, Entry() ) ).first;
+		it->second.m_due = 0;
+		m_queue.insert( std::make_pair( 0, key ) );
+	}
+	else
+	{
+		// a new interval, counted afresh
+		home.m_retiredPolls += it->second.m_polls;
+		home.m_retiredSaved += Saved( it->second, now );
+	}
+	Entry& entry = it->second;
+	entry.m_id = _id;
+	entry.m_intervalMs = _intervalMs;
+	entry.m_enabledAt = now;
+	entry.m_polls = 0;
+	entry.m_lastReport = ( _ageMs < now ) ? now - _ageMs : 0;
+	NodeKey const node( key.first, (uint8_t)_id._nodeId );
+	if( m_nodes.find( node ) == m_nodes.end() )
+	{
+		NodeState& state = m_nodes[node];
+		state.m_sampled = false;
+		state.m_backoff = 1;
+	}
+	Reschedule( key, entry, entry.m_lastReport ? entry.m_lastReport + EffectiveInterval( entry ) : now );
+	UpdateSpacing( key.first );
+	m_cond.notify_one();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Disable>
+//-----------------------------------------------------------------------------
+bool AdaptivePoller::Disable
+(
+	uint32_t _homeId,
+	uint64_t _valueId
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	std::map<ValueKey, Entry>::iterator it = m_entries.find( ValueKey( _homeId, _valueId ) );
+	if( it == m_entries.end() )
+	{
+		return false;
+	}
+	Retire( it, NowMs() );
+	UpdateSpacing( _homeId );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::DisableNode>
+//-----------------------------------------------------------------------------
+uint32_t AdaptivePoller::DisableNode
+(
+	uint32_t _homeId,
+	uint8_t _nodeId
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	uint64_t const now = NowMs();
+	uint32_t count = 0;
+	std::map<ValueKey, Entry>::iterator it = m_entries.lower_bound( ValueKey( _homeId, 0 ) );
+	while( ( it != m_entries.end() ) && ( it->first.first == _homeId ) )
+	{
+		if( (uint8_t)it->second.m_id._nodeId == _nodeId )
+		{
+			it = Retire( it, now );
+			++count;
+		}
+		else
+		{
+			++it;
+		}
+	}
+	// a node added again later under this ID starts without a backoff
+	m_nodes.erase( NodeKey( _homeId, _nodeId ) );
+	UpdateSpacing( _homeId );
+	return count;
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::DisableHome>
+//-----------------------------------------------------------------------------
+uint32_t AdaptivePoller::DisableHome
+(
+	uint32_t _homeId
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	uint64_t const now = NowMs();
+	uint32_t count = 0;
+	std::map<ValueKey, Entry>::iterator it = m_entries.lower_bound( ValueKey( _homeId, 0 ) );
+	while( ( it != m_entries.end() ) && ( it->first.first == _homeId ) )
+	{
+		it = Retire( it, now );
+		++count;
+	}
+	m_nodes.erase( m_nodes.lower_bound( NodeKey( _homeId, 0 ) ), m_nodes.upper_bound( NodeKey( _homeId, 0xff ) ) );
+	UpdateSpacing( _homeId );
+	return count;
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Retire>
+// Drop an entry, keeping its polls in the network's totals; the caller holds
+// m_mutex and updates the spacing
+//-----------------------------------------------------------------------------
+std::map<AdaptivePoller::ValueKey, AdaptivePoller::Entry>::iterator AdaptivePoller::Retire
+(
+	std::map<ValueKey, Entry>::iterator _it,
+	uint64_t _now
+)
+{
+	HomeState& home = m_homes[_it->first.first];
+	home.m_retiredPolls += _it->second.m_polls;
+	home.m_retiredSaved += Saved( _it->second, _now );
+	m_queue.erase( std::make_pair( _it->second.m_due, _it->first ) );
+	m_entries.erase( _it++ );
+	return _it;
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::OnValueReported>
+// Called from the OpenZWave driver thread for every value report, whether
+// ozwd polled it or the node sent it on its own
+//-----------------------------------------------------------------------------
+void AdaptivePoller::OnValueReported
+(
+	uint32_t _homeId,
+	uint64_t _valueId
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	ValueKey const key( _homeId, _valueId );
+	std::map<ValueKey, Entry>::iterator it = m_entries.find( key );
+	if( it == m_entries.end() )
+	{
+		return;
+	}
+	uint64_t const now = NowMs();
+	it->second.m_lastReport = now;
+	Reschedule( key, it->second, now + EffectiveInterval( it->second ) );
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::GetPlan>
+//-----------------------------------------------------------------------------
+void AdaptivePoller::GetPlan
+(
+	uint32_t _homeId,
+	AdaptivePollPlan& _plan
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	uint64_t const now = NowMs();
+	_plan.m_entries.clear();
+	_plan.m_nodeBackoff.clear();
+	_plan.m_spacingMs = 0;
+	_plan.m_polls = _plan.m_saved = _plan.m_failed = 0;
+	std::map<uint32_t, HomeState>::const_iterator home = m_homes.find( _homeId );
+	if( home != m_homes.end() )
+	{
+		_plan.m_spacingMs = home->second.m_spacingMs;
+		_plan.m_polls = home->second.m_retiredPolls;
+		_plan.m_saved = home->second.m_retiredSaved;
+		_plan.m_failed = home->second.m_failed;
+	}
+	// in the order they are due
+	for( std::set< std::pair<uint64_t, ValueKey> >::const_iterator it = m_queue.begin(); it != m_queue.end(); ++it )
+	{
+		if( it->second.first != _homeId )
+		{
+			continue;
+		}
+		Entry const& entry = m_entries.find( it->second )->second;
+		_plan.m_entries.push_back( AdaptivePollEntry() );
+		AdaptivePollEntry& out = _plan.m_entries.back();
+		out.m_valueId = entry.m_id;
+		out.m_intervalMs = entry.m_intervalMs;
+		out.m_effectiveIntervalMs = EffectiveInterval( entry );
+		out.m_lastReportAgeMs = entry.m_lastReport ? (int64_t)( now - entry.m_lastReport ) : -1;
+		out.m_nextPollInMs = ( entry.m_due > now ) ? (int64_t)( entry.m_due - now ) : 0;
+		out.m_polls = entry.m_polls;
+		out.m_saved = Saved( entry, now );
+		_plan.m_polls += out.m_polls;
+		_plan.m_saved += out.m_saved;
+	}
+	for( std::map<NodeKey, NodeState>::const_iterator it = m_nodes.begin(); it != m_nodes.end(); ++it )
+	{
+		if( ( it->first.first == _homeId ) && ( it->second.m_backoff > 1 ) )
+		{
+			_plan.m_nodeBackoff[(int8_t)it->first.second] = it->second.m_backoff;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Reschedule>
+// The caller holds m_mutex
+//-----------------------------------------------------------------------------
+void AdaptivePoller::Reschedule
+(
+	ValueKey const& _key,
+	Entry& _entry,
+	uint64_t _due
+)
+{
+	m_queue.erase( std::make_pair( _entry.m_due, _key ) );
+	_entry.m_due = _due;
+	m_queue.insert( std::make_pair( _due, _key ) );
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::UpdateSpacing>
+// As many polls per ms as all values of the network need together, evenly
+// spaced; the caller holds m_mutex
+//-----------------------------------------------------------------------------
+void AdaptivePoller::UpdateSpacing
+(
+	uint32_t _homeId
+)
+{
+	double rate = 0;
+	for( std::map<ValueKey, Entry>::const_iterator it = m_entries.lower_bound( ValueKey( _homeId, 0 ) );
+		( it != m_entries.end() ) && ( it->first.first == _homeId ); ++it )
+	{
+		rate += 1.0 / EffectiveInterval( it->second );
+	}
+	m_homes[_homeId].m_spacingMs = ( rate > 0 ) ? (uint32_t)( 1.0 / rate ) : 0;
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::EffectiveInterval>
+//-----------------------------------------------------------------------------
+uint32_t AdaptivePoller::EffectiveInterval
+(
+	Entry const& _entry
+) const
+{
+	std::map<NodeKey, NodeState>::const_iterator node = m_nodes.find( NodeKey( (uint32_t)_entry.m_id._homeId, (uint8_t)_entry.m_id._nodeId ) );
+	return _entry.m_intervalMs * ( ( node != m_nodes.end() ) ? node->second.m_backoff : 1 );
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Saved>
+// Polls a fixed interval would have issued since the value was enabled,
+// beyond those actually issued
+//-----------------------------------------------------------------------------
+uint64_t AdaptivePoller::Saved
+(
+	Entry const& _entry,
+	uint64_t _now
+)
+{
+	uint64_t const fixed = 1 + ( _now - _entry.m_enabledAt ) / _entry.m_intervalMs;
+	return ( fixed > _entry.m_polls ) ? fixed - _entry.m_polls : 0;
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Next>
+// The value to poll now, the earliest due one whose network has a free
+// slot; otherwise lowers _wakeUp to when there may be one. The caller holds
+// m_mutex.
+//-----------------------------------------------------------------------------
+bool AdaptivePoller::Next
+(
+	uint64_t _now,
+	Entry& _entry,
+	uint64_t& _wakeUp
+)
+{
+	for( std::set< std::pair<uint64_t, ValueKey> >::const_iterator it = m_queue.begin(); it != m_queue.end(); ++it )
+	{
+		if( it->first > _now )
+		{
+			_wakeUp = std::min( _wakeUp, it->first );
+			break;
+		}
+		// the spacing in force now, the network may have more values since
+		HomeState& home = m_homes[it->second.first];
+		uint64_t const slot = home.m_lastPoll ? home.m_lastPoll + home.m_spacingMs : 0;
+		if( slot > _now )
+		{
+			_wakeUp = std::min( _wakeUp, slot );
+			continue;
+		}
+		ValueKey const key = it->second;
+		Entry& entry = m_entries.find( key )->second;
+		++entry.m_polls;
+		Reschedule( key, entry, _now + EffectiveInterval( entry ) );
+		home.m_lastPoll = _now;
+		_entry = entry;
+		return true;
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::SampleHealth>
+// Back off on the nodes whose messages need retries or fail, recover on the
+// reliable ones. OpenZWave is asked without m_mutex (_lock), which the
+// caller holds.
+//-----------------------------------------------------------------------------
+void AdaptivePoller::SampleHealth
+(
+	boost::unique_lock<boost::mutex>& _lock
+)
+{
+	// only the nodes that still have polled values
+	std::set<NodeKey> polled;
+	for( std::map<ValueKey, Entry>::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it )
+	{
+		polled.insert( NodeKey( it->first.first, (uint8_t)it->second.m_id._nodeId ) );
+	}
+	std::map<NodeKey, NodeState>::iterator node = m_nodes.begin();
+	while( node != m_nodes.end() )
+	{
+		if( polled.count( node->first ) )
+		{
+			++node;
+		}
+		else
+		{
+			m_nodes.erase( node++ );
+		}
+	}
+
+	_lock.unlock();
+	std::vector< std::pair<NodeKey, NodeHealth> > samples;
+	for( std::set<NodeKey>::const_iterator it = polled.begin(); it != polled.end(); ++it )
+	{
+		NodeHealth health;
+		try
+		{
+			if( m_health( it->first, it->second, health ) )
+			{
+				samples.push_back( std::make_pair( *it, health ) );
+			}
+		}
+		catch( std::exception& e )
+		{
+			std::cerr << "AdaptivePoller: node " << (int)it->second << " statistics: " << e.what() << std::endl;
+		}
+	}
+	_lock.lock();
+
+	std::set<uint32_t> changed;
+	for( size_t i = 0; i < samples.size(); ++i )
+	{
+		node = m_nodes.find( samples[i].first );
+		if( node == m_nodes.end() )
+		{
+			continue;
+		}
+		NodeState& state = node->second;
+		NodeHealth const& health = samples[i].second;
+		uint32_t const sent = Delta( health.m_sent, state.m_last.m_sent );
+		uint32_t const bad = Delta( health.m_failed, state.m_last.m_failed ) + Delta( health.m_retries, state.m_last.m_retries );
+		if( state.m_sampled && ( sent >= c_minMessages ) )
+		{
+			uint32_t const backoff = state.m_backoff;
+			if( bad * 4 > sent )
+			{
+				state.m_backoff = std::min( state.m_backoff * 2, c_maxBackoff );
+			}
+			else if( bad * 20 < sent )
+			{
+				state.m_backoff = std::max<uint32_t>( state.m_backoff / 2, 1 );
+			}
+			if( state.m_backoff != backoff )
+			{
+				changed.insert( node->first.first );
+			}
+		}
+		state.m_last = health;
+		state.m_sampled = true;
+	}
+	for( std::set<uint32_t>::const_iterator it = changed.begin(); it != changed.end(); ++it )
+	{
+		UpdateSpacing( *it );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <AdaptivePoller::Run>
+// The poller thread: one RefreshValue at a time, without m_mutex
+//-----------------------------------------------------------------------------
+void AdaptivePoller::Run()
+{
+	boost::unique_lock<boost::mutex> lock( m_mutex );
+	while( m_running )
+	{
+		uint64_t now = NowMs();
+		if( now >= m_nextSample )
+		{
+			m_nextSample = now + c_sampleMs;
+			SampleHealth( lock );
+			now = NowMs();
+		}
+		uint64_t wakeUp = std::min( now + c_idleMs, m_nextSample );
+		Entry entry;
+		if( !Next( now, entry, wakeUp ) )
+		{
+			if( m_running && ( wakeUp > now ) )
+			{
+				m_cond.timed_wait( lock, boost::posix_time::milliseconds( wakeUp - now ) );
+			}
+			continue;
+		}
+		lock.unlock();
+		bool polled = false;
+		try
+		{
+			polled = m_poll( entry.m_id );
+		}
+		catch( std::exception& e )
+		{
+			std::cerr << "AdaptivePoller: polling failed: " << e.what() << std::endl;
+		}
+		lock.lock();
+		if( !polled )
+		{
+			++m_homes[(uint32_t)entry.m_id._homeId].m_failed;
+		}
+	}
+}
@@ -0,0 +1,154 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// AdaptivePoller.h: ozwd's own value polling (EnableAdaptivePoll)
+//
+// OpenZWave polls a value at a fixed pace even when the node reports it
+// unsolicited, keeping the radio busy for nothing. Here a value is polled
+// (Manager::RefreshValue) only when OpenZWave didn't report it within its
+// interval: every report (ValueChanged/ValueRefreshed) pushes its next poll
+// back by a whole interval.
+//
+// - the polls of a network are spread evenly: one every 1 / sum(1 / interval)
+//   ms at most, rather than in bursts of the values enabled together
+// - the node statistics (Manager::GetNodeStatistics) are sampled every
+//   minute; a node whose retries and failed sends exceed a quarter of its
+//   messages gets its values polled 2, 4 then 8 times less often, and
+//   recovers once it is reliable again
+//
+
+#ifndef _AdaptivePoller_H
+#define _AdaptivePoller_H
+
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+
+#include "ozw_types.h"
+
+class AdaptivePoller
+{
+public:
+	static uint32_t const c_minIntervalMs = 1000;
+	static uint64_t const c_unknownAge = ~(uint64_t)0;
+
+	// message counters of a node, as in Node::NodeData
+	struct NodeHealth
+	{
+		uint32_t	m_sent;
+		uint32_t	m_failed;
+		uint32_t	m_retries;
+	};
+
+	// Manager::RefreshValue, false if refused
+	typedef boost::function<bool( OpenZWave::RemoteValueID const& )>					Poll;
+	// Manager::GetNodeStatistics, false if the node is unknown
+	typedef boost::function<bool( uint32_t _homeId, uint8_t _nodeId, NodeHealth& )>		Health;
+
+	AdaptivePoller( Poll _poll, Health _health );
+	~AdaptivePoller();
+
+	void Start();
+	void Stop();
+
+	// poll a value whenever it is older than _intervalMs (at least
+	// c_minIntervalMs); _ageMs is how old it is now, if known
+	bool Enable( OpenZWave::RemoteValueID const& _id, uint32_t _intervalMs, uint64_t _ageMs );
+	bool Disable( uint32_t _homeId, uint64_t _valueId );
+	// a node left the network (NodeRemoved), or the network went away
+	// (DriverRemoved, DriverReset): stop polling all of its values, returns
+	// how many were polled
+	uint32_t DisableNode( uint32_t _homeId, uint8_t _nodeId );
+	uint32_t DisableHome( uint32_t _homeId );
+
+	// OpenZWave reported the value (ValueChanged/ValueRefreshed)
+	void OnValueReported( uint32_t _homeId, uint64_t _valueId );
+
+	void GetPlan( uint32_t _homeId, OpenZWave::AdaptivePollPlan& _plan );
+
+private:
+	typedef std::pair<uint32_t, uint64_t> ValueKey;		// homeId, ValueID
+	typedef std::pair<uint32_t, uint8_t> NodeKey;		// homeId, nodeId
+
+	struct Entry
+	{
+		OpenZWave::RemoteValueID	m_id;
+		uint32_t					m_intervalMs;
+		uint64_t					m_enabledAt;	// ms
+		uint64_t					m_lastReport;	// ms, 0: never
+		uint64_t					m_due;			// ms, next poll unless reported first
+		uint64_t					m_polls;
+	};
+
+	struct NodeState
+	{
+		NodeHealth		m_last;			// counters at the last sample
+		bool			m_sampled;
+		uint32_t		m_backoff;		// 1, 2, 4 or 8
+	};
+
+	struct HomeState
+	{
+		uint32_t		m_spacingMs;	// between two polls of the network
+		uint64_t		m_lastPoll;		// ms, 0: never
+		uint64_t		m_retiredPolls;	// of the values no longer polled
+		uint64_t		m_retiredSaved;
+		uint64_t		m_failed;
+	};
+
+	void Run();
+	bool Next( uint64_t _now, Entry& _entry, uint64_t& _wakeUp );
+	void SampleHealth( boost::unique_lock<boost::mutex>& _lock );
+	void Reschedule( ValueKey const& _key, Entry& _entry, uint64_t _due );
+	std::map<ValueKey, Entry>::iterator Retire( std::map<ValueKey, Entry>::iterator _it, uint64_t _now );
+	void UpdateSpacing( uint32_t _homeId );
+	uint32_t EffectiveInterval( Entry const& _entry ) const;
+	static uint64_t Saved( Entry const& _entry, uint64_t _now );
+	static ValueKey Key( OpenZWave::RemoteValueID const& _id );
+
+	Poll		m_poll;
+	Health		m_health;
+
+	// guards everything below
+	boost::mutex								m_mutex;
+	boost::condition_variable					m_cond;
+	std::map<ValueKey, Entry>					m_entries;
+	std::set< std::pair<uint64_t, ValueKey> >	m_queue;		// by due time
+	std::map<NodeKey, NodeState>				m_nodes;
+	std::map<uint32_t, HomeState>				m_homes;
+	uint64_t									m_nextSample;	// ms
+
+	boost::atomic<bool>		m_running;
+	boost::thread			m_thread;
+};
+
+#endif
@@ -0,0 +1,479 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// HistoryStore.cpp: embedded time series store for numeric OpenZWave values
+//
+
+#include "HistoryStore.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+
+namespace fs = boost::filesystem;
+
+static uint64_t const c_dayMs = 86400000ULL;
+static char const c_magic[8] = { 'O', 'Z', 'W', 'H', 'I', 'S', 'T', '1' };
+static char const* const c_extension = ".ozwh";
+static uint32_t const c_initialCapacity = 16384;	// records, 512KB
+
+// on-disk layout (host byte order), a 32 byte header followed by records
+struct SegmentHeader
+{
+	char		m_magic[8];
+	uint32_t	m_day;			// days since the epoch
+	uint32_t	m_count;		// committed records
+	uint32_t	m_reserved[4];
+};
+
+struct HistoryRecord
+{
+	uint64_t	m_valueId;		// ValueID::GetId()
+	uint32_t	m_homeId;
+	uint32_t	m_offset;		// ms since the start of the segment's day
+	double		m_value;
+	uint32_t	m_prev;			// 1-based index of the value's previous record, 0: none
+	uint32_t	m_reserved;
+};
+
+struct HistoryStore::Segment
+{
+	uint32_t		m_day;
+	int				m_fd;
+	char*			m_base;
+	size_t			m_size;		// mapped bytes
+	uint32_t		m_capacity;	// records
+	LastIndex		m_last;		// 1-based index of each value's latest record
+
+	SegmentHeader* Header() const { return (SegmentHeader*)m_base; }
+	HistoryRecord* Records() const { return (HistoryRecord*)( m_base + sizeof(SegmentHeader) ); }
+};
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::HistoryStore>
+// Maps every segment found in the directory
+//-----------------------------------------------------------------------------
+HistoryStore::HistoryStore
+(
+	std::string const& _directory,
+	uint32_t _retentionDays
+):
+	m_directory( _directory ),
+	m_retentionDays( _retentionDays ),
+	m_lastExpired( 0 )
+{
+	fs::create_directories( m_directory );
+	for( fs::directory_iterator it( m_directory ); it != fs::directory_iterator(); ++it )
+	{
+		if( it->path().extension() != c_extension )
+		{
+			continue;
+		}
+		try
+		{
+			boost::gregorian::date const date = boost::gregorian::from_undelimited_string( it->path().stem().string() );
+			uint32_t const day = ( date - boost::gregorian::date( 1970, 1, 1 ) ).days();
+			if( !OpenSegment( day, false ) )
+			{
+				std::cerr << "HistoryStore: ignoring " << it->path().string() << std::endl;
+			}
+		}
+		catch( std::exception& )
+		{
+			// not one of ours
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::~HistoryStore>
+//-----------------------------------------------------------------------------
+HistoryStore::~HistoryStore
+(
+)
+{
+	for( std::map<uint32_t, Segment*>::iterator it = m_segments.begin(); it != m_segments.end(); ++it )
+	{
+		munmap( it->second->m_base, it->second->m_size );
+		close( it->second->m_fd );
+		delete it->second;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::SegmentPath>
+// <directory>/YYYYMMDD.ozwh
+//-----------------------------------------------------------------------------
+std::string HistoryStore::SegmentPath
+(
+	uint32_t _day
+) const
+{
+	boost::gregorian::date const date = boost::gregorian::date( 1970, 1, 1 ) + boost::gregorian::days( _day );
+	return ( fs::path( m_directory ) / ( boost::gregorian::to_iso_string( date ) + c_extension ) ).string();
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::GetSegment>
+//-----------------------------------------------------------------------------
+HistoryStore::Segment* HistoryStore::GetSegment
+(
+	uint32_t _day,
+	bool _create
+)
+{
+	std::map<uint32_t, Segment*>::iterator it = m_segments.find( _day );
+	if( it != m_segments.end() )
+	{
+		return it->second;
+	}
+	return _create ? OpenSegment( _day, true ) : NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::OpenSegment>
+// Map a segment file (creating it if asked to) and index its values
+//-----------------------------------------------------------------------------
+HistoryStore::Segment* HistoryStore::OpenSegment
+(
+	uint32_t _day,
+	bool _create
+)
+{
+	std::string const path = SegmentPath( _day );
+	int const fd = open( path.c_str(), _create ? ( O_RDWR | O_CREAT ) : O_RDWR, 0644 );
+	if( fd < 0 )
+	{
+		return NULL;
+	}
+	struct stat st;
+	if( fstat( fd, &st ) != 0 )
+	{
+		close( fd );
+		return NULL;
+	}
+	size_t size = st.st_size;
+	bool const fresh = ( size == 0 );
+	if( fresh )
+	{
+		size = sizeof(SegmentHeader) + c_initialCapacity * sizeof(HistoryRecord);
+		if( ftruncate( fd, size ) != 0 )
+		{
+			close( fd );
+			return NULL;
+		}
+	}
+	if( size < sizeof(SegmentHeader) )
+	{
+		close( fd );
+		return NULL;
+	}
+	void* base = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if( base == MAP_FAILED )
+	{
+		close( fd );
+		return NULL;
+	}
+
+	Segment* segment = new Segment();
+	segment->m_day = _day;
+	segment->m_fd = fd;
+	segment->m_base = (char*)base;
+	segment->m_size = size;
+	segment->m_capacity = ( size - sizeof(SegmentHeader) ) / sizeof(HistoryRecord);
+
+	SegmentHeader* header = segment->Header();
+	if( fresh )
+	{
+		memcpy( header->m_magic, c_magic, sizeof(c_magic) );
+		header->m_day = _day;
+		header->m_count = 0;
+	}
+	else if( ( memcmp( header->m_magic, c_magic, sizeof(c_magic) ) != 0 )
+		|| ( header->m_day != _day ) || ( header->m_count > segment->m_capacity ) )
+	{
+		munmap( base, size );
+		close( fd );
+		delete segment;
+		return NULL;
+	}
+
+	HistoryRecord const* records = segment->Records();
+	for( uint32_t i = 0; i < header->m_count; ++i )
+	{
+		segment->m_last[ValueKey( records[i].m_homeId, records[i].m_valueId )] = i + 1;
+	}
+	m_segments[_day] = segment;
+	return segment;
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::Grow>
+// Double a full segment's file and map it again
+//-----------------------------------------------------------------------------
+bool HistoryStore::Grow
+(
+	Segment* _segment
+)
+{
+	size_t const size = sizeof(SegmentHeader) + (size_t)_segment->m_capacity * 2 * sizeof(HistoryRecord);
+	if( ftruncate( _segment->m_fd, size ) != 0 )
+	{
+		return false;
+	}
+	void* base = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _segment->m_fd, 0 );
+	if( base == MAP_FAILED )
+	{
+		return false;
+	}
+	munmap( _segment->m_base, _segment->m_size );
+	_segment->m_base = (char*)base;
+	_segment->m_size = size;
+	_segment->m_capacity *= 2;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::Expire>
+// Delete the segments that fell out of the retention period
+//-----------------------------------------------------------------------------
+void HistoryStore::Expire
+(
+	uint32_t _today
+)
+{
+	m_lastExpired = _today;
+	if( !m_retentionDays )
+	{
+		return;
+	}
+	while( !m_segments.empty() && ( m_segments.begin()->first + m_retentionDays <= _today ) )
+	{
+		Segment* segment = m_segments.begin()->second;
+		munmap( segment->m_base, segment->m_size );
+		close( segment->m_fd );
+		unlink( SegmentPath( segment->m_day ).c_str() );
+		delete segment;
+		m_segments.erase( m_segments.begin() );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::Append>
+//-----------------------------------------------------------------------------
+void HistoryStore::Append
+(
+	uint32_t _homeId,
+	uint64_t _valueId,
+	uint64_t _timestamp,
+	double _value
+)
+{
+	uint32_t const day = _timestamp / c_dayMs;
+	boost::unique_lock<boost::shared_mutex> lock( m_lock );
+	if( day != m_lastExpired )
+	{
+		Expire( day );
+	}
+	Segment* segment = GetSegment( day, true );
+	if( !segment )
+	{
+		return;
+	}
+	SegmentHeader* header = segment->Header();
+	if( ( header->m_count == segment->m_capacity ) && !Grow( segment ) )
+	{
+		return;
+	}
+	header = segment->Header();
+
+	uint32_t& last = segment->m_last[ValueKey( _homeId, _valueId )];
+	HistoryRecord& record = segment->Records()[header->m_count];
+	record.m_valueId = _valueId;
+	record.m_homeId = _homeId;
+	record.m_offset = _timestamp - (uint64_t)day * c_dayMs;
+	record.m_value = _value;
+	record.m_prev = last;
+	record.m_reserved = 0;
+	// the record is complete before it's counted
+	last = ++header->m_count;
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::Walk>
+//-----------------------------------------------------------------------------
+template<class Visitor> void HistoryStore::Walk
+(
+	uint32_t _homeId,
+	uint64_t _valueId,
+	uint64_t _from,
+	uint64_t _to,
+	Visitor& _visit
+)
+{
+	if( _from > _to )
+	{
+		return;
+	}
+	ValueKey const key( _homeId, _valueId );
+	std::map<uint32_t, Segment*>::reverse_iterator it( m_segments.upper_bound( _to / c_dayMs ) );
+	for( ; ( it != m_segments.rend() ) && ( it->first >= _from / c_dayMs ); ++it )
+	{
+		Segment const* segment = it->second;
+		LastIndex::const_iterator last = segment->m_last.find( key );
+		if( last == segment->m_last.end() )
+		{
+			continue;
+		}
+		uint64_t const start = (uint64_t)segment->m_day * c_dayMs;
+		HistoryRecord const* records = segment->Records();
+		for( uint32_t index = last->second; index; index = records[index - 1].m_prev )
+		{
+			HistoryRecord const& record = records[index - 1];
+			uint64_t const timestamp = start + record.m_offset;
+			if( timestamp > _to )
+			{
+				continue;
+			}
+			if( ( timestamp < _from ) || !_visit( timestamp, record.m_value ) )
+			{
+				return;
+			}
+		}
+	}
+}
+
+namespace
+{
+	// GetHistory: collect at most m_max + 1 points
+	struct PointCollector
+	{
+		std::vector<HistoryPoint>&	m_points;
+		size_t						m_max;
+
+		PointCollector( std::vector<HistoryPoint>& _points, size_t _max ): m_points( _points ), m_max( _max ) {}
+
+		bool operator()( uint64_t _timestamp, double _value )
+		{
+			HistoryPoint point = { _timestamp, _value };
+			m_points.push_back( point );
+			return m_points.size() <= m_max;
+		}
+	};
+
+	// GetAggregate: fold the points into their buckets
+	struct BucketCollector
+	{
+		std::vector<HistoryAggregate>&	m_buckets;
+		uint64_t						m_from;
+		uint64_t						m_width;
+
+		BucketCollector( std::vector<HistoryAggregate>& _buckets, uint64_t _from, uint64_t _width ):
+			m_buckets( _buckets ), m_from( _from ), m_width( _width ) {}
+
+		bool operator()( uint64_t _timestamp, double _value )
+		{
+			HistoryAggregate& bucket = m_buckets[( _timestamp - m_from ) / m_width];
+			if( !bucket.m_count++ )
+			{
+				// newest first: the first point seen is the bucket's last one
+				bucket.m_min = bucket.m_max = bucket.m_last = _value;
+			}
+			bucket.m_min = std::min( bucket.m_min, _value );
+			bucket.m_max = std::max( bucket.m_max, _value );
+			bucket.m_sum += _value;
+			return true;
+		}
+	};
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::GetHistory>
+//-----------------------------------------------------------------------------
+bool HistoryStore::GetHistory
+(
+	uint32_t _homeId,
+	uint64_t _valueId,
+	uint64_t _from,
+	uint64_t _to,
+	size_t _maxPoints,
+	std::vector<HistoryPoint>& _points
+)
+{
+	_points.clear();
+	PointCollector collect( _points, _maxPoints );
+	{
+		boost::shared_lock<boost::shared_mutex> lock( m_lock );
+		Walk( _homeId, _valueId, _from, _to, collect );
+	}
+	bool const truncated = _points.size() > _maxPoints;
+	if( truncated )
+	{
+		_points.pop_back();
+	}
+	std::reverse( _points.begin(), _points.end() );
+	return truncated;
+}
+
+//-----------------------------------------------------------------------------
+// <HistoryStore::GetAggregate>
+//-----------------------------------------------------------------------------
+void HistoryStore::GetAggregate
+(
+	uint32_t _homeId,
+	uint64_t _valueId,
+	uint64_t _from,
+	uint64_t _to,
+	uint32_t _buckets,
+	std::vector<HistoryAggregate>& _aggregates
+)
+{
+	_aggregates.clear();
+	if( !_buckets || ( _buckets > c_maxBuckets ) || ( _from > _to ) )
+	{
+		return;
+	}
+	uint64_t const width = ( _to - _from ) / _buckets + 1;
+	_aggregates.resize( _buckets );
+	for( uint32_t i = 0; i < _buckets; ++i )
+	{
+		HistoryAggregate& bucket = _aggregates[i];
+		bucket.m_start = _from + i * width;
+		bucket.m_count = 0;
+		bucket.m_min = bucket.m_max = bucket.m_sum = bucket.m_last = 0;
+	}
+	BucketCollector collect( _aggregates, _from, width );
+	boost::shared_lock<boost::shared_mutex> lock( m_lock );
+	Walk( _homeId, _valueId, _from, _to, collect );
+}
@@ -0,0 +1,119 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// HistoryStore.h: embedded time series store for numeric OpenZWave values
+//
+// Values are appended to one memory-mapped file per (UTC) day, made of a
+// small header followed by fixed-width records. Records of the same value
+// are chained backwards within their segment, and the last record of every
+// value is indexed in memory, so a range query only touches the records of
+// the value it asks for, straight from the mapped pages.
+//
+// Records are only ever appended, the files grow in steps and are mapped
+// again when full. Segments older than the retention period are deleted.
+// The store has a lock of its own: appends take it exclusively, queries
+// share it.
+//
+
+#ifndef _HistoryStore_H
+#define _HistoryStore_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdint.h>
+
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+// one sample of a value
+struct HistoryPoint
+{
+	uint64_t	m_timestamp;	// ms since the epoch
+	double		m_value;
+};
+
+// samples of a value within a time bucket
+struct HistoryAggregate
+{
+	uint64_t	m_start;		// ms since the epoch
+	uint32_t	m_count;
+	double		m_min;
+	double		m_max;
+	double		m_sum;
+	double		m_last;
+};
+
+class HistoryStore
+{
+public:
+	// most buckets GetAggregate fills in, a chart wants a few hundred
+	static uint32_t const c_maxBuckets = 4096;
+
+	// keep segments for _retentionDays days (0: forever)
+	HistoryStore( std::string const& _directory, uint32_t _retentionDays );
+	~HistoryStore();
+
+	// record a sample (timestamps are expected to be non-decreasing)
+	void Append( uint32_t _homeId, uint64_t _valueId, uint64_t _timestamp, double _value );
+
+	// samples of a value in [_from, _to], in time order; if there are more
+	// than _maxPoints, only the latest _maxPoints are returned and it
+	// returns true
+	bool GetHistory( uint32_t _homeId, uint64_t _valueId, uint64_t _from, uint64_t _to,
+		size_t _maxPoints, std::vector<HistoryPoint>& _points );
+	// [_from, _to] split into _buckets equal time buckets, empty ones included
+	// (none if _buckets is 0 or above c_maxBuckets)
+	void GetAggregate( uint32_t _homeId, uint64_t _valueId, uint64_t _from, uint64_t _to,
+		uint32_t _buckets, std::vector<HistoryAggregate>& _aggregates );
+
+private:
+	struct Segment;
+	typedef std::pair<uint32_t, uint64_t>	ValueKey;
+	typedef boost::unordered_map<ValueKey, uint32_t>	LastIndex;
+
+	Segment* GetSegment( uint32_t _day, bool _create );
+	Segment* OpenSegment( uint32_t _day, bool _create );
+	bool Grow( Segment* _segment );
+	void Expire( uint32_t _today );
+	std::string SegmentPath( uint32_t _day ) const;
+
+	// walk a value's records of [_from, _to] backwards, newest first; stops
+	// when _visit returns false
+	template<class Visitor> void Walk( uint32_t _homeId, uint64_t _valueId,
+		uint64_t _from, uint64_t _to, Visitor& _visit );
+
+	HistoryStore( HistoryStore const& );	// no copies
+	HistoryStore& operator=( HistoryStore const& );
+
+	std::string						m_directory;
+	uint32_t						m_retentionDays;
+	std::map<uint32_t, Segment*>	m_segments;		// by day since the epoch, open ones
+	uint32_t						m_lastExpired;	// the day Expire() last ran
+	boost::shared_mutex				m_lock;
+};
+
+#endif
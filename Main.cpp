@@ -30,13 +30,30 @@ http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
 #include "RemoteManager.h"
 #include <protocol/TJSONProtocol.h>
 #include <server/TSimpleServer.h>
+#include <server/TThreadPoolServer.h>
+#include <server/TThreadedServer.h>
+#include <server/TNonblockingServer.h>
+#include <concurrency/ThreadManager.h>
+#include <concurrency/PosixThreadFactory.h>
 #include <transport/TServerSocket.h>
 #include <transport/TBufferTransports.h>
+#include <transport/THttpServer.h>
+#include <protocol/TBinaryProtocol.h>
+#include <protocol/TCompactProtocol.h>
 
 #include <string>
 #include <sstream>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
 #include "unistd.h"
+#include <fcntl.h>
+#include <signal.h>
 // we're using Boost's program_options
 #include <boost/program_options.hpp>
 #include <boost/program_options/parsers.hpp>
@@ -55,6 +72,7 @@ using namespace ::apache::thrift;
 using namespace ::apache::thrift::protocol;
 using namespace ::apache::thrift::transport;
 using namespace ::apache::thrift::server;
+using namespace ::apache::thrift::concurrency;
 
 using boost::shared_ptr;
  
@@ -62,40 +80,245 @@ using namespace OpenZWave;
 
 // boost: extra includes
 #include <boost/thread.hpp>
-// the global mutex for accessing OpenZWave library
-static boost::recursive_mutex     g_criticalSection;
-
+// the OpenZWave locks
+//
+// Every Z-Wave network (--ozwport) is a HomeShard with a lock of its own,
+// so that traffic on one network never waits for another. Calls are
+// serialized by HomeLock:
+// - a call on a known network (HomeReadLock/HomeWriteLock, see
+//   create_server.rb) holds g_criticalSection shared, then its shard's
+//   lock, shared or exclusive.
+// - calls that aren't bound to a network (options, polling, scenes), and
+//   calls on a network ozwd doesn't know (yet), take g_criticalSection
+//   exclusively (or shared, for getters), and so exclude everything else.
 //
-// Struct to hold all valid OpenZWave ValueID's
-// (used by RemoteManager_server.cpp)
-typedef struct
-{
-	uint32			m_homeId;
-	uint8			m_nodeId;
-	bool			m_polled;
-    //std::map<uint64, ValueID*>	m_values;
-    list<ValueID>	m_values;
-} NodeInfo;
+// Concurrency guarantee (valid for every --server mode):
+// - each RemoteManagerHandler method holds its lock only for
+//   the duration of its own OpenZWave::Manager call, so calls coming from
+//   different client connections interleave at method granularity; there
+//   is NO atomicity across several RPCs (e.g. GetValueLabel followed by
+//   GetValueAsFloat may observe a notification in between).
+// - read-only Manager calls (Get*, Is*, SceneGet*...) share the lock and
+//   run in parallel, mutating calls get it exclusively (see create_server.rb)
+// - calls arriving over the same connection are always executed in the
+//   order they were sent, one at a time.
+// - OnNotification (the OpenZWave driver threads) takes its network's lock
+//   exclusively, so it never runs concurrently with a Manager call issued
+//   by a handler for the same network.
+// - the locks are NOT recursive: never call a locking helper while holding one.
+// All ozwd locks record their wait and hold times (GetServerMetrics).
+#include "Metrics.h"
+static InstrumentedSharedMutex  g_criticalSection;
+typedef boost::shared_lock<InstrumentedSharedMutex> ReadLock;
+typedef boost::unique_lock<InstrumentedSharedMutex> WriteLock;
+
 //
-static list<NodeInfo*>     g_nodes;
+// Registry of all known nodes and valid OpenZWave ValueID's of a network,
+// together with their last known values. It has a lock of its own so that
+// cached reads never wait for OpenZWave::Manager; when both are needed,
+// always take the HomeLock first, then the shard's m_registryLock.
+#include "NodeRegistry.h"
 
 // OpenZWave includes
 #include "Manager.h"
 #include "Notification.h"
 #include "Log.h"
 
-static uint32 g_homeId = 0;
-static bool   g_initFailed = false;
+// number of the last notification processed, on any network; lets clients
+// join value snapshots with the live notification stream
+static boost::atomic<uint64> g_sequence(0);
+// numbers them in the order they enter the long-poll ring
+static boost::mutex          g_sequenceMutex;
 //
 
 static boost::condition_variable  initCond ;
 static boost::mutex               initMutex;
 
-// Stomp client
+// Stomp client, shared by the publishers of all networks
 #include "BoostStomp.hpp"
 static STOMP::BoostStomp* stomp_client;
 static string*          notifications_topic = new string("/topic/zwave/monitor");
 
+// all STOMP traffic goes through the asynchronous publisher threads
+#include "NotificationPublisher.h"
+
+// the mesh of a network, for GetNetworkTopology
+#include "TopologyMap.h"
+
+//-----------------------------------------------------------------------------
+// <HomeShard>
+// One Z-Wave network: its controller, OpenZWave lock, value registry and
+// STOMP publisher. The shards are created at startup, one per --ozwport,
+// and learn their homeId when the driver is ready (or from --snapshot).
+//-----------------------------------------------------------------------------
+enum DriverState
+{
+	Driver_Starting = 0,
+	Driver_Ready,
+	Driver_Failed
+};
+
+struct HomeShard
+{
+	string							m_port;				// --ozwport
+	boost::atomic<uint32>			m_homeId;			// 0 until known
+	boost::atomic<int>				m_state;			// DriverState
+	InstrumentedSharedMutex			m_lock;				// see HomeLock
+	NodeRegistry					m_registry;
+	InstrumentedSharedMutex			m_registryLock;
+	// metadata of the nodes restored from --snapshot, served for them while
+	// they are stale (under m_registryLock as well)
+	std::map<uint8, NodeSnapshot>	m_warmNodes;
+	// NULL with --nostomp, or until the homeId is known
+	boost::atomic<NotificationPublisher*>	m_publisher;
+	// for GetDriverHealth
+	boost::atomic<int64_t>			m_readyAt;			// ms since the epoch
+	boost::atomic<int64_t>			m_lastNotificationAt;
+	boost::atomic<uint64>			m_notifications;
+	// GetNetworkTopology's last result, valid while it has the current
+	// version (bumped whenever a node or its neighbors may have changed)
+	boost::atomic<uint64>			m_topologyVersion;
+	boost::mutex					m_topologyMutex;
+	boost::shared_ptr<NetworkTopology const>	m_topology;
+
+	HomeShard( string const& _port ):
+		m_port( _port ), m_homeId( 0 ), m_state( Driver_Starting ), m_publisher( NULL ),
+		m_readyAt( 0 ), m_lastNotificationAt( 0 ), m_notifications( 0 ), m_topologyVersion( 1 ) {}
+};
+
+// one per --ozwport, in command line order; fixed once OpenZWave starts
+static vector<HomeShard*> g_shards;
+
+//-----------------------------------------------------------------------------
+// <find_shard>
+// The shard of a network, NULL if unknown (there are only a few of them)
+//-----------------------------------------------------------------------------
+static HomeShard* find_shard
+(
+	uint32 const _homeId
+)
+{
+	for( vector<HomeShard*>::const_iterator it = g_shards.begin(); it != g_shards.end(); ++it )
+	{
+		if( _homeId && ( (*it)->m_homeId.load() == _homeId ) )
+		{
+			return *it;
+		}
+	}
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <HomeLock>
+// RAII guard of a network's OpenZWave calls: g_criticalSection shared, then
+// the shard's lock; g_criticalSection exclusively for an unknown network.
+// Like the boost locks, it may be released early with unlock().
+//-----------------------------------------------------------------------------
+class HomeLock : boost::noncopyable
+{
+public:
+	HomeLock( HomeShard* _shard, bool const _exclusive ):
+		m_shard( _shard ),
+		m_exclusive( _exclusive ),
+		m_locked( true )
+	{
+		if( !m_shard )
+		{
+			g_criticalSection.lock();
+			return;
+		}
+		g_criticalSection.lock_shared();
+		if( m_exclusive )
+		{
+			m_shard->m_lock.lock();
+		}
+		else
+		{
+			m_shard->m_lock.lock_shared();
+		}
+	}
+
+	~HomeLock()
+	{
+		unlock();
+	}
+
+	void unlock()
+	{
+		if( !m_locked )
+		{
+			return;
+		}
+		m_locked = false;
+		if( !m_shard )
+		{
+			g_criticalSection.unlock();
+			return;
+		}
+		if( m_exclusive )
+		{
+			m_shard->m_lock.unlock();
+		}
+		else
+		{
+			m_shard->m_lock.unlock_shared();
+		}
+		g_criticalSection.unlock_shared();
+	}
+
+private:
+	HomeShard*	m_shard;
+	bool		m_exclusive;
+	bool		m_locked;
+};
+
+struct HomeReadLock : HomeLock
+{
+	explicit HomeReadLock( uint32 const _homeId ): HomeLock( find_shard( _homeId ), false ) {}
+};
+
+struct HomeWriteLock : HomeLock
+{
+	explicit HomeWriteLock( uint32 const _homeId ): HomeLock( find_shard( _homeId ), true ) {}
+};
+
+// the latest notifications, for WaitForNotifications (NULL with --ringsize 0)
+#include "NotificationRing.h"
+static NotificationRing* g_ring = NULL;
+
+// server-side subscription filters: further topics for the notifications
+// matching a route (--route, AddNotificationRoute)
+#include "TopicRouter.h"
+static TopicRouter g_router;
+
+// value writes queued by ScheduleValueWrite, handed to OpenZWave by priority
+// as its send queues drain
+#include "WriteScheduler.h"
+static WriteScheduler* g_writes = NULL;
+
+// values ozwd polls itself, when they weren't reported recently enough
+// (EnableAdaptivePoll)
+#include "AdaptivePoller.h"
+static AdaptivePoller* g_poller = NULL;
+
+// optional time series of numeric values (--history)
+#include "HistoryStore.h"
+static HistoryStore* g_history = NULL;
+
+// the raw notification stream, for ozwd-bench --replay (--capture)
+#include "NotificationCapture.h"
+static NotificationCapture* g_capture = NULL;
+
+// RPC latencies (the Thrift processor's event handler), OnNotification
+// durations and notification counts by type, for GetServerMetrics
+static shared_ptr<RpcMetrics>   g_rpcMetrics(new RpcMetrics());
+static LatencyHistogram         g_notificationLatency;
+static uint32 const             c_notificationTypes = 64;
+static boost::atomic<uint64>    g_notificationCounts[c_notificationTypes];
+static int64_t const            g_startUs = MetricsNowUs();
+// the same in Prometheus' text format over HTTP (--metricsport)
+static MetricsEndpoint*         g_metricsEndpoint = NULL;
+
 // JSON body indicator
 static bool jsonMessageBody = false;
 
@@ -104,25 +327,15 @@ static bool debugMsg = false;
 
 //-----------------------------------------------------------------------------
 // <GetNodeInfo>
-// Callback that is triggered when a value, group or node changes
+// The registry entry of the node a notification refers to
 //-----------------------------------------------------------------------------
 NodeInfo* GetNodeInfo
 (
+	HomeShard* _shard,
 	Notification const* _notification
 )
 {
-	uint32 const homeId = _notification->GetHomeId();
-	uint8 const nodeId = _notification->GetNodeId();
-	for( list<NodeInfo*>::iterator it = g_nodes.begin(); it != g_nodes.end(); ++it )
-	{
-		NodeInfo* nodeInfo = *it;
-		if( ( nodeInfo->m_homeId == homeId ) && ( nodeInfo->m_nodeId == nodeId ) )
-		{
-			return nodeInfo;
-		}
-	}
-
-	return NULL;
+	return _shard->m_registry.GetNode( _notification->GetHomeId(), _notification->GetNodeId() );
 }
 
 //-----------------------------------------------------------------------------
@@ -151,6 +364,456 @@ string jsonifyHeaders(STOMP::hdrmap& headers)
 	return hdrjson;
 }
 
+//-----------------------------------------------------------------------------
+// <fetch_value>
+// Read the current value of a ValueID from OpenZWave into the value cache
+// format (the caller holds the network's HomeLock)
+//-----------------------------------------------------------------------------
+bool fetch_value
+(
+	ValueID const& _id,
+	ValueState& _state
+)
+{
+	Manager* mgr = Manager::Get();
+	switch( _id.GetType() )
+	{
+		case ValueID::ValueType_Bool:
+		case ValueID::ValueType_Button:
+			_state.m_valid = mgr->GetValueAsBool( _id, &_state.m_bool );
+			break;
+		case ValueID::ValueType_Byte:
+			_state.m_valid = mgr->GetValueAsByte( _id, &_state.m_byte );
+			break;
+		case ValueID::ValueType_Decimal:
+			_state.m_valid = mgr->GetValueAsFloat( _id, &_state.m_float );
+			break;
+		case ValueID::ValueType_Int:
+			_state.m_valid = mgr->GetValueAsInt( _id, &_state.m_int );
+			break;
+		case ValueID::ValueType_Short:
+			_state.m_valid = mgr->GetValueAsShort( _id, &_state.m_short );
+			break;
+		case ValueID::ValueType_List:
+			_state.m_valid = mgr->GetValueListSelection( _id, &_state.m_string )
+				&& mgr->GetValueListSelection( _id, &_state.m_int );
+			break;
+		case ValueID::ValueType_Raw:
+		{
+			uint8* raw = NULL;
+			uint8 length = 0;
+			_state.m_valid = mgr->GetValueAsRaw( _id, &raw, &length );
+			if( raw )
+			{
+				_state.m_string.assign( (char const*)raw, length );
+				delete [] raw;
+			}
+			break;
+		}
+		default:
+			_state.m_valid = mgr->GetValueAsString( _id, &_state.m_string );
+			break;
+	}
+	return _state.m_valid;
+}
+
+//-----------------------------------------------------------------------------
+// <history_sample>
+// The value as stored in the history, false for non-numeric types
+//-----------------------------------------------------------------------------
+static bool history_sample
+(
+	ValueState const& _state,
+	ValueID::ValueType const _type,
+	double& _sample
+)
+{
+	switch( _type )
+	{
+		case ValueID::ValueType_Bool:
+		case ValueID::ValueType_Button:		_sample = _state.m_bool ? 1 : 0;	return true;
+		case ValueID::ValueType_Byte:		_sample = _state.m_byte;			return true;
+		case ValueID::ValueType_Decimal:	_sample = _state.m_float;			return true;
+		case ValueID::ValueType_Int:		_sample = _state.m_int;				return true;
+		case ValueID::ValueType_Short:		_sample = _state.m_short;			return true;
+		case ValueID::ValueType_List:		_sample = _state.m_int;				return true;	// the selected index
+		default:							return false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <fill_remote_value>
+// Copy a (valid) cached value into its Thrift representation
+//-----------------------------------------------------------------------------
+static void fill_remote_value
+(
+	RemoteValue& _value,
+	ValueState const& _state,
+	ValueID::ValueType const _type
+)
+{
+	switch( _type )
+	{
+		case ValueID::ValueType_Bool:
+		case ValueID::ValueType_Button:
+			_value.m_bool = _state.m_bool;				_value.__isset.m_bool = true;
+			break;
+		case ValueID::ValueType_Byte:
+			_value.m_byte = (int8_t)_state.m_byte;		_value.__isset.m_byte = true;
+			break;
+		case ValueID::ValueType_Decimal:
+			_value.m_decimal = _state.m_float;			_value.__isset.m_decimal = true;
+			break;
+		case ValueID::ValueType_Int:
+			_value.m_int = _state.m_int;				_value.__isset.m_int = true;
+			break;
+		case ValueID::ValueType_Short:
+			_value.m_short = _state.m_short;			_value.__isset.m_short = true;
+			break;
+		case ValueID::ValueType_List:
+			_value.m_listSelection = _state.m_string;	_value.__isset.m_listSelection = true;
+			break;
+		case ValueID::ValueType_Raw:
+			_value.m_raw = _state.m_string;				_value.__isset.m_raw = true;
+			break;
+		default:
+			_value.m_string = _state.m_string;			_value.__isset.m_string = true;
+			break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <read_remote_value>
+// The reverse of fill_remote_value (List values need their selected index
+// on the side)
+//-----------------------------------------------------------------------------
+static void read_remote_value
+(
+	ValueState& _state,
+	RemoteValue const& _value,
+	ValueID::ValueType const _type,
+	int32 const _listIndex
+)
+{
+	switch( _type )
+	{
+		case ValueID::ValueType_Bool:
+		case ValueID::ValueType_Button:		_state.m_bool = _value.m_bool;					break;
+		case ValueID::ValueType_Byte:		_state.m_byte = (uint8)_value.m_byte;			break;
+		case ValueID::ValueType_Decimal:	_state.m_float = (float)_value.m_decimal;		break;
+		case ValueID::ValueType_Int:		_state.m_int = _value.m_int;					break;
+		case ValueID::ValueType_Short:		_state.m_short = _value.m_short;				break;
+		case ValueID::ValueType_List:
+			_state.m_int = _listIndex;
+			_state.m_string = _value.m_listSelection;
+			break;
+		case ValueID::ValueType_Raw:		_state.m_string = _value.m_raw;					break;
+		default:							_state.m_string = _value.m_string;				break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationEncoder>
+// --payload compact|binary: serializes notifications as RemoteNotification
+// structs into the STOMP body. The message struct and the serialization
+// buffer are reused from one event to the next, one encoder per thread.
+// Value snapshot chunks are always serialized, with TJSONProtocol when
+// notifications are sent as headers.
+//-----------------------------------------------------------------------------
+enum PayloadFormat
+{
+	Payload_Headers = 0,	// hex-formatted STOMP headers (and their JSON with --json)
+	Payload_Compact,		// TCompactProtocol
+	Payload_Binary			// TBinaryProtocol
+};
+static PayloadFormat payloadFormat = Payload_Headers;
+
+class NotificationEncoder
+{
+public:
+	NotificationEncoder():
+		m_buffer( new TMemoryBuffer( 256 ) )
+	{
+		if( payloadFormat == Payload_Binary )
+		{
+			m_protocol.reset( new TBinaryProtocol( m_buffer ) );
+		}
+		else if( payloadFormat == Payload_Compact )
+		{
+			m_protocol.reset( new TCompactProtocol( m_buffer ) );
+		}
+		else
+		{
+			m_protocol.reset( new TJSONProtocol( m_buffer ) );
+		}
+	}
+
+	// the message to fill in, cleared
+	RemoteNotification& Message()
+	{
+		m_message.m_value.__isset = m_emptyValue.__isset;
+		m_message.__isset.m_valueId = false;
+		m_message.__isset.m_value = false;
+		return m_message;
+	}
+
+	// serialize the message into the event's body
+	void Encode( StompEvent* _event )
+	{
+		Encode( m_message, _event );
+	}
+
+	// serialize any Thrift struct into the event's body
+	template<class T> void Encode( T const& _struct, StompEvent* _event )
+	{
+		m_buffer->resetBuffer();
+		_struct.write( m_protocol.get() );
+		uint8_t* buf;
+		uint32_t len;
+		m_buffer->getBuffer( &buf, &len );
+		_event->m_body.assign( (char const*)buf, len );
+		_event->m_headers["content-type"] = ( payloadFormat == Payload_Headers ) ? "application/vnd.apache.thrift.json" : "application/x-thrift";
+		_event->m_headers["content-length"] = boost::lexical_cast<string>( len );
+	}
+
+	// the calling thread's encoder
+	static NotificationEncoder& Get()
+	{
+		static boost::thread_specific_ptr<NotificationEncoder> encoders;
+		if( !encoders.get() )
+		{
+			encoders.reset( new NotificationEncoder() );
+		}
+		return *encoders;
+	}
+
+private:
+	shared_ptr<TMemoryBuffer>	m_buffer;
+	shared_ptr<TProtocol>		m_protocol;
+	RemoteNotification			m_message;
+	RemoteValue					m_emptyValue;
+};
+
+// --queuesize, --overflow and the rate limits, for the publishers that are
+// started as the networks get ready
+struct PublisherSettings
+{
+	int				m_queueSize;
+	OverflowPolicy	m_overflow;
+	int				m_rateWindow;
+	int				m_maxRate;
+	bool			m_suppressUnchanged;
+};
+static PublisherSettings g_publisherSettings;
+
+//-----------------------------------------------------------------------------
+// <shard_topic>
+// The STOMP topic of a network: the notification topic itself with a single
+// --ozwport, a subtopic per homeId with several
+//-----------------------------------------------------------------------------
+static string shard_topic
+(
+	HomeShard const* _shard
+)
+{
+	if( g_shards.size() < 2 )
+	{
+		return *notifications_topic;
+	}
+	return *notifications_topic + "/" + to_string<uint32_t>( _shard->m_homeId, std::hex );
+}
+
+//-----------------------------------------------------------------------------
+// <start_publisher>
+// Start the STOMP publisher thread of a network whose homeId is known (all
+// of them share the one STOMP connection)
+//-----------------------------------------------------------------------------
+static void start_publisher
+(
+	HomeShard* _shard
+)
+{
+	if( !stomp_client || _shard->m_publisher.load() )
+	{
+		return;
+	}
+	NotificationPublisher* publisher = new NotificationPublisher( stomp_client, shard_topic( _shard ),
+		g_publisherSettings.m_queueSize, g_publisherSettings.m_overflow );
+	publisher->SetRateLimit( g_publisherSettings.m_rateWindow, g_publisherSettings.m_maxRate, g_publisherSettings.m_suppressUnchanged );
+	publisher->Start();
+	_shard->m_publisher = publisher;
+}
+
+//-----------------------------------------------------------------------------
+// <set_driver_state>
+// A network's driver got ready or failed, main() waits for all of them
+//-----------------------------------------------------------------------------
+static void set_driver_state
+(
+	HomeShard* _shard,
+	DriverState const _state
+)
+{
+	boost::lock_guard<boost::mutex> initLock( initMutex );
+	_shard->m_state = _state;
+	if( _state == Driver_Ready )
+	{
+		_shard->m_readyAt = GetTimestampMs();
+	}
+	initCond.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// <attach_shard>
+// The shard of a notification from a network ozwd doesn't know yet. On
+// DriverReady, that is the shard whose --ozwport is the network's
+// controller. DriverFailed carries no homeId: it goes to the first shard
+// that is still starting, as does anything else that can't be told apart.
+//-----------------------------------------------------------------------------
+static HomeShard* attach_shard
+(
+	Notification const* _notification
+)
+{
+	uint32 const homeId = _notification->GetHomeId();
+	WriteLock lock( g_criticalSection );
+	if( HomeShard* shard = find_shard( homeId ) )
+	{
+		return shard;
+	}
+	HomeShard* shard = NULL;
+	if( homeId && ( _notification->GetType() == Notification::Type_DriverReady ) )
+	{
+		string const path = Manager::Get()->GetControllerPath( homeId );
+		for( vector<HomeShard*>::const_iterator it = g_shards.begin(); !shard && ( it != g_shards.end() ); ++it )
+		{
+			if( (*it)->m_port == path )
+			{
+				shard = *it;
+			}
+		}
+	}
+	// rather one that --snapshot didn't attribute to another network
+	for( vector<HomeShard*>::const_iterator it = g_shards.begin(); !shard && ( it != g_shards.end() ); ++it )
+	{
+		if( ( (*it)->m_state.load() == Driver_Starting ) && !(*it)->m_homeId.load() )
+		{
+			shard = *it;
+		}
+	}
+	for( vector<HomeShard*>::const_iterator it = g_shards.begin(); !shard && ( it != g_shards.end() ); ++it )
+	{
+		if( (*it)->m_state.load() == Driver_Starting )
+		{
+			shard = *it;
+		}
+	}
+	if( !shard )
+	{
+		shard = g_shards.front();
+	}
+	if( homeId && ( _notification->GetType() == Notification::Type_DriverReady ) )
+	{
+		if( uint32 const previous = shard->m_homeId )
+		{
+			// --snapshot had another network on this controller
+			WriteLock registryLock( shard->m_registryLock );
+			shard->m_registry.RemoveHome( previous );
+			shard->m_warmNodes.clear();
+		}
+		shard->m_homeId = homeId;
+	}
+	return shard;
+}
+
+//-----------------------------------------------------------------------------
+// <prune_warm_registry>
+// Once OpenZWave queried all nodes, what it didn't report of a network
+// restored from --snapshot doesn't exist anymore
+//-----------------------------------------------------------------------------
+static void prune_warm_registry
+(
+    HomeShard* _shard,
+    uint32 const _homeId
+)
+{
+    WriteLock registryLock(_shard->m_registryLock);
+    size_t values = 0;
+    size_t const nodes = _shard->m_registry.PruneStale( _homeId, values );
+    _shard->m_warmNodes.clear();
+    if( nodes || values )
+    {
+        cout << "Warm start: dropped " << nodes << " nodes and " << values << " values OpenZWave no longer reports" << endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// <topology_changed>
+// Notifications after which a node or its neighbor list may be different
+// (OpenZWave queries the neighbors before NodeQueriesComplete)
+//-----------------------------------------------------------------------------
+static bool topology_changed
+(
+    Notification::NotificationType const _type
+)
+{
+    switch( _type )
+    {
+        case Notification::Type_NodeNew:
+        case Notification::Type_NodeAdded:
+        case Notification::Type_NodeRemoved:
+        case Notification::Type_NodeProtocolInfo:
+        case Notification::Type_NodeQueriesComplete:
+        case Notification::Type_AwakeNodesQueried:
+        case Notification::Type_AllNodesQueried:
+        case Notification::Type_AllNodesQueriedSomeDead:
+        case Notification::Type_DriverReady:
+        case Notification::Type_DriverReset:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// the headers of a notification (--payload headers), as strings once and for all
+static string const c_nodeIdHeader("NotificationNodeId");
+static string const c_typeHeader("NotificationType");
+static string const c_byteHeader("NotificationByte");
+static string const c_sequenceHeader("Sequence");
+static string const c_homeIdHeader("HomeID");
+static string const c_valueIdHeader("ValueID");
+
+// set a header to _value in hex (like to_string(_value, std::hex)), reusing
+// the header's string if it is there already
+static void set_hex_header(STOMP::hdrmap& _headers, string const& _name, uint64_t _value) {
+    char hex[17];
+    int const length = snprintf(hex, sizeof(hex), "%llx", (unsigned long long)_value);
+    _headers[_name].assign(hex, length);
+}
+
+//-----------------------------------------------------------------------------
+// <removal_scope>
+// What a notification removes, for the STOMP publisher and the poller
+//-----------------------------------------------------------------------------
+static RemovalScope removal_scope
+(
+    Notification::NotificationType const _type
+)
+{
+    switch( _type )
+    {
+        case Notification::Type_ValueRemoved:
+            return Removal_Value;
+        case Notification::Type_NodeRemoved:
+            return Removal_Node;
+        case Notification::Type_DriverReset:
+        case Notification::Type_DriverRemoved:
+            return Removal_Home;
+        default:
+            return Removal_None;
+    }
+}
+
 //-----------------------------------------------------------------------------
 // <OnNotification>
 // Callback that is triggered by OpenZWave when a value, group or node changes
@@ -163,9 +826,23 @@ void OnNotification
 {
     bool notify_stomp = true;
     bool send_valueID = false;
+    bool touch_node = true;
+    bool value_unchanged = false;
+    // the value read for Value{Added,Changed,Refreshed}, for --payload
+    ValueState state;
+    int64_t const receivedUs = MetricsNowUs();
+    ScopedLatency timer(g_notificationLatency);
+    g_notificationCounts[std::min<uint32>(_notification->GetType(), c_notificationTypes - 1)].fetch_add(1, boost::memory_order_relaxed);
+    
+    // the network's shard, the notification is handled under its lock
+    // (attaching it to a shard needs all of them)
+    HomeShard* shard = find_shard(_notification->GetHomeId());
+    if (!shard) shard = attach_shard(_notification);
+    shard->m_notifications.fetch_add(1, boost::memory_order_relaxed);
+    shard->m_lastNotificationAt = GetTimestampMs();
     
     // Must do this inside a critical section to avoid conflicts with the main thread
-    g_criticalSection.lock();
+    HomeLock lock(shard, true);
     
     switch( _notification->GetType() )
     {
@@ -176,11 +853,16 @@ void OnNotification
         depending on the complexity of the item being represented.  */
         case Notification::Type_ValueAdded: 
         {
-            if( NodeInfo* nodeInfo = GetNodeInfo( _notification ) )
+            // Add the new value to the node's value list, with its initial value
+            fetch_value( _notification->GetValueID(), state );
+            WriteLock registryLock(shard->m_registryLock);
+            if( ValueRecord* record = shard->m_registry.AddValue( _notification->GetValueID() ) )
             {
-                // Add the new value to the node's value list
-                ValueID v = _notification->GetValueID();
-                nodeInfo->m_values.push_back( v );
+                // a value restored from --snapshot stays (stale) until OpenZWave can read it
+                if( state.m_valid || !record->m_stale )
+                {
+                    record->Update( state, GetTimestampMs() );
+                }
             }
             send_valueID = true;
             break;
@@ -190,28 +872,9 @@ void OnNotification
         This only occurs when a node is removed. */
         case Notification::Type_ValueRemoved:
         {
-            if( NodeInfo* nodeInfo = GetNodeInfo( _notification ) )
-            {
-                // Remove the value from out list
-				for( list<ValueID>::iterator it = nodeInfo->m_values.begin(); it != nodeInfo->m_values.end(); ++it )
-				{
-					if( (*it) == _notification->GetValueID() )
-					{
-						nodeInfo->m_values.erase( it );
-						break;
-					}
-				}
-
-                //~ // Remove the value from out list
-                for( list<ValueID>::iterator it = nodeInfo->m_values.begin(); it != nodeInfo->m_values.end(); ++it )
-                {
-                    if( (*it) == _notification->GetValueID() )
-                    {
-                        nodeInfo->m_values.erase( it );
-                        break;
-                    }
-                }
-            }
+            // Remove the value from our list
+            WriteLock registryLock(shard->m_registryLock);
+            shard->m_registry.RemoveValue( _notification->GetValueID() );
             send_valueID = true;
             break;
         }
@@ -219,6 +882,15 @@ void OnNotification
         /**< A node value has been updated from the Z-Wave network. */
         case Notification::Type_ValueChanged:
         case Notification::Type_ValueRefreshed: {
+            // refresh the cached value
+            fetch_value( _notification->GetValueID(), state );
+            {
+                WriteLock registryLock(shard->m_registryLock);
+                ValueRecord* record = shard->m_registry.GetValue( _notification->GetValueID() );
+                // a refresh that didn't change anything leaves the node's version alone
+                value_unchanged = record && !record->Update( state, GetTimestampMs() );
+                touch_node = !value_unchanged;
+            }
             send_valueID = true;
         /**< The associations for the node have changed. The application 
         should rebuild any group information it holds about the node. */
@@ -237,7 +909,7 @@ void OnNotification
         a Basic_Set command to the controller.  The event value is stored in the notification. */
 /*        case Notification::Type_NodeEvent:
         {
-            if( NodeInfo* nodeInfo = GetNodeInfo( _notification ) )
+            if( NodeInfo* nodeInfo = GetNodeInfo( shard, _notification ) )
             {
                 // One of the node's association groups has changed
                 // TBD...
@@ -252,11 +924,14 @@ void OnNotification
         case Notification::Type_NodeAdded:
         {
             // Add the new node to our list
-            NodeInfo* nodeInfo = new NodeInfo();
-            nodeInfo->m_homeId = _notification->GetHomeId();
-            nodeInfo->m_nodeId = _notification->GetNodeId();
-            nodeInfo->m_polled = false;		
-            g_nodes.push_back( nodeInfo );
+            WriteLock registryLock(shard->m_registryLock);
+            NodeInfo* nodeInfo = shard->m_registry.AddNode( _notification->GetHomeId(), _notification->GetNodeId() );
+            if( nodeInfo->m_stale )
+            {
+                // restored from --snapshot, from now on OpenZWave knows better
+                nodeInfo->m_stale = false;
+                shard->m_warmNodes.erase( nodeInfo->m_nodeId );
+            }
             break;
         }
 
@@ -264,18 +939,9 @@ void OnNotification
         to a device being removed from the Z-Wave network, or because the application is closing. */
         case Notification::Type_NodeRemoved:
         {
-            // Remove the node from our list
-            uint32 const homeId = _notification->GetHomeId();
-            uint8 const nodeId = _notification->GetNodeId();
-            for( list<NodeInfo*>::iterator it = g_nodes.begin(); it != g_nodes.end(); ++it )
-            {
-                NodeInfo* nodeInfo = *it;
-                if( ( nodeInfo->m_homeId == homeId ) && ( nodeInfo->m_nodeId == nodeId ) )
-                {
-                    g_nodes.erase( it );
-                    break;
-                }
-            }
+            // Remove the node (and all of its values) from our list
+            WriteLock registryLock(shard->m_registryLock);
+            shard->m_registry.RemoveNode( _notification->GetHomeId(), _notification->GetNodeId() );
             break;
         }
 
@@ -284,7 +950,8 @@ void OnNotification
         /**< Polling of a node has been successfully turned off by a call to Manager::DisablePoll */
         case Notification::Type_PollingDisabled:
         {
-            if( NodeInfo* nodeInfo = GetNodeInfo( _notification ) )
+            WriteLock registryLock(shard->m_registryLock);
+            if( NodeInfo* nodeInfo = GetNodeInfo( shard, _notification ) )
             {
                 nodeInfo->m_polled = false;
             }
@@ -294,7 +961,8 @@ void OnNotification
         /**< Polling of a node has been successfully turned on by a call to Manager::EnablePoll */
         case Notification::Type_PollingEnabled:
         {
-            if( NodeInfo* nodeInfo = GetNodeInfo( _notification ) )
+            WriteLock registryLock(shard->m_registryLock);
+            if( NodeInfo* nodeInfo = GetNodeInfo( shard, _notification ) )
             {
                 nodeInfo->m_polled = true;
             }
@@ -305,86 +973,1177 @@ void OnNotification
         will contain the controller's Home ID, which is needed to call most of the Manager methods. */
         case Notification::Type_DriverReady:
         {
-            g_homeId = _notification->GetHomeId();
-            initCond.notify_all();
+            // attach_shard() gave the shard its homeId
+            start_publisher(shard);
+            set_driver_state(shard, Driver_Ready);
             break;
         }
 
         /**< Driver failed to load */
         case Notification::Type_DriverFailed:
         {
-            g_initFailed = true;
-            initCond.notify_all();
+            set_driver_state(shard, Driver_Failed);
             break;
         }
         
-        //missing Type_DriverReset:  < All nodes and values for this driver have been removed.  This is sent instead of potentially hundreds of individual node and value notifications. */
+        /**< All nodes and values for this driver have been removed.  This is sent instead of 
+        potentially hundreds of individual node and value notifications. */
+        case Notification::Type_DriverReset:
+        {
+            WriteLock registryLock(shard->m_registryLock);
+            shard->m_registry.RemoveHome( _notification->GetHomeId() );
+            shard->m_warmNodes.clear();
+            break;
+        }
+
         //missing MsgComplete  < The last message that was sent is now complete. */
         //missing Type_EssentialNodeQueriesComplete,	/**< The queries on a node that are essential to its operation have been completed. The node can now handle incoming messages. */
         //missing Type_NodeQueriesComplete,			/**< All the initialisation queries on a node have been completed. */
         
         /*< All awake nodes have been queried, so client application can expected complete data for these nodes. */
         case Notification::Type_AwakeNodesQueried:        
-        /**< All nodes have been queried, so client application can expected complete data. */
-        case Notification::Type_AllNodesQueried:
         {
                 //initCond.notify_all();
                 break;
         }
 
+        /**< All nodes have been queried, so client application can expected complete data. */
+        case Notification::Type_AllNodesQueried:
         case Notification::Type_AllNodesQueriedSomeDead:
         {
             // TODO: mark dead nodes for deletion?
-                //initCond.notify_all();
-                break;
+            // what --snapshot had but OpenZWave didn't report is gone
+            prune_warm_registry( shard, _notification->GetHomeId() );
+            break;
         }
             
         default:
         	break;
     }
+
+    // GetNetworkTopology reads the neighbor lists again
+    if (topology_changed(_notification->GetType())) {
+        shard->m_topologyVersion.fetch_add(1);
+    }
+
+    // bump the node's version, so that GetNodeSnapshots clients notice the change
+    if (touch_node) {
+        WriteLock registryLock(shard->m_registryLock);
+        if( NodeInfo* nodeInfo = GetNodeInfo( shard, _notification ) )
+        {
+            shard->m_registry.Touch( nodeInfo );
+        }
+    }
     
-    // now we can send the captured event to STOMP queue
-    //
-    if (notify_stomp) {
-        STOMP::hdrmap headers;
-        headers["NotificationNodeId"] = to_string<uint16_t>(_notification->GetNodeId(), std::hex);
-        headers["NotificationType"] =  to_string<uint32_t>(_notification->GetType(), std::hex);
-        headers["NotificationByte"] =  to_string<uint16_t>(_notification->GetByte(), std::hex);
+    // number the notification and hand it over to the long-poll ring, in
+    // the same order for all networks
+    NotificationPublisher* const publisher = shard->m_publisher;
+    RemoteNotification* msg = NULL;
+    if (notify_stomp && (g_ring || g_capture || (publisher && (payloadFormat != Payload_Headers)))) {
+        msg = &NotificationEncoder::Get().Message();
+        msg->m_type = _notification->GetType();
+        msg->m_homeId = _notification->GetHomeId();
+        msg->m_nodeId = _notification->GetNodeId();
+        msg->m_byte = _notification->GetByte();
+        msg->m_timestamp = GetTimestampMs();
         if (send_valueID) {
-            headers["HomeID"] =  to_string<uint32_t>(_notification->GetValueID().GetHomeId(), std::hex);
-            headers["ValueID"] =  to_string<uint64_t>(_notification->GetValueID().GetId(), std::hex);
+            msg->m_valueId = RemoteValueID(_notification->GetValueID());
+            msg->__isset.m_valueId = true;
+            if (state.m_valid) {
+                fill_remote_value(msg->m_value, state, _notification->GetValueID().GetType());
+                msg->__isset.m_value = true;
+            }
         }
+    }
+    uint64 sequence;
+    {
+        boost::lock_guard<boost::mutex> sequenceLock(g_sequenceMutex);
+        sequence = ++g_sequence;
+        if (msg) {
+            msg->m_sequence = sequence;
+            if (g_ring) g_ring->Push(*msg);
+        }
+    }
+    
+    lock.unlock();
+    
+    if (g_capture && msg) g_capture->Record(*msg);
+    
+    // numeric values that were added or changed go into the history
+    double sample;
+    if (g_history && state.m_valid && !value_unchanged &&
+        history_sample(state, _notification->GetValueID().GetType(), sample)) {
+        g_history->Append(_notification->GetHomeId(), _notification->GetValueID().GetId(), GetTimestampMs(), sample);
+    }
+    
+    // now we can hand the captured event over to the network's STOMP
+    // publisher thread
+    //
+    if (notify_stomp && publisher) {
+        // a recycled event: its strings keep their buffers, so that a
+        // steady stream of value updates allocates nothing here
+        StompEvent* event = publisher->Acquire();
+        event->m_receivedUs = receivedUs;
+        if (payloadFormat != Payload_Headers) {
+            NotificationEncoder::Get().Encode(event);
+        } else {
+            STOMP::hdrmap& headers = event->m_headers;
+            set_hex_header(headers, c_nodeIdHeader, _notification->GetNodeId());
+            set_hex_header(headers, c_typeHeader, _notification->GetType());
+            set_hex_header(headers, c_byteHeader, _notification->GetByte());
+            set_hex_header(headers, c_sequenceHeader, sequence);
+            if (send_valueID) {
+                set_hex_header(headers, c_homeIdHeader, _notification->GetValueID().GetHomeId());
+                set_hex_header(headers, c_valueIdHeader, _notification->GetValueID().GetId());
+            } else {
+                headers.erase(c_homeIdHeader);
+                headers.erase(c_valueIdHeader);
+            }
+            //
+            if (jsonMessageBody) event->m_body = jsonifyHeaders(headers);
+        }
+        // only plain value updates may be coalesced, never adds/removals
+        Notification::NotificationType const type = _notification->GetType();
+        event->m_nodeId = _notification->GetNodeId();
+        if ((type == Notification::Type_ValueChanged) || (type == Notification::Type_ValueRefreshed)) {
+            event->m_coalesceKey = _notification->GetValueID().GetId();
+            event->m_unchanged = value_unchanged;
+        }
+        // and updates still waiting aside must not follow the removal of their value
+        event->m_removal = removal_scope(type);
+        if (event->m_removal == Removal_Value) event->m_removedKey = _notification->GetValueID().GetId();
+        // the topics of the routes it matches
+        ValueID const& id = _notification->GetValueID();
+        g_router.Match(_notification->GetHomeId(), _notification->GetNodeId(), (uint8)type, send_valueID,
+                       send_valueID ? id.GetCommandClassId() : 0, send_valueID ? (uint8)id.GetGenre() : 0, event->m_routes);
         //
-        string body = jsonMessageBody ? jsonifyHeaders(headers) : "";
-        //
-        stomp_client->send(*notifications_topic, headers, body);
+        publisher->Publish(event);
+    }
+    
+    // the value a scheduled write was sent to, as the node reports it, and
+    // fresh enough not to be polled for a while
+    if ((_notification->GetType() == Notification::Type_ValueChanged) ||
+        (_notification->GetType() == Notification::Type_ValueRefreshed)) {
+        if (g_writes) g_writes->OnValueReported(_notification->GetHomeId(), _notification->GetValueID().GetId());
+        if (g_poller) g_poller->OnValueReported(_notification->GetHomeId(), _notification->GetValueID().GetId());
+    } else if (g_poller) {
+        // nothing left to poll once the value, its node or its network is gone
+        switch (removal_scope(_notification->GetType())) {
+            case Removal_Value: g_poller->Disable(_notification->GetHomeId(), _notification->GetValueID().GetId()); break;
+            case Removal_Node:  g_poller->DisableNode(_notification->GetHomeId(), _notification->GetNodeId()); break;
+            case Removal_Home:  g_poller->DisableHome(_notification->GetHomeId()); break;
+            default:            break;
+        }
+    }
+}
+
+// Send all known values of a network via its STOMP publisher
+static void send_shard_values(HomeShard* _shard) {
+    NotificationPublisher* const publisher = _shard->m_publisher;
+    if (!publisher) return;
+    // copy the ValueIDs (and their values), then publish without holding the lock
+    vector<ValueID> values;
+    vector<ValueState> states;
+    {
+        ReadLock lock(_shard->m_registryLock);
+        _shard->m_registry.GetValueIDs( values );
+        if (payloadFormat != Payload_Headers) {
+            states.reserve( values.size() );
+            for( vector<ValueID>::iterator val_iter = values.begin(); val_iter != values.end(); ++val_iter )
+            {
+                states.push_back( _shard->m_registry.GetValue( *val_iter )->m_state );
+            }
+        }
     }
     //
-    g_criticalSection.unlock();
+    for( size_t i = 0; i < values.size(); i++ )
+    {
+        ValueID const& v = values[i];
+        StompEvent* event = new StompEvent();
+        if (payloadFormat != Payload_Headers) {
+            // sent as a refresh of the value
+            NotificationEncoder& encoder = NotificationEncoder::Get();
+            RemoteNotification& msg = encoder.Message();
+            msg.m_type = Notification::Type_ValueRefreshed;
+            msg.m_homeId = v.GetHomeId();
+            msg.m_nodeId = v.GetNodeId();
+            msg.m_byte = 0;
+            msg.m_timestamp = GetTimestampMs();
+            msg.m_sequence = 0;
+            msg.m_valueId = RemoteValueID(v);
+            msg.__isset.m_valueId = true;
+            if (states[i].m_valid) {
+                fill_remote_value(msg.m_value, states[i], v.GetType());
+                msg.__isset.m_value = true;
+            }
+            encoder.Encode(event);
+        } else {
+            event->m_headers["HomeID"] =  to_string<uint32_t>(v.GetHomeId(), std::hex);
+            event->m_headers["ValueID"] =  to_string<uint64_t>(v.GetId(), std::hex);
+            //
+            if (jsonMessageBody) event->m_body = jsonifyHeaders(event->m_headers);
+        }
+        g_router.Match(v.GetHomeId(), v.GetNodeId(), (uint8)Notification::Type_ValueRefreshed, true,
+                       v.GetCommandClassId(), (uint8)v.GetGenre(), event->m_routes);
+        publisher->Publish(event);
+    }
 }
 
 // Send all known values via STOMP
 void send_all_values() {
+    for (vector<HomeShard*>::const_iterator it = g_shards.begin(); it != g_shards.end(); ++it) {
+        send_shard_values(*it);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// <fill_cached_value>
+// Copy a value cache record into its Thrift representation
+//-----------------------------------------------------------------------------
+static void fill_cached_value
+(
+	CachedValue& _value,
+	ValueRecord const* _record
+)
+{
+	ValueState const& state = _record->m_state;
+	_value.retval = state.m_valid;
+	_value.m_changedAt = _record->m_changedAt;
+	_value.m_refreshedAt = _record->m_refreshedAt;
+	_value.m_stale = _record->m_stale;
+	if( !state.m_valid )
+	{
+		return;
+	}
+	fill_remote_value( _value.o_value, state, _record->m_id.GetType() );
+}
+
+// GetValues: the cached values of a batch of ValueIDs, in request order
+// (retval is false for unknown ValueIDs and values never read successfully)
+void get_cached_values(std::vector<CachedValue>& _return, std::vector<RemoteValueID> const& _ids) {
+    _return.resize(_ids.size());
+    for (size_t i = 0; i < _ids.size(); i++) {
+        _return[i]._id = _ids[i];
+        _return[i].retval = false;
+    }
+    // one pass (and lock acquisition) per network
+    for (vector<HomeShard*>::const_iterator it = g_shards.begin(); it != g_shards.end(); ++it) {
+        uint32 const homeId = (*it)->m_homeId;
+        if (!homeId) continue;
+        ReadLock lock((*it)->m_registryLock);
+        for (size_t i = 0; i < _ids.size(); i++) {
+            if ((uint32)_ids[i]._homeId != homeId) continue;
+            if (ValueRecord const* record = (*it)->m_registry.GetValue(_ids[i].toValueID())) {
+                fill_cached_value(_return[i], record);
+            }
+        }
+    }
+}
+
+// GetAllValuesForNode: the cached values of all of a node's ValueIDs
+void get_node_cached_values(std::vector<CachedValue>& _return, int32_t _homeId, int8_t _nodeId) {
+    HomeShard* shard = find_shard((uint32)_homeId);
+    if (!shard) return;
+    ReadLock lock(shard->m_registryLock);
+    NodeInfo const* nodeInfo = shard->m_registry.GetNode((uint32)_homeId, (uint8)_nodeId);
+    if (!nodeInfo) return;
+    _return.resize(nodeInfo->m_valueCount);
+    size_t i = 0;
+    for (ValueRecord const* record = nodeInfo->m_values; record; record = record->m_next, i++) {
+        _return[i]._id = RemoteValueID(record->m_id);
+        fill_cached_value(_return[i], record);
+    }
+}
+
+// GetValuesPage: a page of a network's cached values, _cursor being the
+// m_nextCursor of the previous page (0 for the first one)
+void get_values_page(ValuesPage& _return, int32_t _homeId, int64_t _cursor, int32_t _limit) {
+    vector<ValueRecord const*> page;
+    HomeShard* shard = find_shard((uint32)_homeId);
+    if (!shard) {
+        _return.m_sequence = g_sequence;
+        _return.m_more = false;
+        _return.m_nextCursor = _cursor;
+        return;
+    }
+    HomeLock lock(shard, false);
+    ReadLock registryLock(shard->m_registryLock);
+    _return.m_sequence = g_sequence;
+    _return.m_more = shard->m_registry.GetValuesPage((uint32)_homeId, (uint64)_cursor, (_limit > 0) ? _limit : 1, page);
+    _return.m_nextCursor = page.empty() ? _cursor : (int64_t)page.back()->m_id.GetId();
+    _return.m_values.resize(page.size());
+    for (size_t i = 0; i < page.size(); i++) {
+        _return.m_values[i]._id = RemoteValueID(page[i]->m_id);
+        fill_cached_value(_return.m_values[i], page[i]);
+    }
+}
+
+// a snapshot marker: no body, only headers
+static void publish_snapshot_marker(NotificationPublisher* _publisher, uint32 const _homeId, char const* _marker, uint64 const _sequence, size_t const _values, size_t const _chunks) {
+    StompEvent* event = new StompEvent();
+    event->m_headers["Snapshot"] = _marker;
+    event->m_headers["HomeID"] = to_string<uint32_t>(_homeId, std::hex);
+    event->m_headers["SnapshotSequence"] = to_string<uint64_t>(_sequence, std::hex);
+    event->m_headers["SnapshotValues"] = to_string<uint32_t>(_values, std::hex);
+    event->m_headers["SnapshotChunks"] = to_string<uint32_t>(_chunks, std::hex);
+    _publisher->Publish(event);
+}
+
+// the value snapshot of one network, on its publisher; returns its sequence
+static int64_t send_shard_snapshot(HomeShard* _shard, size_t const _chunkSize) {
+    NotificationPublisher* const publisher = _shard->m_publisher;
+    if (!publisher) return -1;
+    uint32 const homeId = _shard->m_homeId;
+    vector<ValuesSnapshotChunk> chunks;
+    uint64 sequence;
+    size_t count;
+    {
+        HomeLock lock(_shard, false);
+        ReadLock registryLock(_shard->m_registryLock);
+        sequence = g_sequence;
+        count = _shard->m_registry.GetValueCount();
+        chunks.resize((count + _chunkSize - 1) / _chunkSize);
+        vector<NodeInfo*> nodes;
+        _shard->m_registry.GetNodes(nodes);
+        size_t i = 0;
+        for (vector<NodeInfo*>::iterator it = nodes.begin(); it != nodes.end(); ++it) {
+            for (ValueRecord const* record = (*it)->m_values; record; record = record->m_next, i++) {
+                ValuesSnapshotChunk& chunk = chunks[i / _chunkSize];
+                if (chunk.m_values.empty()) chunk.m_values.reserve(std::min(_chunkSize, count - i));
+                chunk.m_values.push_back(CachedValue());
+                chunk.m_values.back()._id = RemoteValueID(record->m_id);
+                fill_cached_value(chunk.m_values.back(), record);
+            }
+        }
+    }
     //
-    g_criticalSection.lock();
-    //
-    for( list<NodeInfo*>::iterator node_it = g_nodes.begin(); node_it != g_nodes.end(); ++node_it )
+    publish_snapshot_marker(publisher, homeId, "begin", sequence, count, chunks.size());
+    NotificationEncoder& encoder = NotificationEncoder::Get();
+    for (size_t i = 0; i < chunks.size(); i++) {
+        chunks[i].m_sequence = sequence;
+        chunks[i].m_chunk = i;
+        StompEvent* event = new StompEvent();
+        event->m_headers["Snapshot"] = "chunk";
+        event->m_headers["HomeID"] = to_string<uint32_t>(homeId, std::hex);
+        event->m_headers["SnapshotSequence"] = to_string<uint64_t>(sequence, std::hex);
+        event->m_headers["SnapshotChunk"] = to_string<uint32_t>(i, std::hex);
+        encoder.Encode(chunks[i], event);
+        publisher->Publish(event);
+        // the chunk is serialized, don't hold on to its values
+        vector<CachedValue>().swap(chunks[i].m_values);
+    }
+    publish_snapshot_marker(publisher, homeId, "end", sequence, count, chunks.size());
+    return sequence;
+}
+
+// SendValuesSnapshot: for each network, copy all cached values (consistent
+// with notification _sequence) in one go, then publish them on the
+// network's topic outside of the locks as
+//   Snapshot:begin, Snapshot:chunk * n (ValuesSnapshotChunk bodies), Snapshot:end
+// Clients apply the chunks, then the live notifications numbered above the
+// snapshot's sequence. Returns the highest sequence of these snapshots.
+// Chunks hold at most c_maxSnapshotChunk values, a larger _chunkSize is
+// lowered to that.
+static int32_t const c_maxSnapshotChunk = 4096;
+int64_t send_values_snapshot(int32_t _chunkSize) {
+    size_t const chunkSize = std::min(std::max<int32_t>(_chunkSize, 1), c_maxSnapshotChunk);
+    int64_t sequence = -1;
+    for (vector<HomeShard*>::const_iterator it = g_shards.begin(); it != g_shards.end(); ++it) {
+        sequence = std::max(sequence, send_shard_snapshot(*it, chunkSize));
+    }
+    return sequence;
+}
+
+// GetValueHistory: the recorded samples of a value in [_from, _to] (ms since
+// the epoch), at most _maxPoints of them (the latest ones)
+void get_value_history(ValueHistory& _return, RemoteValueID const& _valueId, int64_t _from, int64_t _to, int32_t _maxPoints) {
+    _return.retval = (g_history != NULL);
+    _return.m_truncated = false;
+    if (!g_history || (_maxPoints <= 0) || (_from < 0) || (_to < 0)) return;
+    vector<HistoryPoint> points;
+    ValueID const id = _valueId.toValueID();
+    _return.m_truncated = g_history->GetHistory(id.GetHomeId(), id.GetId(), _from, _to, _maxPoints, points);
+    _return.m_timestamps.resize(points.size());
+    _return.m_values.resize(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+        _return.m_timestamps[i] = points[i].m_timestamp;
+        _return.m_values[i] = points[i].m_value;
+    }
+}
+
+// GetValueHistoryAggregate: [_from, _to] split into _buckets time buckets
+// (none above HistoryStore::c_maxBuckets, every bucket is allocated up front)
+void get_value_history_aggregate(std::vector<HistoryBucket>& _return, RemoteValueID const& _valueId, int64_t _from, int64_t _to, int32_t _buckets) {
+    if (!g_history || (_buckets <= 0) || ((uint32_t)_buckets > HistoryStore::c_maxBuckets) || (_from < 0) || (_to < 0)) return;
+    vector<HistoryAggregate> aggregates;
+    ValueID const id = _valueId.toValueID();
+    g_history->GetAggregate(id.GetHomeId(), id.GetId(), _from, _to, _buckets, aggregates);
+    _return.resize(aggregates.size());
+    for (size_t i = 0; i < aggregates.size(); i++) {
+        HistoryAggregate const& aggregate = aggregates[i];
+        _return[i].m_start = aggregate.m_start;
+        _return[i].m_count = aggregate.m_count;
+        _return[i].m_min = aggregate.m_min;
+        _return[i].m_max = aggregate.m_max;
+        _return[i].m_avg = aggregate.m_count ? aggregate.m_sum / aggregate.m_count : 0;
+        _return[i].m_last = aggregate.m_last;
+    }
+}
+
+// WaitForNotifications: long-poll for the notifications numbered above
+// _sinceSeq of process _epoch; returns as soon as there is at least one, or
+// after _timeoutMs (at most c_maxWaitMs, a waiting client ties up a server
+// worker thread)
+static int32_t const c_maxWaitMs = 60000;
+void wait_for_notifications(NotificationBatch& _return, int64_t _sinceSeq, int32_t _maxBatch, int32_t _timeoutMs, int64_t _epoch) {
+    _return.retval = (g_ring != NULL);
+    _return.m_complete = true;
+    _return.m_lastSequence = _sinceSeq;
+    _return.m_epoch = 0;
+    if (!g_ring) return;
+    _return.m_epoch = g_ring->GetEpoch();
+    uint32 const maxBatch = (_maxBatch > 0) ? _maxBatch : 1;
+    uint32 const timeout = std::min<int32_t>(std::max<int32_t>(_timeoutMs, 0), c_maxWaitMs);
+    uint64_t since = (_sinceSeq > 0) ? _sinceSeq : 0;
+    _return.m_complete = g_ring->Wait((_epoch > 0) ? _epoch : 0, since, maxBatch, timeout, _return.m_notifications);
+    _return.m_lastSequence = since;
+    if (!_return.m_notifications.empty()) {
+        _return.m_lastSequence = _return.m_notifications.back().m_sequence;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// <fill_node_snapshot>
+// Gather everything about a node (the caller holds the network's HomeLock
+// and m_registryLock)
+//-----------------------------------------------------------------------------
+static void fill_node_snapshot
+(
+	NodeSnapshot& _snapshot,
+	HomeShard const* _shard,
+	NodeInfo const* _nodeInfo
+)
+{
+	Manager* mgr = Manager::Get();
+	uint32 const homeId = _nodeInfo->m_homeId;
+	uint8 const nodeId = _nodeInfo->m_nodeId;
+
+	if( _nodeInfo->m_stale )
 	{
-		NodeInfo* nodeInfo = *node_it;
-        
-		for( list<ValueID>::iterator val_iter = nodeInfo->m_values.begin(); val_iter != nodeInfo->m_values.end(); ++val_iter )
+		// OpenZWave doesn't know the node (yet), what --snapshot had is all there is
+		std::map<uint8, NodeSnapshot>::const_iterator it = _shard->m_warmNodes.find( nodeId );
+		if( it != _shard->m_warmNodes.end() )
 		{
-			ValueID v = *val_iter;
-            STOMP::hdrmap headers;
-            headers["HomeID"] =  to_string<uint32_t>(v.GetHomeId(), std::hex);
-            headers["ValueID"] =  to_string<uint64_t>(v.GetId(), std::hex);
-            //
-            string response = jsonMessageBody ? jsonifyHeaders(headers) : "";
-            stomp_client->send(*notifications_topic, headers,response );         
+			_snapshot = it->second;
 		}
+		_snapshot.m_nodeId = (int8_t)nodeId;
+		_snapshot.retval = true;
+		_snapshot.m_version = _nodeInfo->m_version;
+		_snapshot.m_stale = true;
+		return;
+	}
+	_snapshot.m_nodeId = (int8_t)nodeId;
+	_snapshot.retval = true;
+	_snapshot.m_version = _nodeInfo->m_version;
+	_snapshot.m_stale = false;
+	_snapshot.m_type = mgr->GetNodeType( homeId, nodeId );
+	_snapshot.m_manufacturerName = mgr->GetNodeManufacturerName( homeId, nodeId );
+	_snapshot.m_productName = mgr->GetNodeProductName( homeId, nodeId );
+	_snapshot.m_name = mgr->GetNodeName( homeId, nodeId );
+	_snapshot.m_location = mgr->GetNodeLocation( homeId, nodeId );
+	_snapshot.m_basic = (int8_t)mgr->GetNodeBasic( homeId, nodeId );
+	_snapshot.m_generic = (int8_t)mgr->GetNodeGeneric( homeId, nodeId );
+	_snapshot.m_specific = (int8_t)mgr->GetNodeSpecific( homeId, nodeId );
+	_snapshot.m_listening = mgr->IsNodeListeningDevice( homeId, nodeId );
+
+	uint8* neighbors = NULL;
+	uint32 const count = mgr->GetNodeNeighbors( homeId, nodeId, &neighbors );
+	if( neighbors )
+	{
+		_snapshot.m_neighbors.assign( neighbors, neighbors + count );
+		delete [] neighbors;
+	}
+
+	Node::NodeData data;
+	mgr->GetNodeStatistics( homeId, nodeId, &data );
+	NodeData& stats = _snapshot.m_statistics;
+	stats.m_sentCnt = data.m_sentCnt;
+	stats.m_sentFailed = data.m_sentFailed;
+	stats.m_retries = data.m_retries;
+	stats.m_receivedCnt = data.m_receivedCnt;
+	stats.m_receivedDups = data.m_receivedDups;
+	stats.m_rtt = data.m_rtt;
+	stats.m_sentTS = data.m_sentTS;
+	stats.m_receivedTS = data.m_receivedTS;
+	stats.m_lastRTT = data.m_lastRTT;
+	stats.m_averageRTT = data.m_averageRTT;
+	stats.m_quality = (int8_t)data.m_quality;
+	stats.m_lastReceivedMessage.assign( data.m_lastReceivedMessage, data.m_lastReceivedMessage + sizeof(data.m_lastReceivedMessage) );
+	for( std::list<Node::CommandClassData>::const_iterator it = data.m_ccData.begin(); it != data.m_ccData.end(); ++it )
+	{
+		CommandClassData ccData;
+		ccData.m_commandClassId = (int8_t)it->m_commandClassId;
+		ccData.m_sentCnt = it->m_sentCnt;
+		ccData.m_receivedCnt = it->m_receivedCnt;
+		stats.m_ccData.push_back( ccData );
+	}
+}
+
+// GetNodeSnapshots: node metadata, neighbors and statistics of a batch of
+// nodes (all known nodes of the network if _nodeIds is empty), gathered
+// under a single acquisition of the network's OpenZWave lock
+void get_node_snapshots(std::vector<NodeSnapshot>& _return, int32_t _homeId, std::vector<int8_t> const& _nodeIds) {
+    HomeShard* shard = find_shard((uint32)_homeId);
+    if (!shard) {
+        // none of the nodes of an unknown network is known
+        _return.resize(_nodeIds.size());
+        for (size_t i = 0; i < _nodeIds.size(); i++) {
+            _return[i].m_nodeId = _nodeIds[i];
+            _return[i].retval = false;
+        }
+        return;
+    }
+    HomeLock lock(shard, false);
+    ReadLock registryLock(shard->m_registryLock);
+    vector<NodeInfo*> nodes;
+    if (_nodeIds.empty()) {
+        // the shard's registry only holds this network
+        shard->m_registry.GetNodes(nodes);
+    } else {
+        for (size_t i = 0; i < _nodeIds.size(); i++) {
+            nodes.push_back(shard->m_registry.GetNode((uint32)_homeId, (uint8)_nodeIds[i]));
+        }
+    }
+    _return.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i]) {
+            fill_node_snapshot(_return[i], shard, nodes[i]);
+        } else {
+            _return[i].m_nodeId = _nodeIds[i];
+            _return[i].retval = false;
+        }
+    }
+}
+
+// --snapshot: the registry (nodes, their metadata and the last known values)
+// is saved periodically and at shutdown, and loaded at startup, so that the
+// Thrift interface can serve the last known state, marked stale, while
+// OpenZWave interviews the network again
+static int32_t const c_snapshotVersion = 1;
+static char const    c_snapshotMagic[4] = { 'O', 'Z', 'W', 'S' };
+static boost::mutex  g_snapshotMutex;       // one save at a time
+static uint64        g_snapshotSequence = 0;    // g_sequence of the last save
+
+// write the snapshot to _path (atomically, through a temporary file); with
+// _ifChanged, only if a notification came in since the last save
+bool save_registry_snapshot(string const& _path, bool _ifChanged) {
+    boost::lock_guard<boost::mutex> saveLock(g_snapshotMutex);
+    RegistrySnapshot snapshot;
+    snapshot.m_version = c_snapshotVersion;
+    snapshot.m_savedAt = GetTimestampMs();
+    // a notification that comes in while saving is in the next save
+    uint64 const sequence = g_sequence;
+    if (_ifChanged && (sequence == g_snapshotSequence)) return true;
+    g_snapshotSequence = sequence;
+    size_t nodeCount = 0, valueCount = 0;
+    // one network at a time
+    for (vector<HomeShard*>::const_iterator shard = g_shards.begin(); shard != g_shards.end(); ++shard) {
+        HomeLock lock(*shard, false);
+        ReadLock registryLock((*shard)->m_registryLock);
+        uint32 const homeId = (*shard)->m_homeId;
+        if (!homeId) continue;
+        nodeCount += (*shard)->m_registry.GetNodeCount();
+        valueCount += (*shard)->m_registry.GetValueCount();
+        snapshot.m_homes.push_back(HomeSnapshot());
+        HomeSnapshot& home = snapshot.m_homes.back();
+        home.m_homeId = (int32_t)homeId;
+        home.m_controllerPath = (*shard)->m_port;
+        vector<NodeInfo*> nodes;
+        (*shard)->m_registry.GetNodes(nodes);
+        for (vector<NodeInfo*>::iterator it = nodes.begin(); it != nodes.end(); ++it) {
+            home.m_nodes.push_back(NodeSnapshot());
+            fill_node_snapshot(home.m_nodes.back(), *shard, *it);
+            for (ValueRecord const* record = (*it)->m_values; record; record = record->m_next) {
+                home.m_values.push_back(CachedValue());
+                home.m_values.back()._id = RemoteValueID(record->m_id);
+                fill_cached_value(home.m_values.back(), record);
+                if ((record->m_id.GetType() == ValueID::ValueType_List) && record->m_state.m_valid) {
+                    home.m_listIndexes[(int64_t)record->m_id.GetId()] = record->m_state.m_int;
+                }
+            }
+        }
+    }
+    // serialize and write without holding the locks
+    try {
+        shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+        TCompactProtocol protocol(buffer);
+        snapshot.write(&protocol);
+        uint8_t* data;
+        uint32_t size;
+        buffer->getBuffer(&data, &size);
+        string const temp = _path + ".tmp";
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw runtime_error("can't create " + temp + ": " + strerror(errno));
+        bool ok = (write(fd, c_snapshotMagic, sizeof(c_snapshotMagic)) == (ssize_t)sizeof(c_snapshotMagic)) &&
+                  (write(fd, data, size) == (ssize_t)size) && (fsync(fd) == 0);
+        ok = (close(fd) == 0) && ok;
+        if (!ok || (rename(temp.c_str(), _path.c_str()) != 0)) {
+            unlink(temp.c_str());
+            throw runtime_error("can't write " + _path + ": " + strerror(errno));
+        }
+        if (debugMsg) {
+            cout << "Saved " << nodeCount << " nodes and " << valueCount << " values to " << _path << " (" << size << " bytes)" << endl;
+        }
+    }
+    catch (exception& e)
+    {
+        cerr << "saving the registry snapshot: " << e.what() << endl;
+        return false;
+    }
+    return true;
+}
+
+// restore the registry from _path, every node and value marked stale;
+// returns false (and leaves the registry empty) if there is no usable snapshot
+bool load_registry_snapshot(string const& _path) {
+    RegistrySnapshot snapshot;
+    try {
+        std::ifstream file(_path.c_str(), std::ios::binary);
+        if (!file) return false;
+        string const content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if ((content.size() < sizeof(c_snapshotMagic)) || (content.compare(0, sizeof(c_snapshotMagic), c_snapshotMagic, sizeof(c_snapshotMagic)) != 0)) {
+            throw runtime_error("not an ozwd snapshot");
+        }
+        shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer(
+            (uint8_t*)content.data() + sizeof(c_snapshotMagic), (uint32_t)(content.size() - sizeof(c_snapshotMagic))));
+        TCompactProtocol protocol(buffer);
+        snapshot.read(&protocol);
+        if (snapshot.m_version != c_snapshotVersion) {
+            throw runtime_error("unsupported snapshot version " + boost::lexical_cast<string>(snapshot.m_version));
+        }
+    }
+    catch (exception& e)
+    {
+        cerr << "ignoring " << _path << ": " << e.what() << endl;
+        return false;
+    }
+
+    // match the networks to the shards first: a shard only gets its homeId
+    // (this runs before OpenZWave starts) once the snapshot is known usable
+    vector<pair<HomeShard*, HomeSnapshot const*> > matches;
+    for (vector<HomeSnapshot>::const_iterator home = snapshot.m_homes.begin(); home != snapshot.m_homes.end(); ++home) {
+        // no homeId, or no nodes to hang the values on: nothing to restore
+        if (!home->m_homeId || home->m_nodes.empty()) continue;
+        HomeShard* shard = NULL;
+        for (vector<HomeShard*>::const_iterator it = g_shards.begin(); !shard && (it != g_shards.end()); ++it) {
+            // a snapshot of a single network that doesn't name its port is that of the one --ozwport
+            if (((*it)->m_port == home->m_controllerPath) || (home->m_controllerPath.empty() && (g_shards.size() == 1))) {
+                shard = *it;
+            }
+        }
+        for (size_t i = 0; shard && (i < matches.size()); i++) {
+            if (matches[i].first == shard) shard = NULL;
+        }
+        if (!shard) {
+            cout << "Warm start: skipping network " << to_string<uint32_t>((uint32)home->m_homeId, std::hex) << " of " << _path
+                 << ", no free --ozwport for its controller (" << home->m_controllerPath << ")" << endl;
+            continue;
+        }
+        matches.push_back(make_pair(shard, &*home));
+    }
+    if (matches.empty()) return false;
+
+    size_t nodeCount = 0, valueCount = 0;
+    for (size_t i = 0; i < matches.size(); i++) {
+        HomeShard* const shard = matches[i].first;
+        HomeSnapshot const* const home = matches[i].second;
+        uint32 const homeId = (uint32)home->m_homeId;
+        WriteLock registryLock(shard->m_registryLock);
+        for (vector<NodeSnapshot>::const_iterator node = home->m_nodes.begin(); node != home->m_nodes.end(); ++node) {
+            NodeInfo* nodeInfo = shard->m_registry.AddNode(homeId, (uint8)node->m_nodeId);
+            nodeInfo->m_stale = true;
+            shard->m_warmNodes[(uint8)node->m_nodeId] = *node;
+        }
+        for (vector<CachedValue>::const_iterator value = home->m_values.begin(); value != home->m_values.end(); ++value) {
+            ValueID const id = value->_id.toValueID();
+            ValueRecord* record = shard->m_registry.AddValue(id);
+            if (!record) continue;
+            map<int64_t, int32_t>::const_iterator listIndex = home->m_listIndexes.find((int64_t)id.GetId());
+            read_remote_value(record->m_state, value->o_value, id.GetType(),
+                (listIndex != home->m_listIndexes.end()) ? listIndex->second : 0);
+            record->m_state.m_valid = value->retval;
+            record->m_changedAt = value->m_changedAt;
+            record->m_refreshedAt = value->m_refreshedAt;
+            record->m_stale = true;
+        }
+        nodeCount += shard->m_registry.GetNodeCount();
+        valueCount += shard->m_registry.GetValueCount();
+        shard->m_homeId = homeId;
+    }
+    cout << "Warm start: " << nodeCount << " nodes and " << valueCount
+         << " values from " << _path << " (saved " << (GetTimestampMs() - snapshot.m_savedAt) / 1000 << "s ago)" << endl;
+    return true;
+}
+
+// --snapshotinterval: save every _intervalSec seconds, if anything changed
+static void snapshot_thread(string _path, int _intervalSec) {
+    for (;;) {
+        boost::this_thread::sleep(boost::posix_time::seconds(_intervalSec));
+        save_registry_snapshot(_path, true);
+    }
+}
+
+// join the poller, write and publisher threads (the publishers send what
+// they still hold) and flush the capture file; anything not started yet is
+// skipped
+static void stop_workers() {
+    if (g_poller) g_poller->Stop();
+    if (g_writes) g_writes->Stop();
+    for (vector<HomeShard*>::iterator it = g_shards.begin(); it != g_shards.end(); ++it) {
+        if (NotificationPublisher* publisher = (*it)->m_publisher) publisher->Stop();
+    }
+    if (g_capture) g_capture->Flush();
+}
+
+// the Thrift servers, once main() created them, for shutdown_thread to stop
+static boost::mutex                 g_shutdownMutex;
+static vector< shared_ptr<TServer> > g_servers;                // guarded by g_shutdownMutex
+static bool                         g_shutdownRequested = false; // guarded by g_shutdownMutex
+// set by whoever tears down: main() once its server returned, or
+// shutdown_thread when that takes too long
+static boost::atomic<bool>          g_tearingDown(false);
+static int const                    c_shutdownGraceSec = 10;
+
+// with --snapshot, SIGINT and SIGTERM stop the Thrift servers, upon which
+// main() saves the snapshot and tears everything down, OpenZWave included.
+// If main() doesn't get there within c_shutdownGraceSec (a client
+// connection keeping a server busy, OpenZWave still initializing), this
+// saves the snapshot, stops the workers and leaves with _exit: other
+// threads are still running, static destructors must not. (The signals
+// are blocked in every other thread.)
+static void shutdown_thread(string _path, sigset_t _signals) {
+    int sig = 0;
+    sigwait(&_signals, &sig);
+    cout << "Caught signal " << sig << ", shutting down" << endl;
+    {
+        boost::lock_guard<boost::mutex> lock(g_shutdownMutex);
+        g_shutdownRequested = true;
+        for (size_t i = 0; i < g_servers.size(); i++) g_servers[i]->stop();
+    }
+    for (int i = 0; (i < c_shutdownGraceSec * 10) && !g_tearingDown; i++) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    }
+    if (g_tearingDown.exchange(true)) return;
+    cout << "Not stopped after " << c_shutdownGraceSec << "s, saving the registry snapshot and exiting" << endl;
+    save_registry_snapshot(_path, false);
+    stop_workers();
+    cout.flush();
+    _exit(0);
+}
+
+// add the statistics of a network's STOMP publisher to _total, false if it
+// has none
+static bool add_publisher_statistics(PublisherStatistics& _total, HomeShard const* _shard) {
+    NotificationPublisher* const publisher = _shard->m_publisher;
+    if (!publisher) return false;
+    PublisherStatistics stats = PublisherStatistics();
+    publisher->GetStatistics(stats);
+    _total.m_capacity += stats.m_capacity;
+    _total.m_depth += stats.m_depth;
+    _total.m_maxDepth = std::max(_total.m_maxDepth, stats.m_maxDepth);
+    _total.m_enqueued += stats.m_enqueued;
+    _total.m_published += stats.m_published;
+    _total.m_dropped += stats.m_dropped;
+    _total.m_coalesced += stats.m_coalesced;
+    _total.m_blocked += stats.m_blocked;
+    _total.m_sendFailures += stats.m_sendFailures;
+    _total.m_batches += stats.m_batches;
+    _total.m_rateLimited += stats.m_rateLimited;
+    _total.m_suppressed += stats.m_suppressed;
+    _total.m_sendLatency.Add(stats.m_sendLatency);
+    _total.m_publishLatency.Add(stats.m_publishLatency);
+    return true;
+}
+
+// GetNotificationQueueStatistics: the publisher of a network, or all of
+// them together (_shard NULL); left empty with --nostomp
+void get_queue_statistics(NotificationQueueStatistics& _return, HomeShard const* _shard) {
+    PublisherStatistics stats = PublisherStatistics();
+    bool any = false;
+    for (vector<HomeShard*>::const_iterator it = g_shards.begin(); it != g_shards.end(); ++it) {
+        if (!_shard || (*it == _shard)) any = add_publisher_statistics(stats, *it) || any;
+    }
+    if (!any) return;
+    _return.m_capacity = stats.m_capacity;
+    _return.m_depth = stats.m_depth;
+    _return.m_maxDepth = stats.m_maxDepth;
+    _return.m_overflowPolicy = NotificationPublisher::PolicyName(g_publisherSettings.m_overflow);
+    _return.m_enqueued = stats.m_enqueued;
+    _return.m_published = stats.m_published;
+    _return.m_dropped = stats.m_dropped;
+    _return.m_coalesced = stats.m_coalesced;
+    _return.m_blocked = stats.m_blocked;
+    _return.m_sendFailures = stats.m_sendFailures;
+    _return.m_rateLimited = stats.m_rateLimited;
+    _return.m_suppressed = stats.m_suppressed;
+}
+
+//-----------------------------------------------------------------------------
+// <dispatch_write>
+// WriteScheduler: the Manager::SetValue overload of the value's type, false
+// if the RemoteValue member of that type isn't set
+//-----------------------------------------------------------------------------
+static bool dispatch_write
+(
+	RemoteValueID const& _id,
+	RemoteValue const& _value
+)
+{
+	ValueID const id = _id.toValueID();
+	Manager* mgr = Manager::Get();
+	HomeWriteLock lock(_id._homeId);
+	switch( id.GetType() )
+	{
+		case ValueID::ValueType_Bool:		return _value.__isset.m_bool && mgr->SetValue( id, _value.m_bool );
+		// OpenZWave refuses SetValue on buttons: true presses, false releases
+		case ValueID::ValueType_Button:		return _value.__isset.m_bool && ( _value.m_bool ? mgr->PressButton( id ) : mgr->ReleaseButton( id ) );
+		case ValueID::ValueType_Byte:		return _value.__isset.m_byte && mgr->SetValue( id, (uint8)_value.m_byte );
+		case ValueID::ValueType_Decimal:	return _value.__isset.m_decimal && mgr->SetValue( id, (float)_value.m_decimal );
+		case ValueID::ValueType_Int:		return _value.__isset.m_int && mgr->SetValue( id, (int32)_value.m_int );
+		case ValueID::ValueType_Short:		return _value.__isset.m_short && mgr->SetValue( id, (int16)_value.m_short );
+		case ValueID::ValueType_List:		return _value.__isset.m_listSelection && mgr->SetValueListSelection( id, _value.m_listSelection );
+		case ValueID::ValueType_Raw:
+			// OpenZWave takes an 8-bit length, longer data would be cut short
+			return _value.__isset.m_raw && ( _value.m_raw.size() <= 0xff ) &&
+				mgr->SetValue( id, (uint8 const*)_value.m_raw.data(), (uint8)_value.m_raw.size() );
+		default:							return _value.__isset.m_string && mgr->SetValue( id, _value.m_string );
 	}
-	//
-	g_criticalSection.unlock();
+}
+
+// WriteScheduler admission control: the network's send queue length
+static uint32_t send_queue_depth(uint32_t _homeId) {
+    HomeReadLock lock(_homeId);
+    return (uint32_t)std::max<int32>(Manager::Get()->GetSendQueueCount(_homeId), 0);
+}
+
+// WriteScheduler: publish the progress of a write ticket on its network's topic
+static void report_write(WriteReport const& _report) {
+    HomeShard* const shard = find_shard(_report.m_id._homeId);
+    NotificationPublisher* const publisher = shard ? shard->m_publisher.load() : NULL;
+    if (!publisher) return;
+    StompEvent* event = new StompEvent();
+    STOMP::hdrmap& headers = event->m_headers;
+    headers["WriteTicket"] = to_string<uint64_t>(_report.m_ticket, std::hex);
+    headers["WriteStatus"] = _WriteStatus_VALUES_TO_NAMES.find(_report.m_status)->second;
+    headers["HomeID"] = to_string<uint32_t>(_report.m_id._homeId, std::hex);
+    headers["ValueID"] = to_string<uint64_t>(_report.m_id.toValueID().GetId(), std::hex);
+    if (jsonMessageBody) event->m_body = jsonifyHeaders(headers);
+    publisher->Publish(event);
+}
+
+// AdaptivePoller: poll a value
+static bool poll_value(RemoteValueID const& _id) {
+    HomeWriteLock lock(_id._homeId);
+    return Manager::Get()->RefreshValue(_id.toValueID());
+}
+
+// AdaptivePoller: the message counters of a node
+static bool node_health(uint32_t _homeId, uint8_t _nodeId, AdaptivePoller::NodeHealth& _health) {
+    Node::NodeData data;
+    {
+        HomeReadLock lock(_homeId);
+        if (!find_shard(_homeId)) return false;
+        Manager::Get()->GetNodeStatistics(_homeId, _nodeId, &data);
+    }
+    _health.m_sent = data.m_sentCnt;
+    _health.m_failed = data.m_sentFailed;
+    _health.m_retries = data.m_retries;
+    return true;
+}
+
+// EnableAdaptivePoll: the poller takes over from OpenZWave's polling, and
+// starts from the age of the cached value
+bool enable_adaptive_poll(RemoteValueID const& _valueId, int32_t _intervalMs) {
+    if (_intervalMs < (int32_t)AdaptivePoller::c_minIntervalMs) return false;
+    HomeShard* const shard = find_shard(_valueId._homeId);
+    if (!shard) return false;
+    ValueID const id = _valueId.toValueID();
+    uint64 age = AdaptivePoller::c_unknownAge;
+    {
+        ReadLock registryLock(shard->m_registryLock);
+        ValueRecord const* record = shard->m_registry.GetValue(id);
+        if (!record) return false;
+        int64_t const now = GetTimestampMs();
+        if (record->m_refreshedAt && !record->m_stale) {
+            age = std::max<int64_t>(now - (int64_t)record->m_refreshedAt, 0);
+        }
+    }
+    {
+        HomeLock lock(shard, true);
+        Manager* mgr = Manager::Get();
+        if (mgr->IsValuePolled(id)) mgr->DisablePoll(id);
+    }
+    return g_poller->Enable(_valueId, _intervalMs, age);
+}
+
+bool disable_adaptive_poll(RemoteValueID const& _valueId) {
+    return g_poller->Disable(_valueId._homeId, _valueId.toValueID().GetId());
+}
+
+void get_adaptive_poll_plan(AdaptivePollPlan& _return, uint32 const _homeId) {
+    g_poller->GetPlan(_homeId, _return);
+}
+
+// ScheduleValueWrite/GetWriteSchedulerStatistics
+void schedule_value_write(WriteTicket& _return, RemoteValueID const& _id, RemoteValue const& _value, int32_t _priority) {
+    _return = g_writes->Schedule(_id, _value, (uint32_t)std::max<int32_t>(_priority, 0));
+}
+
+void get_write_scheduler_statistics(WriteSchedulerStatistics& _return) {
+    g_writes->GetStatistics(_return);
+}
+
+// GetNetworkTopology: every node's neighbor list is read (and analyzed)
+// once, then served from the shard until a notification invalidates it
+void get_network_topology(NetworkTopology& _return, uint32 const _homeId) {
+    _return.retval = false;
+    _return.m_homeId = _homeId;
+    HomeShard* const shard = find_shard(_homeId);
+    if (!shard) return;
+    uint64 const version = shard->m_topologyVersion;
+    {
+        boost::lock_guard<boost::mutex> lock(shard->m_topologyMutex);
+        if (shard->m_topology && (shard->m_topology->m_version == (int64_t)version)) {
+            _return = *shard->m_topology;
+            return;
+        }
+    }
+    // built outside m_topologyMutex: concurrent callers may both build it
+    TopologyMap mesh;
+    vector<uint8> nodeIds;
+    {
+        ReadLock registryLock(shard->m_registryLock);
+        vector<NodeInfo*> nodes;
+        shard->m_registry.GetNodes(nodes);
+        for (vector<NodeInfo*>::iterator it = nodes.begin(); it != nodes.end(); ++it) {
+            nodeIds.push_back((*it)->m_nodeId);
+            mesh.AddNode((*it)->m_nodeId);
+        }
+    }
+    boost::shared_ptr<NetworkTopology> topology(new NetworkTopology());
+    {
+        Manager* mgr = Manager::Get();
+        HomeLock lock(shard, false);
+        for (vector<uint8>::iterator it = nodeIds.begin(); it != nodeIds.end(); ++it) {
+            uint8* neighbors = NULL;
+            uint32 const count = mgr->GetNodeNeighbors(_homeId, *it, &neighbors);
+            if (count > 0) {
+                mesh.SetNeighbors(*it, neighbors, count);
+                delete[] neighbors;
+            }
+        }
+        mesh.Analyze(mgr->GetControllerNodeId(_homeId));
+    }
+    mesh.Fill(*topology);
+    topology->retval = true;
+    topology->m_homeId = _homeId;
+    topology->m_version = version;
+    topology->m_builtAt = GetTimestampMs();
+    {
+        boost::lock_guard<boost::mutex> lock(shard->m_topologyMutex);
+        shard->m_topology = topology;
+    }
+    _return = *topology;
+}
+
+// AddNotificationRoute/RemoveNotificationRoute/GetNotificationRoutes: the
+// routes are used for the notifications published from then on
+int32_t add_notification_route(NotificationRoute const& _route) {
+    return g_router.Add(_route);
+}
+
+bool remove_notification_route(int32_t _id) {
+    return g_router.Remove(_id);
+}
+
+void get_notification_routes(std::vector<NotificationRoute>& _return) {
+    g_router.GetRoutes(_return);
+}
+
+// GetDriverHealth: the state of every --ozwport, in command line order
+void get_driver_health(std::vector<DriverHealth>& _return) {
+    static char const* const stateNames[] = { "starting", "ready", "failed" };
+    _return.resize(g_shards.size());
+    for (size_t i = 0; i < g_shards.size(); i++) {
+        HomeShard* shard = g_shards[i];
+        DriverHealth& health = _return[i];
+        uint32 const homeId = shard->m_homeId;
+        int const state = shard->m_state;
+        health.m_controllerPath = shard->m_port;
+        health.m_homeId = (int32_t)homeId;
+        health.m_state = stateNames[state];
+        health.m_readyAt = shard->m_readyAt;
+        health.m_lastNotificationAt = shard->m_lastNotificationAt;
+        health.m_notifications = shard->m_notifications;
+        {
+            ReadLock registryLock(shard->m_registryLock);
+            health.m_nodes = shard->m_registry.GetNodeCount();
+            health.m_values = shard->m_registry.GetValueCount();
+        }
+        if (shard->m_publisher.load()) {
+            health.m_topic = shard_topic(shard);
+            get_queue_statistics(health.m_queue, shard);
+        }
+        if ((state == Driver_Ready) && homeId) {
+            HomeLock lock(shard, false);
+            Manager::Get()->GetDriverStatistics(homeId, (OpenZWave::Driver::DriverData*) &health.m_driverStatistics);
+        }
+    }
+}
+
+// name of a notification type, for GetServerMetrics
+static string notification_type_name(uint32 _type) {
+    switch (_type) {
+        case Notification::Type_ValueAdded:             return "ValueAdded";
+        case Notification::Type_ValueRemoved:           return "ValueRemoved";
+        case Notification::Type_ValueChanged:           return "ValueChanged";
+        case Notification::Type_ValueRefreshed:         return "ValueRefreshed";
+        case Notification::Type_Group:                  return "Group";
+        case Notification::Type_NodeNew:                return "NodeNew";
+        case Notification::Type_NodeAdded:              return "NodeAdded";
+        case Notification::Type_NodeRemoved:            return "NodeRemoved";
+        case Notification::Type_NodeProtocolInfo:       return "NodeProtocolInfo";
+        case Notification::Type_PollingDisabled:        return "PollingDisabled";
+        case Notification::Type_PollingEnabled:         return "PollingEnabled";
+        case Notification::Type_DriverReady:            return "DriverReady";
+        case Notification::Type_DriverFailed:           return "DriverFailed";
+        case Notification::Type_DriverReset:            return "DriverReset";
+        case Notification::Type_NodeQueriesComplete:    return "NodeQueriesComplete";
+        case Notification::Type_AwakeNodesQueried:      return "AwakeNodesQueried";
+        case Notification::Type_AllNodesQueried:        return "AllNodesQueried";
+        case Notification::Type_AllNodesQueriedSomeDead: return "AllNodesQueriedSomeDead";
+        default:                                        return "Type" + boost::lexical_cast<string>(_type);
+    }
+}
+
+static void fill_metric_histogram(MetricHistogram& _histogram, string const& _name, HistogramSnapshot const& _snapshot) {
+    _histogram.m_name = _name;
+    _histogram.m_count = _snapshot.m_count;
+    _histogram.m_sumUs = _snapshot.m_sumUs;
+    _histogram.m_maxUs = _snapshot.m_maxUs;
+    _histogram.m_p50Us = _snapshot.Percentile(0.5);
+    _histogram.m_p99Us = _snapshot.Percentile(0.99);
+    _histogram.m_p999Us = _snapshot.Percentile(0.999);
+    _histogram.m_buckets.assign(_snapshot.m_buckets, _snapshot.m_buckets + HistogramSnapshot::c_buckets);
+    _histogram.m_errors = 0;
+}
+
+static void fill_metric_histogram(MetricHistogram& _histogram, string const& _name, LatencyHistogram const& _latency) {
+    HistogramSnapshot snapshot;
+    _latency.GetSnapshot(snapshot);
+    fill_metric_histogram(_histogram, _name, snapshot);
+}
+
+static void fill_lock_metrics(LockMetrics& _metrics, string const& _name, InstrumentedSharedMutex const& _mutex) {
+    _metrics.m_name = _name;
+    fill_metric_histogram(_metrics.m_readWait, "readWait", _mutex.GetReadWait());
+    fill_metric_histogram(_metrics.m_writeWait, "writeWait", _mutex.GetWriteWait());
+    fill_metric_histogram(_metrics.m_readHold, "readHold", _mutex.GetReadHold());
+    fill_metric_histogram(_metrics.m_writeHold, "writeHold", _mutex.GetWriteHold());
+    _metrics.m_contended = _mutex.GetContended();
+}
+
+// GetServerMetrics: everything ozwd measures about itself, takes no lock
+// but the RPC table's
+void get_server_metrics(ServerMetrics& _return) {
+    _return.m_uptimeMs = (MetricsNowUs() - g_startUs) / 1000;
+    vector<RpcSnapshot> rpcs;
+    g_rpcMetrics->GetSnapshots(rpcs);
+    _return.m_rpcs.resize(rpcs.size());
+    for (size_t i = 0; i < rpcs.size(); i++) {
+        fill_metric_histogram(_return.m_rpcs[i], rpcs[i].m_name, rpcs[i].m_latency);
+        _return.m_rpcs[i].m_errors = rpcs[i].m_errors;
+    }
+    _return.m_locks.resize(1 + 2 * g_shards.size());
+    fill_lock_metrics(_return.m_locks[0], "openzwave", g_criticalSection);
+    for (size_t i = 0; i < g_shards.size(); i++) {
+        fill_lock_metrics(_return.m_locks[1 + 2 * i], "home:" + g_shards[i]->m_port, g_shards[i]->m_lock);
+        fill_lock_metrics(_return.m_locks[2 + 2 * i], "registry:" + g_shards[i]->m_port, g_shards[i]->m_registryLock);
+    }
+    fill_metric_histogram(_return.m_notificationCallback, "notificationCallback", g_notificationLatency);
+    for (uint32 type = 0; type < c_notificationTypes; type++) {
+        uint64 const count = g_notificationCounts[type].load(boost::memory_order_relaxed);
+        if (count) _return.m_notifications[notification_type_name(type)] = count;
+    }
+    PublisherStatistics stats = PublisherStatistics();
+    for (vector<HomeShard*>::const_iterator it = g_shards.begin(); it != g_shards.end(); ++it) {
+        add_publisher_statistics(stats, *it);
+    }
+    fill_metric_histogram(_return.m_stompSend, "stompSend", stats.m_sendLatency);
+    _return.m_stompSendFailures = stats.m_sendFailures;
+    fill_metric_histogram(_return.m_notificationPublish, "notificationPublish", stats.m_publishLatency);
+}
+
+// one histogram in Prometheus' text format, with cumulative buckets in seconds
+static void prometheus_histogram(ostream& _out, string const& _name, string const& _labels, MetricHistogram const& _histogram) {
+    string const sep = _labels.empty() ? "" : ",";
+    int64_t cumulative = 0;
+    for (size_t i = 0; i + 1 < _histogram.m_buckets.size(); i++) {
+        cumulative += _histogram.m_buckets[i];
+        _out << _name << "_bucket{" << _labels << sep << "le=\"" << ((1LL << i) / 1e6) << "\"} " << cumulative << "\n";
+    }
+    _out << _name << "_bucket{" << _labels << sep << "le=\"+Inf\"} " << _histogram.m_count << "\n";
+    _out << _name << "_sum" << (_labels.empty() ? "" : "{" + _labels + "}") << " " << (_histogram.m_sumUs / 1e6) << "\n";
+    _out << _name << "_count" << (_labels.empty() ? "" : "{" + _labels + "}") << " " << _histogram.m_count << "\n";
+}
+
+// the --metricsport page
+string prometheus_metrics() {
+    ServerMetrics metrics;
+    get_server_metrics(metrics);
+    ostringstream out;
+    out << "# HELP ozwd_uptime_seconds Time since ozwd started.\n# TYPE ozwd_uptime_seconds gauge\n";
+    out << "ozwd_uptime_seconds " << (metrics.m_uptimeMs / 1e3) << "\n";
+    out << "# HELP ozwd_rpc_duration_seconds RemoteManager call latency, from reading the arguments to writing the result.\n";
+    out << "# TYPE ozwd_rpc_duration_seconds histogram\n";
+    for (size_t i = 0; i < metrics.m_rpcs.size(); i++) {
+        prometheus_histogram(out, "ozwd_rpc_duration_seconds", "method=\"" + metrics.m_rpcs[i].m_name + "\"", metrics.m_rpcs[i]);
+    }
+    out << "# HELP ozwd_rpc_errors_total RemoteManager calls that failed.\n# TYPE ozwd_rpc_errors_total counter\n";
+    for (size_t i = 0; i < metrics.m_rpcs.size(); i++) {
+        out << "ozwd_rpc_errors_total{method=\"" << metrics.m_rpcs[i].m_name << "\"} " << metrics.m_rpcs[i].m_errors << "\n";
+    }
+    out << "# HELP ozwd_lock_wait_seconds Time spent waiting for an ozwd lock.\n# TYPE ozwd_lock_wait_seconds histogram\n";
+    for (size_t i = 0; i < metrics.m_locks.size(); i++) {
+        string const lock = "lock=\"" + metrics.m_locks[i].m_name + "\",mode=";
+        prometheus_histogram(out, "ozwd_lock_wait_seconds", lock + "\"read\"", metrics.m_locks[i].m_readWait);
+        prometheus_histogram(out, "ozwd_lock_wait_seconds", lock + "\"write\"", metrics.m_locks[i].m_writeWait);
+    }
+    out << "# HELP ozwd_lock_hold_seconds Time an ozwd lock was held.\n# TYPE ozwd_lock_hold_seconds histogram\n";
+    for (size_t i = 0; i < metrics.m_locks.size(); i++) {
+        string const lock = "lock=\"" + metrics.m_locks[i].m_name + "\",mode=";
+        prometheus_histogram(out, "ozwd_lock_hold_seconds", lock + "\"read\"", metrics.m_locks[i].m_readHold);
+        prometheus_histogram(out, "ozwd_lock_hold_seconds", lock + "\"write\"", metrics.m_locks[i].m_writeHold);
+    }
+    out << "# HELP ozwd_lock_contended_total Lock acquisitions that had to wait.\n# TYPE ozwd_lock_contended_total counter\n";
+    for (size_t i = 0; i < metrics.m_locks.size(); i++) {
+        out << "ozwd_lock_contended_total{lock=\"" << metrics.m_locks[i].m_name << "\"} " << metrics.m_locks[i].m_contended << "\n";
+    }
+    out << "# HELP ozwd_notification_callback_seconds OpenZWave notification handling time.\n";
+    out << "# TYPE ozwd_notification_callback_seconds histogram\n";
+    prometheus_histogram(out, "ozwd_notification_callback_seconds", "", metrics.m_notificationCallback);
+    out << "# HELP ozwd_notifications_total OpenZWave notifications received.\n# TYPE ozwd_notifications_total counter\n";
+    for (map<string, int64_t>::const_iterator it = metrics.m_notifications.begin(); it != metrics.m_notifications.end(); ++it) {
+        out << "ozwd_notifications_total{type=\"" << it->first << "\"} " << it->second << "\n";
+    }
+    out << "# HELP ozwd_stomp_send_seconds Time spent handing a message to STOMP.\n# TYPE ozwd_stomp_send_seconds histogram\n";
+    prometheus_histogram(out, "ozwd_stomp_send_seconds", "", metrics.m_stompSend);
+    out << "# HELP ozwd_stomp_send_failures_total STOMP send errors.\n# TYPE ozwd_stomp_send_failures_total counter\n";
+    out << "ozwd_stomp_send_failures_total " << metrics.m_stompSendFailures << "\n";
+    out << "# HELP ozwd_notification_publish_seconds Time from a notification to the end of its STOMP send.\n";
+    out << "# TYPE ozwd_notification_publish_seconds histogram\n";
+    prometheus_histogram(out, "ozwd_notification_publish_seconds", "", metrics.m_notificationPublish);
+    return out.str();
 }
 
 // the Thrift-generated (and manually patched) RemoteManager implementation
@@ -401,11 +2160,171 @@ void dump_trace(exception& e, const char* context) {
         cerr << "------------------------------------------------------------------------" << endl;
 }
 
+//-----------------------------------------------------------------------------
+// <Listener>
+// A Thrift endpoint: --thriftport/--protocol/--transport, plus one for each
+// --listen port[:protocol[:transport]]
+//-----------------------------------------------------------------------------
+struct Listener
+{
+	int		m_port;
+	string	m_protocol;		// binary, compact or json
+	string	m_transport;	// buffered, framed or http
+};
+
+bool valid_listener
+(
+	Listener const& _listener
+)
+{
+	return ( _listener.m_port > 0 ) && ( _listener.m_port < 65536 )
+		&& ( ( _listener.m_protocol == "binary" ) || ( _listener.m_protocol == "compact" ) || ( _listener.m_protocol == "json" ) )
+		&& ( ( _listener.m_transport == "buffered" ) || ( _listener.m_transport == "framed" ) || ( _listener.m_transport == "http" ) );
+}
+
+bool parse_listener
+(
+	string const& _spec,
+	Listener& _listener
+)
+{
+	vector<string> fields;
+	size_t start = 0;
+	for( ;; )
+	{
+		size_t const colon = _spec.find( ':', start );
+		fields.push_back( _spec.substr( start, colon - start ) );
+		if( colon == string::npos )
+		{
+			break;
+		}
+		start = colon + 1;
+	}
+	if( fields.size() > 3 )
+	{
+		return false;
+	}
+	try
+	{
+		_listener.m_port = boost::lexical_cast<int>( fields[0] );
+	}
+	catch( boost::bad_lexical_cast& )
+	{
+		return false;
+	}
+	if( fields.size() > 1 ) _listener.m_protocol = fields[1];
+	if( fields.size() > 2 ) _listener.m_transport = fields[2];
+	return valid_listener( _listener );
+}
+
+shared_ptr<TProtocolFactory> make_protocol_factory
+(
+	string const& _protocol
+)
+{
+	if( _protocol == "compact" )
+	{
+		return shared_ptr<TProtocolFactory>( new TCompactProtocolFactory() );
+	}
+	if( _protocol == "json" )
+	{
+		return shared_ptr<TProtocolFactory>( new TJSONProtocolFactory() );
+	}
+	return shared_ptr<TProtocolFactory>( new TBinaryProtocolFactory() );
+}
+
+shared_ptr<TTransportFactory> make_transport_factory
+(
+	string const& _transport
+)
+{
+	if( _transport == "framed" )
+	{
+		return shared_ptr<TTransportFactory>( new TFramedTransportFactory() );
+	}
+	if( _transport == "http" )
+	{
+		// HTTP POST, as sent by gen-js/RemoteManager.js
+		return shared_ptr<TTransportFactory>( new THttpServerTransportFactory() );
+	}
+	return shared_ptr<TTransportFactory>( new TBufferedTransportFactory() );
+}
+
+//-----------------------------------------------------------------------------
+// <make_server>
+// A Thrift server of the given --server mode for one listener. All servers
+// share the RemoteManager processor, but each has its own worker pool.
+//-----------------------------------------------------------------------------
+shared_ptr<TServer> make_server
+(
+	shared_ptr<TProcessor> _processor,
+	Listener const& _listener,
+	string const& _mode,
+	int const _workers,
+	int const _queue
+)
+{
+	shared_ptr<TProtocolFactory> protocolFactory = make_protocol_factory( _listener.m_protocol );
+	if( _mode == "simple" )
+	{
+		shared_ptr<TServerTransport> serverTransport( new TServerSocket( _listener.m_port ) );
+		return shared_ptr<TServer>( new TSimpleServer( _processor, serverTransport, make_transport_factory( _listener.m_transport ), protocolFactory ) );
+	}
+	if( _mode == "threaded" )
+	{
+		// one thread per client connection
+		shared_ptr<TServerTransport> serverTransport( new TServerSocket( _listener.m_port ) );
+		return shared_ptr<TServer>( new TThreadedServer( _processor, serverTransport, make_transport_factory( _listener.m_transport ), protocolFactory ) );
+	}
+	// threadpool & nonblocking: a bounded pool of workers. TThreadPoolServer
+	// gives each client connection a worker for as long as it stays open
+	// (queuedepth connections wait for one, further ones aren't accepted);
+	// TNonblockingServer a worker per request (queuedepth requests wait)
+	shared_ptr<ThreadManager> threadManager =
+		ThreadManager::newSimpleThreadManager( _workers, _queue );
+	threadManager->threadFactory( shared_ptr<PosixThreadFactory>( new PosixThreadFactory() ) );
+	threadManager->start();
+	if( _mode == "threadpool" )
+	{
+		shared_ptr<TServerTransport> serverTransport( new TServerSocket( _listener.m_port ) );
+		return shared_ptr<TServer>( new TThreadPoolServer( _processor, serverTransport, make_transport_factory( _listener.m_transport ), protocolFactory, threadManager ) );
+	}
+	// libevent-driven I/O, always framed (checked in main)
+	return shared_ptr<TServer>( new TNonblockingServer( _processor, protocolFactory, _listener.m_port, threadManager ) );
+}
+
+// runs an additional listener's server in a thread of its own
+void serve_listener( shared_ptr<TServer> _server, Listener const _listener ) {
+    try {
+        _server->serve();
+    }
+    catch (exception& e)
+    {
+        dump_trace(e, ("server.serve() on port " + boost::lexical_cast<string>(_listener.m_port)).c_str());
+    }
+}
+
 // -----------------------------------------
 int main(int argc, char *argv[]) {
 // -----------------------------------------
-	string  stomp_host, ozw_port, ozw_conf, ozw_user;
-    int     stomp_port, thrift_port;
+	string  stomp_host, ozw_conf, ozw_user, server_mode, overflow;
+    vector<string> ozw_ports;
+    int     stomp_port, thrift_port, server_workers, server_queue, queue_size, rate_window, max_rate;
+    bool    suppress_unchanged = false;
+    string  payload, history_dir;
+    int     history_days, ring_size, metrics_port;
+    string  snapshot_path, capture_path;
+    vector<string> route_specs;
+    int     write_queue, write_timeout;
+    string  write_limits;
+    uint32_t write_limit[WriteScheduler::c_priorities];
+    int     snapshot_interval;
+    bool    warm_start = false;
+    bool    no_stomp = false;
+    OverflowPolicy overflow_policy;
+    // the main Thrift listener, then every --listen one
+    vector<Listener> listeners(1);
+    vector<string> listen_specs;
     // 
     string ozwconf_default = "/usr/share/openzwave/config";
     //
@@ -421,11 +2340,35 @@ int main(int argc, char *argv[]) {
             ("help,?", "print this help message")
             ("stomphost,h",   po::value<string>(&stomp_host)->default_value("localhost"), "STOMP server hostname")
             ("stompport,s",   po::value<int>(&stomp_port)->default_value(61613), "STOMP server port number")
+            ("nostomp",       po::bool_switch(&no_stomp), "don't publish notifications to STOMP (use WaitForNotifications)")
+            ("ringsize",      po::value<int>(&ring_size)->default_value(4096), "notifications kept for WaitForNotifications (0: disabled)")
             ("thriftport,t",  po::value<int>(&thrift_port)->default_value(9090), "our Thrift service port")
+            ("protocol",      po::value<string>(&listeners[0].m_protocol)->default_value("binary"), "Thrift protocol on --thriftport: binary, compact or json")
+            ("transport",     po::value<string>(&listeners[0].m_transport)->default_value("buffered"), "Thrift transport on --thriftport: buffered, framed or http")
+            ("listen,l",      po::value< vector<string> >(&listen_specs)->composing(), "additional Thrift listener, port[:protocol[:transport]] (default binary:buffered), may be repeated")
+            ("server",        po::value<string>(&server_mode)->default_value("threadpool"), "Thrift server mode: simple, threadpool, threaded or nonblocking (framed transport)")
+            ("workers,w",     po::value<int>(&server_workers)->default_value(64), "worker threads for the threadpool/nonblocking server modes (threadpool: max. connected clients, a WaitForNotifications long poll included)")
+            ("queuedepth,q",  po::value<int>(&server_queue)->default_value(64), "max. connections (threadpool) or requests (nonblocking) waiting for a worker (0: unbounded)")
             ("ozwconf,c",     po::value<string>(&ozw_conf)->default_value(ozw_config_dir.string()), "OpenZWave's manufacturer database")
             ("ozwuser,u",     po::value<string>(&ozw_user)->default_value(current_dir.string()), "OpenZWave's user config database")
-            ("ozwport,p",     po::value<string>(&ozw_port)->default_value("/dev/ttyUSB0"), "OpenZWave's driver dongle")
+            ("ozwport,p",     po::value< vector<string> >(&ozw_ports)->composing()->default_value(vector<string>(1, "/dev/ttyUSB0"), "/dev/ttyUSB0"), "OpenZWave's driver dongle, may be repeated (a Z-Wave network each)")
             ("json,j",        po::bool_switch(&jsonMessageBody), "Should stomp messages have JSON body?")
+            ("payload",       po::value<string>(&payload)->default_value("headers"), "STOMP message format: headers (hex-formatted headers), compact or binary (Thrift-serialized RemoteNotification body)")
+            ("queuesize",     po::value<int>(&queue_size)->default_value(4096), "max. notifications waiting to be published to STOMP (1..65534)")
+            ("overflow",      po::value<string>(&overflow)->default_value("coalesce"), "when the notification queue is full: block, drop-oldest or coalesce (latest per value, block for the rest)")
+            ("ratewindow",    po::value<int>(&rate_window)->default_value(0), "rate limit window per value (ms): within it only the first and the latest update of a value are published (0: off)")
+            ("maxrate",       po::value<int>(&max_rate)->default_value(0), "max. updates published per value and second (0: unlimited)")
+            ("suppressunchanged", po::bool_switch(&suppress_unchanged), "don't publish value updates that didn't change the value")
+            ("history",       po::value<string>(&history_dir)->default_value(""), "directory of the numeric value history (empty: no history)")
+            ("historydays",   po::value<int>(&history_days)->default_value(30), "days of value history to keep (0: forever)")
+            ("capture",       po::value<string>(&capture_path)->default_value(""), "record every notification (with its value) to this file, for ozwd-bench --replay (empty: off)")
+            ("snapshot",      po::value<string>(&snapshot_path)->default_value(""), "registry snapshot file, loaded at startup to serve the last known (stale) state right away, saved periodically and at shutdown (empty: none)")
+            ("snapshotinterval", po::value<int>(&snapshot_interval)->default_value(300), "seconds between --snapshot saves (0: only at shutdown)")
+            ("route",         po::value< vector<string> >(&route_specs)->composing(), "also publish the notifications matching criteria to a topic of their own: criteria[@topic], e.g. \"node=2-9;cc=0x25,0x26@/topic/lights/{node}\", may be repeated")
+            ("writequeue",    po::value<int>(&write_queue)->default_value(1024), "max. ScheduleValueWrite writes waiting (to distinct values)")
+            ("writelimits",   po::value<string>(&write_limits)->default_value("8,4,1"), "send queue length below which interactive,normal,bulk scheduled writes are handed to OpenZWave")
+            ("writetimeout",  po::value<int>(&write_timeout)->default_value(10000), "ms a scheduled write waits for the node to report the value before it is unconfirmed")
+            ("metricsport",   po::value<int>(&metrics_port)->default_value(0), "serve GetServerMetrics in Prometheus text format over HTTP on this port (0: off)")
             ("debug,d",       po::bool_switch(&debugMsg), "Show debug logging from OpenZwave and BoostStomp?")
         ;
         // a boost:program_options variable map
@@ -438,6 +2381,87 @@ int main(int argc, char *argv[]) {
             cout << desc << "\n";
             return 1;
         }
+        if ((server_mode != "simple") && (server_mode != "threadpool") &&
+            (server_mode != "threaded") && (server_mode != "nonblocking")) {
+            throw po::invalid_option_value(server_mode);
+        }
+        listeners[0].m_port = thrift_port;
+        if (!valid_listener(listeners[0])) {
+            throw po::invalid_option_value("--thriftport/--protocol/--transport");
+        }
+        for (vector<string>::iterator it = listen_specs.begin(); it != listen_specs.end(); ++it) {
+            Listener listener = { 0, "binary", "buffered" };
+            if (!parse_listener(*it, listener)) {
+                throw po::invalid_option_value(*it);
+            }
+            listeners.push_back(listener);
+        }
+        for (size_t i = 0; i < listeners.size(); i++) {
+            if ((server_mode == "nonblocking") && (listeners[i].m_transport != "framed")) {
+                throw po::invalid_option_value("--server nonblocking requires the framed transport on every listener");
+            }
+            for (size_t j = 0; j < i; j++) {
+                if (listeners[j].m_port == listeners[i].m_port) {
+                    throw po::invalid_option_value("port " + boost::lexical_cast<string>(listeners[i].m_port) + " is used twice");
+                }
+            }
+        }
+        if ((server_workers < 1) || (server_queue < 0)) {
+            throw po::invalid_option_value("--workers/--queuedepth");
+        }
+        if ((queue_size < 1) || (queue_size > 65534)) {
+            throw po::invalid_option_value("--queuesize");
+        }
+        if (!NotificationPublisher::ParsePolicy(overflow, overflow_policy)) {
+            throw po::invalid_option_value(overflow);
+        }
+        if (payload == "compact") {
+            payloadFormat = Payload_Compact;
+        } else if (payload == "binary") {
+            payloadFormat = Payload_Binary;
+        } else if (payload != "headers") {
+            throw po::invalid_option_value(payload);
+        }
+        if (jsonMessageBody && (payloadFormat != Payload_Headers)) {
+            throw po::invalid_option_value("--json can't be combined with --payload " + payload);
+        }
+        if ((rate_window < 0) || (max_rate < 0)) {
+            throw po::invalid_option_value("--ratewindow/--maxrate");
+        }
+        if (ring_size < 0) {
+            throw po::invalid_option_value("--ringsize");
+        }
+        if (no_stomp && (ring_size == 0)) {
+            throw po::invalid_option_value("--nostomp needs a --ringsize");
+        }
+        if (history_days < 0) {
+            throw po::invalid_option_value("--historydays");
+        }
+        if ((metrics_port < 0) || (metrics_port > 65535)) {
+            throw po::invalid_option_value("--metricsport");
+        }
+        if (snapshot_interval < 0) {
+            throw po::invalid_option_value("--snapshotinterval");
+        }
+        if ((write_queue < 1) || (write_timeout < 1)) {
+            throw po::invalid_option_value("--writequeue/--writetimeout");
+        }
+        char trailing;
+        if ((sscanf(write_limits.c_str(), "%u,%u,%u%c", &write_limit[0], &write_limit[1], &write_limit[2], &trailing) != 3) ||
+            !write_limit[0] || !write_limit[1] || !write_limit[2]) {
+            throw po::invalid_option_value("--writelimits " + write_limits);
+        }
+        for (vector<string>::iterator it = route_specs.begin(); it != route_specs.end(); ++it) {
+            NotificationRoute route;
+            if (!TopicRouter::Parse(*it, route) || (g_router.Add(route) < 0)) {
+                throw po::invalid_option_value("--route " + *it);
+            }
+        }
+        for (size_t i = 0; i < ozw_ports.size(); i++) {
+            if (std::count(ozw_ports.begin(), ozw_ports.begin() + i, ozw_ports[i])) {
+                throw po::invalid_option_value("--ozwport " + ozw_ports[i] + " is given twice");
+            }
+        }
     }
     catch (exception& e) 
     {
@@ -445,20 +2469,91 @@ int main(int argc, char *argv[]) {
         return 2;
     }
 
+    // one shard per Z-Wave network
+    for (vector<string>::iterator it = ozw_ports.begin(); it != ozw_ports.end(); ++it) {
+        g_shards.push_back(new HomeShard(*it));
+    }
+    PublisherSettings const publisherSettings = { queue_size, overflow_policy, rate_window, max_rate, suppress_unchanged };
+    g_publisherSettings = publisherSettings;
+
     // ------------------
-    try {
-        cout << "Connecting to STOMP server at " << stomp_host << ":" << stomp_port << std::endl;
-        // connect to STOMP server in order to send openzwave notifications 
-        stomp_client = new STOMP::BoostStomp(stomp_host, stomp_port);
-        stomp_client->start();
-        stomp_client->enable_debug_msgs(debugMsg);
-        cout << "Connected to STOMP server." << std::endl;
-    } 
-    catch (exception& e) 
-    {
-        dump_trace(e, "connecting to STOMP");
-        return 3;
-    } 
+    if (!snapshot_path.empty()) {
+        // SIGINT/SIGTERM go to shutdown_thread only: block them before any
+        // other thread is started, threads inherit the mask
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+        boost::thread(shutdown_thread, snapshot_path, signals);
+        warm_start = load_registry_snapshot(snapshot_path);
+        if (snapshot_interval > 0) {
+            boost::thread(snapshot_thread, snapshot_path, snapshot_interval);
+        }
+    }
+
+    // ------------------
+    if (!history_dir.empty()) {
+        try {
+            g_history = new HistoryStore(history_dir, history_days);
+            cout << "Recording value history in " << history_dir << std::endl;
+        }
+        catch (exception& e)
+        {
+            dump_trace(e, "opening the value history");
+            return 2;
+        }
+    }
+
+    if (!capture_path.empty()) {
+        try {
+            g_capture = new NotificationCapture(capture_path);
+            cout << "Capturing notifications to " << capture_path << std::endl;
+        }
+        catch (exception& e)
+        {
+            dump_trace(e, "opening the notification capture");
+            return 2;
+        }
+    }
+
+    if (ring_size > 0) {
+        g_ring = new NotificationRing(ring_size);
+    }
+
+    if (metrics_port) {
+        try {
+            g_metricsEndpoint = new MetricsEndpoint(metrics_port, prometheus_metrics);
+        }
+        catch (exception& e)
+        {
+            dump_trace(e, "opening the metrics port");
+            return 2;
+        }
+    }
+
+    // ------------------
+    if (!no_stomp) {
+        try {
+            cout << "Connecting to STOMP server at " << stomp_host << ":" << stomp_port << std::endl;
+            // connect to STOMP server in order to send openzwave notifications 
+            stomp_client = new STOMP::BoostStomp(stomp_host, stomp_port);
+            stomp_client->start();
+            stomp_client->enable_debug_msgs(debugMsg);
+            cout << "Connected to STOMP server." << std::endl;
+            // decouple OpenZWave's driver threads from the STOMP socket: the
+            // networks restored from --snapshot get their publisher now, the
+            // others once their driver is ready
+            for (vector<HomeShard*>::iterator it = g_shards.begin(); it != g_shards.end(); ++it) {
+                if ((*it)->m_homeId) start_publisher(*it);
+            }
+        } 
+        catch (exception& e) 
+        {
+            dump_trace(e, "connecting to STOMP");
+            return 3;
+        } 
+    }
 
     // OpenZWave daemon initialization
     try {    
@@ -469,19 +2564,28 @@ int main(int argc, char *argv[]) {
         cout << "Initializing OpenZWave" << endl;
         cout << "    configuration    : " << ozw_conf << std::endl;
         cout << "    user preferences : " << ozw_user << std::endl;
-        cout << "    controller port  : " << ozw_port << std::endl;
+        for (vector<string>::iterator it = ozw_ports.begin(); it != ozw_ports.end(); ++it) {
+            cout << "    controller port  : " << *it << std::endl;
+        }
         cout.flush();
         
         Options::Create(ozw_conf, ozw_user, "" );
         Options::Get()->Lock();
     
         Manager::Create();
+        // value writes scheduled through the Thrift interface
+        g_writes = new WriteScheduler(dispatch_write, send_queue_depth, report_write, write_queue, write_limit, write_timeout);
+        g_writes->Start();
+        g_poller = new AdaptivePoller(poll_value, node_health);
+        g_poller->Start();
           
         // Add a callback handler to the manager. 
         Manager::Get()->AddWatcher( OnNotification, NULL );
     
-        // Add a Z-Wave Driver
-        Manager::Get()->AddDriver( ozw_port );
+        // Add a Z-Wave Driver per network
+        for (vector<string>::iterator it = ozw_ports.begin(); it != ozw_ports.end(); ++it) {
+            Manager::Get()->AddDriver( *it );
+        }
         
         // Set OpenZwave's log level
         LogLevel ll_save  = debugMsg ? LogLevel_Debug : LogLevel_None;
@@ -497,28 +2601,39 @@ int main(int argc, char *argv[]) {
     };
     
     // Thrift server initialization
-    TSimpleServer* server;
+    vector< shared_ptr<TServer> > servers;
     try {   
-        // THRIFT: initialize RemoteManager
+        // THRIFT: initialize RemoteManager, shared by all listeners
         shared_ptr<RemoteManagerHandler> handler(new RemoteManagerHandler());
         shared_ptr<TProcessor> processor(new RemoteManagerProcessor(handler));
-        TServerSocket* ss = new TServerSocket(thrift_port);
-        shared_ptr<TServerTransport> serverTransport(ss);
-        shared_ptr<TTransportFactory> transportFactory(new TBufferedTransportFactory());
-        shared_ptr<TProtocolFactory> protocolFactory(new TBinaryProtocolFactory());
-        server = new TSimpleServer(processor, serverTransport, transportFactory, protocolFactory);
+        // times every call (GetServerMetrics)
+        processor->setEventHandler(g_rpcMetrics);
+        for (size_t i = 0; i < listeners.size(); i++) {
+            servers.push_back(make_server(processor, listeners[i], server_mode, server_workers, server_queue));
+        }
     }
     catch (exception& e) 
     {
-        dump_trace(e, "setting up Thrift SimpleServer");
+        dump_trace(e, "setting up Thrift server");
         return 5;
     }
     
     try {
-        // Now we just wait for the driver to become ready, and then write out the loaded config.
-        boost::unique_lock<boost::mutex> initLock(initMutex);
-        initCond.wait(initLock);
-        usleep(500);
+        // Now we just wait for the drivers to become ready (or fail), and then write out the loaded config.
+        // After a warm start there is no need to: the snapshot is served until
+        // OpenZWave catches up.
+        if (!warm_start) {
+            boost::unique_lock<boost::mutex> initLock(initMutex);
+            for (;;) {
+                size_t starting = 0;
+                for (vector<HomeShard*>::iterator it = g_shards.begin(); it != g_shards.end(); ++it) {
+                    if ((*it)->m_state == Driver_Starting) starting++;
+                }
+                if (!starting) break;
+                initCond.wait(initLock);
+            }
+            usleep(500);
+        }
     }
     catch (exception& e) 
     {
@@ -528,18 +2643,52 @@ int main(int argc, char *argv[]) {
 
     cout << "------------------------------------------------------------------------" << endl;
     cout << "OpenZWave orbiter is now active, Thrift interface listening on port " << thrift_port << endl;
+    for (size_t i = 0; i < listeners.size(); i++) {
+        cout << "    listener         : port " << listeners[i].m_port << ", "
+             << listeners[i].m_protocol << " protocol, " << listeners[i].m_transport << " transport" << endl;
+    }
+    cout << "    server mode      : " << server_mode;
+    if ((server_mode == "threadpool") || (server_mode == "nonblocking")) {
+        cout << " (" << server_workers << " workers, queue depth " << server_queue << ")";
+    }
+    cout << endl;
+    if (metrics_port) {
+        cout << "    metrics          : http://localhost:" << metrics_port << "/metrics" << endl;
+    }
     cout << "------------------------------------------------------------------------" << endl;
     cout.flush();
     
-    // ready to serve!
-    try {
-        server->serve();
-    }    
-    catch (exception& e) 
+    // ready to serve! additional listeners get a thread each, the main one runs here
+    bool stopping;
     {
-        dump_trace(e, "server.serve()");
-        return 7;
+        boost::lock_guard<boost::mutex> lock(g_shutdownMutex);
+        g_servers = servers;
+        stopping = g_shutdownRequested;
+    }
+    if (!stopping) {
+        for (size_t i = 1; i < servers.size(); i++) {
+            boost::thread(serve_listener, servers[i], listeners[i]);
+        }
+        try {
+            servers[0]->serve();
+        }    
+        catch (exception& e) 
+        {
+            dump_trace(e, "server.serve()");
+            return 7;
+        }
     }
     
+    // stopped by shutdown_thread; if that gave up waiting, it exits for us
+    if (g_tearingDown.exchange(true)) {
+        for (;;) boost::this_thread::sleep(boost::posix_time::seconds(1));
+    }
+    if (!snapshot_path.empty()) save_registry_snapshot(snapshot_path, false);
+    Manager::Get()->RemoveWatcher(OnNotification, NULL);
+    stop_workers();
+    if (g_metricsEndpoint) g_metricsEndpoint->Stop();
+    // writes zwcfg_<homeId>.xml for every network
+    Manager::Destroy();
+    Options::Destroy();
     return 0;
 }
@@ -0,0 +1,533 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// Metrics.cpp: ozwd's built-in instrumentation
+//
+
+#include "Metrics.h"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+
+using std::string;
+using boost::asio::ip::tcp;
+
+//-----------------------------------------------------------------------------
+// <HistogramSnapshot::Percentile>
+//-----------------------------------------------------------------------------
+uint64_t HistogramSnapshot::Percentile
+(
+	double _p
+) const
+{
+	if( m_count == 0 )
+	{
+		return 0;
+	}
+	uint64_t const rank = (uint64_t)( _p * m_count ) + 1;
+	uint64_t seen = 0;
+	for( uint32_t i = 0; i < c_buckets; ++i )
+	{
+		seen += m_buckets[i];
+		if( seen >= rank )
+		{
+			if( i + 1 == c_buckets )
+			{
+				return m_maxUs;
+			}
+			return std::min<uint64_t>( ( (uint64_t)1 << i ) - 1, m_maxUs );
+		}
+	}
+	return m_maxUs;
+}
+
+//-----------------------------------------------------------------------------
+// <HistogramSnapshot::Add>
+//-----------------------------------------------------------------------------
+void HistogramSnapshot::Add
+(
+	HistogramSnapshot const& _other
+)
+{
+	m_count += _other.m_count;
+	m_sumUs += _other.m_sumUs;
+	m_maxUs = std::max( m_maxUs, _other.m_maxUs );
+	for( uint32_t i = 0; i < c_buckets; ++i )
+	{
+		m_buckets[i] += _other.m_buckets[i];
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <LatencyHistogram::LatencyHistogram>
+//-----------------------------------------------------------------------------
+LatencyHistogram::LatencyHistogram
+(
+):
+	m_count( 0 ),
+	m_sumUs( 0 ),
+	m_maxUs( 0 )
+{
+	for( uint32_t i = 0; i < HistogramSnapshot::c_buckets; ++i )
+	{
+		m_buckets[i] = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <LatencyHistogram::Record>
+//-----------------------------------------------------------------------------
+void LatencyHistogram::Record
+(
+	int64_t _us
+)
+{
+	uint64_t const us = ( _us > 0 ) ? (uint64_t)_us : 0;
+	// bit length of us: 0 for 0, i for [2^(i-1), 2^i)
+	uint32_t const bucket = ( us == 0 ) ? 0 : 64 - __builtin_clzll( us );
+	m_buckets[std::min<uint32_t>( bucket, HistogramSnapshot::c_buckets - 1 )].fetch_add( 1, boost::memory_order_relaxed );
+	m_sumUs.fetch_add( us, boost::memory_order_relaxed );
+	m_count.fetch_add( 1, boost::memory_order_relaxed );
+	uint64_t max = m_maxUs.load( boost::memory_order_relaxed );
+	while( ( us > max ) && !m_maxUs.compare_exchange_weak( max, us, boost::memory_order_relaxed ) )
+	{
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <LatencyHistogram::GetSnapshot>
+// Not atomic as a whole: counters read while others record may be off by
+// the few samples recorded in between
+//-----------------------------------------------------------------------------
+void LatencyHistogram::GetSnapshot
+(
+	HistogramSnapshot& _snapshot
+) const
+{
+	_snapshot.m_count = 0;
+	for( uint32_t i = 0; i < HistogramSnapshot::c_buckets; ++i )
+	{
+		_snapshot.m_buckets[i] = m_buckets[i].load( boost::memory_order_relaxed );
+		_snapshot.m_count += _snapshot.m_buckets[i];
+	}
+	_snapshot.m_sumUs = m_sumUs.load( boost::memory_order_relaxed );
+	_snapshot.m_maxUs = m_maxUs.load( boost::memory_order_relaxed );
+}
+
+//-----------------------------------------------------------------------------
+// <InstrumentedSharedMutex::lock>
+// Uncontended acquisitions are recorded as 0µs waits, so the percentiles
+// cover all of them
+//-----------------------------------------------------------------------------
+void InstrumentedSharedMutex::lock
+(
+)
+{
+	int64_t start = 0;
+	if( !m_mutex.try_lock() )
+	{
+		m_contended.fetch_add( 1, boost::memory_order_relaxed );
+		start = MetricsNowUs();
+		m_mutex.lock();
+	}
+	int64_t const now = MetricsNowUs();
+	m_writeWait.Record( start ? now - start : 0 );
+	m_writeSince = now;
+}
+
+//-----------------------------------------------------------------------------
+// <InstrumentedSharedMutex::try_lock>
+//-----------------------------------------------------------------------------
+bool InstrumentedSharedMutex::try_lock
+(
+)
+{
+	if( !m_mutex.try_lock() )
+	{
+		return false;
+	}
+	m_writeWait.Record( 0 );
+	m_writeSince = MetricsNowUs();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <InstrumentedSharedMutex::unlock>
+//-----------------------------------------------------------------------------
+void InstrumentedSharedMutex::unlock
+(
+)
+{
+	m_writeHold.Record( MetricsNowUs() - m_writeSince );
+	m_mutex.unlock();
+}
+
+//-----------------------------------------------------------------------------
+// <InstrumentedSharedMutex::lock_shared>
+//-----------------------------------------------------------------------------
+void InstrumentedSharedMutex::lock_shared
+(
+)
+{
+	int64_t start = 0;
+	if( !m_mutex.try_lock_shared() )
+	{
+		m_contended.fetch_add( 1, boost::memory_order_relaxed );
+		start = MetricsNowUs();
+		m_mutex.lock_shared();
+	}
+	int64_t const now = MetricsNowUs();
+	m_readWait.Record( start ? now - start : 0 );
+	if( !m_readSince.get() )
+	{
+		m_readSince.reset( new int64_t );
+	}
+	*m_readSince = now;
+}
+
+//-----------------------------------------------------------------------------
+// <InstrumentedSharedMutex::try_lock_shared>
+//-----------------------------------------------------------------------------
+bool InstrumentedSharedMutex::try_lock_shared
+(
+)
+{
+	if( !m_mutex.try_lock_shared() )
+	{
+		return false;
+	}
+	m_readWait.Record( 0 );
+	if( !m_readSince.get() )
+	{
+		m_readSince.reset( new int64_t );
+	}
+	*m_readSince = MetricsNowUs();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <InstrumentedSharedMutex::unlock_shared>
+//-----------------------------------------------------------------------------
+void InstrumentedSharedMutex::unlock_shared
+(
+)
+{
+	m_readHold.Record( MetricsNowUs() - *m_readSince );
+	m_mutex.unlock_shared();
+}
+
+//-----------------------------------------------------------------------------
+// <RpcMetrics::~RpcMetrics>
+//-----------------------------------------------------------------------------
+RpcMetrics::~RpcMetrics
+(
+)
+{
+	for( boost::unordered_map<string, Method*>::iterator it = m_methods.begin(); it != m_methods.end(); ++it )
+	{
+		delete it->second;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <RpcMetrics::GetMethod>
+// Methods are registered on their first call, lookups only share the lock
+//-----------------------------------------------------------------------------
+RpcMetrics::Method* RpcMetrics::GetMethod
+(
+	char const* _fnName
+)
+{
+	// "RemoteManager.GetValueAsBool" -> "GetValueAsBool"
+	char const* dot = strrchr( _fnName, '.' );
+	string const name( dot ? dot + 1 : _fnName );
+	{
+		boost::shared_lock<boost::shared_mutex> lock( m_mutex );
+		boost::unordered_map<string, Method*>::const_iterator it = m_methods.find( name );
+		if( it != m_methods.end() )
+		{
+			return it->second;
+		}
+	}
+	boost::unique_lock<boost::shared_mutex> lock( m_mutex );
+	Method*& method = m_methods[name];
+	if( !method )
+	{
+		method = new Method();
+	}
+	return method;
+}
+
+//-----------------------------------------------------------------------------
+// <RpcMetrics::getContext>
+// Called by the processor once it read the method name
+//-----------------------------------------------------------------------------
+void* RpcMetrics::getContext
+(
+	char const* _fnName,
+	void* _serverContext
+)
+{
+	Call* call = new Call();
+	call->m_method = GetMethod( _fnName );
+	call->m_start = MetricsNowUs();
+	return call;
+}
+
+//-----------------------------------------------------------------------------
+// <RpcMetrics::freeContext>
+// Called once the result was written (or the call failed)
+//-----------------------------------------------------------------------------
+void RpcMetrics::freeContext
+(
+	void* _ctx,
+	char const* _fnName
+)
+{
+	Call* call = static_cast<Call*>( _ctx );
+	if( call )
+	{
+		call->m_method->m_latency.Record( MetricsNowUs() - call->m_start );
+		delete call;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <RpcMetrics::handlerError>
+//-----------------------------------------------------------------------------
+void RpcMetrics::handlerError
+(
+	void* _ctx,
+	char const* _fnName
+)
+{
+	if( Call* call = static_cast<Call*>( _ctx ) )
+	{
+		call->m_method->m_errors.fetch_add( 1, boost::memory_order_relaxed );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <RpcMetrics::GetSnapshots>
+//-----------------------------------------------------------------------------
+void RpcMetrics::GetSnapshots
+(
+	std::vector<RpcSnapshot>& _snapshots
+) const
+{
+	boost::shared_lock<boost::shared_mutex> lock( m_mutex );
+	_snapshots.resize( m_methods.size() );
+	size_t i = 0;
+	for( boost::unordered_map<string, Method*>::const_iterator it = m_methods.begin(); it != m_methods.end(); ++it, ++i )
+	{
+		_snapshots[i].m_name = it->first;
+		_snapshots[i].m_errors = it->second->m_errors.load( boost::memory_order_relaxed );
+		it->second->m_latency.GetSnapshot( _snapshots[i].m_latency );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::Connection>
+//-----------------------------------------------------------------------------
+struct MetricsEndpoint::Connection
+{
+	tcp::socket					m_socket;
+	boost::asio::deadline_timer	m_deadline;
+	boost::asio::streambuf		m_request;
+	string						m_response;
+
+	explicit Connection( boost::asio::io_service& _io ): m_socket( _io ), m_deadline( _io ) {}
+};
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::MetricsEndpoint>
+//-----------------------------------------------------------------------------
+MetricsEndpoint::MetricsEndpoint
+(
+	uint16_t _port,
+	boost::function<string()> _render
+):
+	m_render( _render ),
+	m_acceptor( m_io, tcp::endpoint( tcp::v4(), _port ) ),
+	m_retry( m_io )
+{
+	Accept();
+	m_thread = boost::thread( boost::bind( &MetricsEndpoint::Run, this ) );
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::~MetricsEndpoint>
+//-----------------------------------------------------------------------------
+MetricsEndpoint::~MetricsEndpoint()
+{
+	Stop();
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::Stop>
+//-----------------------------------------------------------------------------
+void MetricsEndpoint::Stop()
+{
+	m_io.stop();
+	if( m_thread.joinable() )
+	{
+		m_thread.join();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::Run>
+//-----------------------------------------------------------------------------
+void MetricsEndpoint::Run
+(
+)
+{
+	m_io.run();
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::Accept>
+//-----------------------------------------------------------------------------
+void MetricsEndpoint::Accept
+(
+)
+{
+	ConnectionPtr connection( new Connection( m_io ) );
+	m_acceptor.async_accept( connection->m_socket,
+		boost::bind( &MetricsEndpoint::OnAccept, this, connection, boost::asio::placeholders::error ) );
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::OnAccept>
+// The next connection is accepted right away, whatever this one does
+//-----------------------------------------------------------------------------
+void MetricsEndpoint::OnAccept
+(
+	ConnectionPtr _connection,
+	boost::system::error_code const& _ec
+)
+{
+	if( _ec == boost::asio::error::operation_aborted )
+	{
+		return;
+	}
+	if( _ec )
+	{
+		std::cerr << "MetricsEndpoint: accept failed: " << _ec.message() << std::endl;
+		m_retry.expires_from_now( boost::posix_time::seconds( 1 ) );
+		m_retry.async_wait( boost::bind( &MetricsEndpoint::OnRetry, this, boost::asio::placeholders::error ) );
+		return;
+	}
+	_connection->m_deadline.expires_from_now( boost::posix_time::seconds( (long)c_timeoutSec ) );
+	_connection->m_deadline.async_wait( boost::bind( &MetricsEndpoint::OnDeadline, _connection, boost::asio::placeholders::error ) );
+	boost::asio::async_read_until( _connection->m_socket, _connection->m_request, "\r\n\r\n",
+		boost::bind( &MetricsEndpoint::OnRequest, this, _connection, boost::asio::placeholders::error ) );
+	Accept();
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::OnRetry>
+//-----------------------------------------------------------------------------
+void MetricsEndpoint::OnRetry
+(
+	boost::system::error_code const& _ec
+)
+{
+	if( !_ec )
+	{
+		Accept();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::OnRequest>
+// Whatever the request, the answer is the current metrics
+//-----------------------------------------------------------------------------
+void MetricsEndpoint::OnRequest
+(
+	ConnectionPtr _connection,
+	boost::system::error_code const& _ec
+)
+{
+	if( _ec )
+	{
+		OnResponse( _connection );
+		return;
+	}
+	string body;
+	try
+	{
+		body = m_render();
+	}
+	catch( std::exception& e )
+	{
+		std::cerr << "MetricsEndpoint: " << e.what() << std::endl;
+		OnResponse( _connection );
+		return;
+	}
+	std::ostringstream response;
+	response << "HTTP/1.0 200 OK\r\n"
+		<< "Content-Type: text/plain; version=0.0.4\r\n"
+		<< "Content-Length: " << body.size() << "\r\n"
+		<< "Connection: close\r\n\r\n"
+		<< body;
+	_connection->m_response = response.str();
+	// still under the deadline, a client that doesn't read is closed too
+	boost::asio::async_write( _connection->m_socket, boost::asio::buffer( _connection->m_response ),
+		boost::bind( &MetricsEndpoint::OnResponse, _connection ) );
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::OnResponse>
+// Done with a connection, answered or not
+//-----------------------------------------------------------------------------
+void MetricsEndpoint::OnResponse
+(
+	ConnectionPtr _connection
+)
+{
+	boost::system::error_code ignored;
+	_connection->m_deadline.cancel( ignored );
+	_connection->m_socket.close( ignored );
+}
+
+//-----------------------------------------------------------------------------
+// <MetricsEndpoint::OnDeadline>
+// Closing the socket aborts the pending read or write
+//-----------------------------------------------------------------------------
+void MetricsEndpoint::OnDeadline
+(
+	ConnectionPtr _connection,
+	boost::system::error_code const& _ec
+)
+{
+	if( _ec != boost::asio::error::operation_aborted )
+	{
+		boost::system::error_code ignored;
+		_connection->m_socket.close( ignored );
+	}
+}
@@ -0,0 +1,219 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// Metrics.h: ozwd's built-in instrumentation (GetServerMetrics, --metricsport)
+//
+// - LatencyHistogram: lock-free latency distribution with power-of-two
+//   buckets, cheap enough to record every RPC, lock and notification
+// - InstrumentedSharedMutex: a boost::shared_mutex that records how long
+//   its users wait for it and hold it, and how often they had to wait
+// - RpcMetrics: a Thrift processor event handler timing every
+//   RemoteManager call by method name
+// - MetricsEndpoint: a minimal HTTP server for Prometheus scrapes
+//
+
+#ifndef _Metrics_H
+#define _Metrics_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <TProcessor.h>
+
+// monotonic clock, µs
+inline int64_t MetricsNowUs()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct HistogramSnapshot
+{
+	// bucket 0 counts 0µs, bucket i (i > 0) [2^(i-1), 2^i) µs, the last one
+	// everything slower
+	static uint32_t const c_buckets = 28;
+
+	uint64_t	m_count;
+	uint64_t	m_sumUs;
+	uint64_t	m_maxUs;
+	uint64_t	m_buckets[c_buckets];
+
+	// upper bound of the bucket holding the _p quantile (0 < _p < 1), capped at m_maxUs
+	uint64_t Percentile( double _p ) const;
+
+	// merge another distribution into this one
+	void Add( HistogramSnapshot const& _other );
+};
+
+class LatencyHistogram : boost::noncopyable
+{
+public:
+	LatencyHistogram();
+
+	void Record( int64_t _us );
+	void GetSnapshot( HistogramSnapshot& _snapshot ) const;
+
+private:
+	boost::atomic<uint64_t>	m_count;
+	boost::atomic<uint64_t>	m_sumUs;
+	boost::atomic<uint64_t>	m_maxUs;
+	boost::atomic<uint64_t>	m_buckets[HistogramSnapshot::c_buckets];
+};
+
+// records the time until it goes out of scope
+class ScopedLatency : boost::noncopyable
+{
+public:
+	explicit ScopedLatency( LatencyHistogram& _histogram ): m_histogram( _histogram ), m_start( MetricsNowUs() ) {}
+	~ScopedLatency() { m_histogram.Record( MetricsNowUs() - m_start ); }
+
+private:
+	LatencyHistogram&	m_histogram;
+	int64_t				m_start;
+};
+
+// a drop-in for boost::shared_mutex (Lockable and SharedLockable, thus
+// usable with boost::unique_lock and boost::shared_lock)
+class InstrumentedSharedMutex : boost::noncopyable
+{
+public:
+	InstrumentedSharedMutex(): m_writeSince( 0 ), m_contended( 0 ) {}
+
+	void lock();
+	bool try_lock();
+	void unlock();
+	void lock_shared();
+	bool try_lock_shared();
+	void unlock_shared();
+
+	LatencyHistogram const& GetReadWait() const { return m_readWait; }
+	LatencyHistogram const& GetWriteWait() const { return m_writeWait; }
+	LatencyHistogram const& GetReadHold() const { return m_readHold; }
+	LatencyHistogram const& GetWriteHold() const { return m_writeHold; }
+	// acquisitions that found the mutex taken
+	uint64_t GetContended() const { return m_contended.load(); }
+
+private:
+	boost::shared_mutex					m_mutex;
+	// when the exclusive owner got the mutex; when each shared owner did
+	int64_t								m_writeSince;
+	boost::thread_specific_ptr<int64_t>	m_readSince;
+	boost::atomic<uint64_t>				m_contended;
+	LatencyHistogram					m_readWait;
+	LatencyHistogram					m_writeWait;
+	LatencyHistogram					m_readHold;
+	LatencyHistogram					m_writeHold;
+};
+
+struct RpcSnapshot
+{
+	std::string			m_name;
+	uint64_t			m_errors;
+	HistogramSnapshot	m_latency;
+};
+
+// times each call from reading its arguments to writing its result, which
+// covers every RemoteManager method, generated or not
+class RpcMetrics : public apache::thrift::TProcessorEventHandler
+{
+public:
+	RpcMetrics() {}
+	~RpcMetrics();
+
+	virtual void* getContext( char const* _fnName, void* _serverContext );
+	virtual void freeContext( void* _ctx, char const* _fnName );
+	virtual void handlerError( void* _ctx, char const* _fnName );
+
+	// all methods called so far, by name
+	void GetSnapshots( std::vector<RpcSnapshot>& _snapshots ) const;
+
+private:
+	struct Method
+	{
+		LatencyHistogram		m_latency;
+		boost::atomic<uint64_t>	m_errors;
+
+		Method(): m_errors( 0 ) {}
+	};
+
+	struct Call
+	{
+		Method*	m_method;
+		int64_t	m_start;
+	};
+
+	Method* GetMethod( char const* _fnName );
+
+	mutable boost::shared_mutex						m_mutex;
+	boost::unordered_map<std::string, Method*>		m_methods;
+};
+
+// answers every HTTP request on _port with the text _render returns
+// (Prometheus exposition format); throws if the port can't be bound. All
+// connections are served asynchronously by one thread, and one that hasn't
+// sent its request and read the answer within c_timeoutSec is closed, so a
+// stuck client can't hold up the scrapes.
+class MetricsEndpoint : boost::noncopyable
+{
+public:
+	static long const c_timeoutSec = 10;
+
+	MetricsEndpoint( uint16_t _port, boost::function<std::string()> _render );
+	~MetricsEndpoint();
+
+	// close the port and join the thread
+	void Stop();
+
+private:
+	struct Connection;
+	typedef boost::shared_ptr<Connection> ConnectionPtr;
+
+	void Run();
+	void Accept();
+	void OnAccept( ConnectionPtr _connection, boost::system::error_code const& _ec );
+	void OnRetry( boost::system::error_code const& _ec );
+	void OnRequest( ConnectionPtr _connection, boost::system::error_code const& _ec );
+	static void OnResponse( ConnectionPtr _connection );
+	static void OnDeadline( ConnectionPtr _connection, boost::system::error_code const& _ec );
+
+	boost::function<std::string()>	m_render;
+	boost::asio::io_service			m_io;
+	boost::asio::ip::tcp::acceptor	m_acceptor;
+	boost::asio::deadline_timer		m_retry;	// after a failed accept
+	boost::thread					m_thread;
+};
+
+#endif
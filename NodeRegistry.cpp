@@ -0,0 +1,440 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// NodeRegistry.cpp: indexed registry of all known OpenZWave nodes and ValueIDs
+//
+
+#include "NodeRegistry.h"
+
+#include <new>
+#include <cstring>
+
+//-----------------------------------------------------------------------------
+// <ValueState::Equals>
+//-----------------------------------------------------------------------------
+bool ValueState::Equals
+(
+	ValueState const& _other,
+	ValueID::ValueType const _type
+) const
+{
+	if( m_valid != _other.m_valid )
+	{
+		return false;
+	}
+	if( !m_valid )
+	{
+		return true;
+	}
+	switch( _type )
+	{
+		case ValueID::ValueType_Bool:
+		case ValueID::ValueType_Button:		return m_bool == _other.m_bool;
+		case ValueID::ValueType_Byte:		return m_byte == _other.m_byte;
+		case ValueID::ValueType_Decimal:	return m_float == _other.m_float;
+		case ValueID::ValueType_Int:		return m_int == _other.m_int;
+		case ValueID::ValueType_Short:		return m_short == _other.m_short;
+		case ValueID::ValueType_List:		return ( m_int == _other.m_int ) && ( m_string == _other.m_string );
+		default:							return m_string == _other.m_string;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <ValueRecord::Update>
+//-----------------------------------------------------------------------------
+bool ValueRecord::Update
+(
+	ValueState const& _state,
+	uint64 const _timestamp
+)
+{
+	m_refreshedAt = _timestamp;
+	m_stale = false;
+	if( m_state.Equals( _state, m_id.GetType() ) && ( m_changedAt != 0 ) )
+	{
+		return false;
+	}
+	m_state = _state;
+	m_changedAt = _timestamp;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::NodeRegistry>
+//-----------------------------------------------------------------------------
+NodeRegistry::NodeRegistry():
+	m_valuePool( sizeof(ValueRecord) ),
+	m_nodeCount( 0 ),
+	m_clock( 0 )
+{
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::~NodeRegistry>
+//-----------------------------------------------------------------------------
+NodeRegistry::~NodeRegistry()
+{
+	while( !m_homes.empty() )
+	{
+		RemoveHome( m_homes.begin()->first );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::GetHome>
+//-----------------------------------------------------------------------------
+NodeRegistry::HomeNodes* NodeRegistry::GetHome
+(
+	uint32 const _homeId
+) const
+{
+	std::map<uint32, HomeNodes*>::const_iterator it = m_homes.find( _homeId );
+	return ( it != m_homes.end() ) ? it->second : NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::GetNode>
+//-----------------------------------------------------------------------------
+NodeInfo* NodeRegistry::GetNode
+(
+	uint32 const _homeId,
+	uint8 const _nodeId
+) const
+{
+	HomeNodes* home = GetHome( _homeId );
+	return home ? home->m_nodes[_nodeId] : NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::AddNode>
+// Returns the existing node if it is already known
+//-----------------------------------------------------------------------------
+NodeInfo* NodeRegistry::AddNode
+(
+	uint32 const _homeId,
+	uint8 const _nodeId
+)
+{
+	HomeNodes* home = GetHome( _homeId );
+	if( !home )
+	{
+		home = new HomeNodes();
+		memset( home->m_nodes, 0, sizeof(home->m_nodes) );
+		m_homes[_homeId] = home;
+	}
+
+	NodeInfo*& slot = home->m_nodes[_nodeId];
+	if( !slot )
+	{
+		slot = new NodeInfo();
+		slot->m_homeId = _homeId;
+		slot->m_nodeId = _nodeId;
+		slot->m_polled = false;
+		slot->m_values = NULL;
+		slot->m_valueCount = 0;
+		slot->m_stale = false;
+		Touch( slot );
+		++m_nodeCount;
+	}
+	return slot;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::RemoveNode>
+// Frees the node together with all of its values
+//-----------------------------------------------------------------------------
+void NodeRegistry::RemoveNode
+(
+	uint32 const _homeId,
+	uint8 const _nodeId
+)
+{
+	HomeNodes* home = GetHome( _homeId );
+	if( home && home->m_nodes[_nodeId] )
+	{
+		DestroyNode( home->m_nodes[_nodeId] );
+		home->m_nodes[_nodeId] = NULL;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::RemoveHome>
+//-----------------------------------------------------------------------------
+void NodeRegistry::RemoveHome
+(
+	uint32 const _homeId
+)
+{
+	std::map<uint32, HomeNodes*>::iterator it = m_homes.find( _homeId );
+	if( it == m_homes.end() )
+	{
+		return;
+	}
+	HomeNodes* home = it->second;
+	for( int i = 0; i < 256; ++i )
+	{
+		if( home->m_nodes[i] )
+		{
+			DestroyNode( home->m_nodes[i] );
+		}
+	}
+	delete home;
+	m_homes.erase( it );
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::PruneStale>
+//-----------------------------------------------------------------------------
+size_t NodeRegistry::PruneStale
+(
+	uint32 const _homeId,
+	size_t& _values
+)
+{
+	HomeNodes* home = GetHome( _homeId );
+	if( !home )
+	{
+		return 0;
+	}
+	size_t nodes = 0;
+	for( int i = 0; i < 256; ++i )
+	{
+		NodeInfo* nodeInfo = home->m_nodes[i];
+		if( !nodeInfo )
+		{
+			continue;
+		}
+		if( nodeInfo->m_stale )
+		{
+			DestroyNode( nodeInfo );
+			home->m_nodes[i] = NULL;
+			++nodes;
+			continue;
+		}
+		for( ValueRecord* record = nodeInfo->m_values; record; )
+		{
+			ValueRecord* next = record->m_next;
+			if( record->m_stale )
+			{
+				RemoveValue( record->m_id );
+				++_values;
+			}
+			record = next;
+		}
+	}
+	return nodes;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::GetNodes>
+// All known nodes, by homeId then nodeId
+//-----------------------------------------------------------------------------
+void NodeRegistry::GetNodes
+(
+	std::vector<NodeInfo*>& _nodes
+) const
+{
+	_nodes.reserve( _nodes.size() + m_nodeCount );
+	for( std::map<uint32, HomeNodes*>::const_iterator it = m_homes.begin(); it != m_homes.end(); ++it )
+	{
+		for( int i = 0; i < 256; ++i )
+		{
+			if( NodeInfo* nodeInfo = it->second->m_nodes[i] )
+			{
+				_nodes.push_back( nodeInfo );
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::GetValue>
+//-----------------------------------------------------------------------------
+ValueRecord* NodeRegistry::GetValue
+(
+	ValueID const& _id
+) const
+{
+	ValueIndex::const_iterator it = m_index.find( KeyOf( _id ) );
+	return ( it != m_index.end() ) ? it->second : NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::AddValue>
+// Returns the existing record if the value is already known
+//-----------------------------------------------------------------------------
+ValueRecord* NodeRegistry::AddValue
+(
+	ValueID const& _id
+)
+{
+	NodeInfo* nodeInfo = GetNode( _id.GetHomeId(), _id.GetNodeId() );
+	if( !nodeInfo )
+	{
+		return NULL;
+	}
+
+	std::pair<ValueIndex::iterator, bool> res = m_index.insert( ValueIndex::value_type( KeyOf( _id ), (ValueRecord*)NULL ) );
+	if( !res.second )
+	{
+		return res.first->second;
+	}
+
+	void* mem = m_valuePool.malloc();
+	if( !mem )
+	{
+		m_index.erase( res.first );
+		throw std::bad_alloc();
+	}
+	ValueRecord* record = new (mem) ValueRecord( _id, nodeInfo );
+	// push front into the node's value list
+	record->m_next = nodeInfo->m_values;
+	if( nodeInfo->m_values )
+	{
+		nodeInfo->m_values->m_prev = record;
+	}
+	nodeInfo->m_values = record;
+	++nodeInfo->m_valueCount;
+
+	res.first->second = record;
+	m_order[KeyOf( _id )] = record;
+	return record;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::RemoveValue>
+//-----------------------------------------------------------------------------
+bool NodeRegistry::RemoveValue
+(
+	ValueID const& _id
+)
+{
+	ValueIndex::iterator it = m_index.find( KeyOf( _id ) );
+	if( it == m_index.end() )
+	{
+		return false;
+	}
+	ValueRecord* record = it->second;
+	m_index.erase( it );
+	m_order.erase( KeyOf( _id ) );
+
+	NodeInfo* nodeInfo = record->m_node;
+	if( record->m_prev )
+	{
+		record->m_prev->m_next = record->m_next;
+	}
+	else
+	{
+		nodeInfo->m_values = record->m_next;
+	}
+	if( record->m_next )
+	{
+		record->m_next->m_prev = record->m_prev;
+	}
+	--nodeInfo->m_valueCount;
+
+	DestroyValue( record );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::GetValueIDs>
+// All known ValueIDs, grouped by node
+//-----------------------------------------------------------------------------
+void NodeRegistry::GetValueIDs
+(
+	std::vector<ValueID>& _values
+) const
+{
+	std::vector<NodeInfo*> nodes;
+	GetNodes( nodes );
+	_values.reserve( _values.size() + m_index.size() );
+	for( std::vector<NodeInfo*>::iterator it = nodes.begin(); it != nodes.end(); ++it )
+	{
+		for( ValueRecord* record = (*it)->m_values; record; record = record->m_next )
+		{
+			_values.push_back( record->m_id );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::GetValuesPage>
+// A stable cursor: GetId() orders values regardless of when they were added
+//-----------------------------------------------------------------------------
+bool NodeRegistry::GetValuesPage
+(
+	uint32 const _homeId,
+	uint64 const _after,
+	size_t const _limit,
+	std::vector<ValueRecord const*>& _page
+) const
+{
+	_page.clear();
+	ValueOrder::const_iterator it = m_order.upper_bound( ValueKey( _homeId, _after ) );
+	for( ; ( it != m_order.end() ) && ( it->first.first == _homeId ); ++it )
+	{
+		if( _page.size() == _limit )
+		{
+			return true;
+		}
+		_page.push_back( it->second );
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::DestroyNode>
+//-----------------------------------------------------------------------------
+void NodeRegistry::DestroyNode
+(
+	NodeInfo* _nodeInfo
+)
+{
+	ValueRecord* record = _nodeInfo->m_values;
+	while( record )
+	{
+		ValueRecord* next = record->m_next;
+		m_index.erase( KeyOf( record->m_id ) );
+		m_order.erase( KeyOf( record->m_id ) );
+		DestroyValue( record );
+		record = next;
+	}
+	delete _nodeInfo;
+	--m_nodeCount;
+}
+
+//-----------------------------------------------------------------------------
+// <NodeRegistry::DestroyValue>
+// Gives the record back to the pool
+//-----------------------------------------------------------------------------
+void NodeRegistry::DestroyValue
+(
+	ValueRecord* _record
+)
+{
+	_record->~ValueRecord();
+	m_valuePool.free( _record );
+}
@@ -0,0 +1,190 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// NodeRegistry.h: indexed registry of all known OpenZWave nodes and ValueIDs
+//
+// Nodes live in a direct-indexed table per homeId (node IDs are 8-bit),
+// values in a hash index keyed on (homeId, ValueID::GetId()); value records
+// come from a memory pool and are chained per node, so that adding, removing
+// and looking up either is O(1) and a leaving node gives back all its memory.
+// An ordered index on the same key serves GetValuesPage, a page costing
+// O(log n + page size).
+//
+// Each value record also caches the last known typed value of its ValueID,
+// as reported by OpenZWave notifications, so that clients can read values
+// without going through OpenZWave::Manager.
+//
+// After a warm start (see ozwd's --snapshot), nodes and values restored from
+// the snapshot are marked stale until OpenZWave reports them again; those it
+// never reports are pruned once it has queried all nodes.
+//
+// The registry does no locking of its own: ozwd keeps one per network, in
+// its HomeShard, and callers hold that shard's m_registryLock (exclusively
+// to modify it, shared to read it), after the network's HomeLock if they
+// take both.
+//
+
+#ifndef _NodeRegistry_H
+#define _NodeRegistry_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <utility>
+
+#include <boost/pool/pool.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "Defs.h"
+#include "ValueID.h"
+
+using OpenZWave::ValueID;
+
+// milliseconds since the Unix epoch, used to timestamp value changes
+inline uint64 GetTimestampMs()
+{
+	static boost::posix_time::ptime const epoch( boost::gregorian::date( 1970, 1, 1 ) );
+	return (uint64)( boost::posix_time::microsec_clock::universal_time() - epoch ).total_milliseconds();
+}
+
+// a typed value as read from OpenZWave, which member is valid depends
+// on the ValueID's type (List values fill both m_int and m_string)
+struct ValueState
+{
+	bool		m_valid;
+	union
+	{
+		bool	m_bool;		// Bool, Button
+		uint8	m_byte;		// Byte
+		float	m_float;	// Decimal
+		int32	m_int;		// Int, List (selected index)
+		int16	m_short;	// Short
+	};
+	std::string	m_string;	// String, List (selected item), Schedule, Raw (bytes)
+
+	ValueState(): m_valid( false ), m_int( 0 ) {}
+	bool Equals( ValueState const& _other, ValueID::ValueType const _type ) const;
+};
+
+struct NodeInfo;
+
+// a known ValueID, chained into its node's value list
+struct ValueRecord
+{
+	ValueID			m_id;
+	NodeInfo*		m_node;
+	ValueRecord*	m_prev;
+	ValueRecord*	m_next;
+
+	// last known value
+	ValueState		m_state;
+	uint64			m_changedAt;	// ms, last time the value actually changed
+	uint64			m_refreshedAt;	// ms, last time OpenZWave reported it
+	bool			m_stale;		// restored from a snapshot, not reported since
+
+	ValueRecord( ValueID const& _id, NodeInfo* _node ):
+		m_id( _id ), m_node( _node ), m_prev( NULL ), m_next( NULL ),
+		m_changedAt( 0 ), m_refreshedAt( 0 ), m_stale( false ) {}
+
+	// store a freshly read value (which is no longer stale), returns true
+	// if it differs from the cached one
+	bool Update( ValueState const& _state, uint64 const _timestamp );
+};
+
+struct NodeInfo
+{
+	uint32			m_homeId;
+	uint8			m_nodeId;
+	bool			m_polled;
+	ValueRecord*	m_values;		// head of the node's value list
+	uint32			m_valueCount;
+	uint64			m_version;		// bumped by NodeRegistry::Touch
+	bool			m_stale;		// restored from a snapshot, not reported since
+};
+
+class NodeRegistry
+{
+public:
+	NodeRegistry();
+	~NodeRegistry();
+
+	// nodes
+	NodeInfo* GetNode( uint32 const _homeId, uint8 const _nodeId ) const;
+	NodeInfo* AddNode( uint32 const _homeId, uint8 const _nodeId );
+	void RemoveNode( uint32 const _homeId, uint8 const _nodeId );
+	// forget everything about a driver (DriverReset / DriverRemoved)
+	void RemoveHome( uint32 const _homeId );
+	// forget the stale nodes and values of a driver, returns the number of
+	// nodes removed and adds the number of values removed from the remaining
+	// nodes to _values
+	size_t PruneStale( uint32 const _homeId, size_t& _values );
+	void GetNodes( std::vector<NodeInfo*>& _nodes ) const;
+	// mark a node as changed: versions are unique registry-wide, so a node
+	// that left and came back never reuses an old version
+	void Touch( NodeInfo* _nodeInfo ) { _nodeInfo->m_version = ++m_clock; }
+
+	// values (AddValue returns NULL if the node is unknown)
+	ValueRecord* GetValue( ValueID const& _id ) const;
+	ValueRecord* AddValue( ValueID const& _id );
+	bool RemoveValue( ValueID const& _id );
+	void GetValueIDs( std::vector<ValueID>& _values ) const;
+	// at most _limit values of a network whose ValueID::GetId() is above
+	// _after, in ascending GetId() order; returns true if more would follow
+	bool GetValuesPage( uint32 const _homeId, uint64 const _after, size_t const _limit,
+		std::vector<ValueRecord const*>& _page ) const;
+
+	size_t GetNodeCount() const { return m_nodeCount; }
+	size_t GetValueCount() const { return m_index.size(); }
+
+private:
+	typedef std::pair<uint32, uint64>	ValueKey;
+	typedef boost::unordered_map<ValueKey, ValueRecord*>	ValueIndex;
+	typedef std::map<ValueKey, ValueRecord*>				ValueOrder;
+
+	// direct-indexed node table of one Z-Wave network
+	struct HomeNodes
+	{
+		NodeInfo*	m_nodes[256];
+	};
+
+	static ValueKey KeyOf( ValueID const& _id ) { return ValueKey( _id.GetHomeId(), _id.GetId() ); }
+
+	HomeNodes* GetHome( uint32 const _homeId ) const;
+	void DestroyNode( NodeInfo* _nodeInfo );
+	void DestroyValue( ValueRecord* _record );
+
+	NodeRegistry( NodeRegistry const& );	// no copies
+	NodeRegistry& operator=( NodeRegistry const& );
+
+	std::map<uint32, HomeNodes*>	m_homes;	// a handful of drivers at most
+	ValueIndex						m_index;
+	ValueOrder						m_order;	// the same values, by homeId then GetId()
+	boost::pool<>					m_valuePool;
+	size_t							m_nodeCount;
+	uint64							m_clock;
+};
+
+#endif
@@ -0,0 +1,265 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// NotificationCapture.cpp: a recording of the notification stream
+//
+
+#include "NotificationCapture.h"
+
+#include <stdexcept>
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using apache::thrift::transport::TMemoryBuffer;
+using apache::thrift::protocol::TCompactProtocol;
+using OpenZWave::RemoteNotification;
+
+char const NotificationCapture::c_magic[8] = { 'O', 'Z', 'W', 'D', 'C', 'A', 'P', '1' };
+
+// anything longer is not a record but garbage
+static uint32_t const c_maxRecord = 1 << 20;
+
+//-----------------------------------------------------------------------------
+// <NotificationCapture::NotificationCapture>
+//-----------------------------------------------------------------------------
+NotificationCapture::NotificationCapture
+(
+	std::string const& _path
+):
+	m_file( fopen( _path.c_str(), "wb" ) ),
+	m_buffer( new TMemoryBuffer( 256 ) ),
+	m_records( 0 ),
+	m_bytes( 0 ),
+	m_failed( false ),
+	m_stopping( false )
+{
+	if( !m_file )
+	{
+		throw std::runtime_error( "can't create " + _path + ": " + strerror( errno ) );
+	}
+	m_protocol.reset( new TCompactProtocol( m_buffer ) );
+	m_pending.reserve( c_writeChunk );
+	m_writing.reserve( c_writeChunk );
+	if( fwrite( c_magic, sizeof(c_magic), 1, m_file ) != 1 )
+	{
+		fclose( m_file );
+		throw std::runtime_error( "can't write " + _path + ": " + strerror( errno ) );
+	}
+	m_bytes = sizeof(c_magic);
+	m_thread = boost::thread( boost::bind( &NotificationCapture::Run, this ) );
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationCapture::~NotificationCapture>
+//-----------------------------------------------------------------------------
+NotificationCapture::~NotificationCapture()
+{
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		m_stopping = true;
+		m_wakeCond.notify_one();
+	}
+	m_thread.join();
+	WriteOut();
+	fclose( m_file );
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationCapture::Run>
+// The writer thread
+//-----------------------------------------------------------------------------
+void NotificationCapture::Run()
+{
+	boost::unique_lock<boost::mutex> lock( m_mutex );
+	while( !m_stopping )
+	{
+		if( m_pending.size() < c_writeChunk )
+		{
+			m_wakeCond.timed_wait( lock, boost::posix_time::milliseconds( (long)c_flushMs ) );
+		}
+		lock.unlock();
+		WriteOut();
+		lock.lock();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationCapture::WriteOut>
+// Only the swap happens under m_mutex, Record never waits for the write
+//-----------------------------------------------------------------------------
+void NotificationCapture::WriteOut()
+{
+	boost::lock_guard<boost::mutex> fileLock( m_fileMutex );
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		// what is pending ends at a record, even once the capture stopped
+		if( m_pending.empty() )
+		{
+			return;
+		}
+		m_writing.swap( m_pending );
+	}
+	bool const ok = ( fwrite( m_writing.data(), m_writing.size(), 1, m_file ) == 1 ) && ( fflush( m_file ) == 0 );
+	m_writing.clear();
+	if( !ok )
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		m_failed = true;
+		m_pending.clear();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationCapture::Record>
+//-----------------------------------------------------------------------------
+void NotificationCapture::Record
+(
+	RemoteNotification const& _notification
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	if( m_failed )
+	{
+		return;
+	}
+	m_buffer->resetBuffer();
+	_notification.write( m_protocol.get() );
+	uint8_t* data;
+	uint32_t size;
+	m_buffer->getBuffer( &data, &size );
+	uint8_t const length[4] = { (uint8_t)size, (uint8_t)( size >> 8 ), (uint8_t)( size >> 16 ), (uint8_t)( size >> 24 ) };
+	if( m_pending.size() + sizeof(length) + size > c_maxPending )
+	{
+		// the writer is stuck: end the capture rather than grow without bound
+		std::cerr << "NotificationCapture: the disk can't keep up, capture stopped after "
+			<< m_records << " records" << std::endl;
+		m_failed = true;
+		return;
+	}
+	m_pending.append( (char const*)length, sizeof(length) );
+	m_pending.append( (char const*)data, size );
+	++m_records;
+	m_bytes += sizeof(length) + size;
+	if( m_pending.size() >= c_writeChunk )
+	{
+		m_wakeCond.notify_one();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationCapture::Flush>
+//-----------------------------------------------------------------------------
+void NotificationCapture::Flush()
+{
+	WriteOut();
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationCapture::GetRecords>
+//-----------------------------------------------------------------------------
+uint64_t NotificationCapture::GetRecords() const
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	return m_records;
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationCapture::GetBytes>
+//-----------------------------------------------------------------------------
+uint64_t NotificationCapture::GetBytes() const
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	return m_bytes;
+}
+
+//-----------------------------------------------------------------------------
+// <CaptureReader::CaptureReader>
+//-----------------------------------------------------------------------------
+CaptureReader::CaptureReader
+(
+	std::string const& _path
+):
+	m_file( fopen( _path.c_str(), "rb" ) )
+{
+	if( !m_file )
+	{
+		throw std::runtime_error( "can't open " + _path + ": " + strerror( errno ) );
+	}
+	char magic[sizeof(NotificationCapture::c_magic)];
+	if( ( fread( magic, sizeof(magic), 1, m_file ) != 1 ) || ( memcmp( magic, NotificationCapture::c_magic, sizeof(magic) ) != 0 ) )
+	{
+		fclose( m_file );
+		throw std::runtime_error( _path + " is not an ozwd capture" );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <CaptureReader::~CaptureReader>
+//-----------------------------------------------------------------------------
+CaptureReader::~CaptureReader()
+{
+	fclose( m_file );
+}
+
+//-----------------------------------------------------------------------------
+// <CaptureReader::Next>
+//-----------------------------------------------------------------------------
+bool CaptureReader::Next
+(
+	RemoteNotification& _notification
+)
+{
+	uint8_t length[4];
+	if( fread( length, sizeof(length), 1, m_file ) != 1 )
+	{
+		return false;
+	}
+	uint32_t const size = length[0] | ( length[1] << 8 ) | ( length[2] << 16 ) | ( (uint32_t)length[3] << 24 );
+	if( ( size == 0 ) || ( size > c_maxRecord ) )
+	{
+		return false;
+	}
+	m_record.resize( size );
+	if( fread( &m_record[0], size, 1, m_file ) != 1 )
+	{
+		return false;
+	}
+	try
+	{
+		boost::shared_ptr<TMemoryBuffer> buffer( new TMemoryBuffer( &m_record[0], size ) );
+		TCompactProtocol protocol( buffer );
+		_notification = RemoteNotification();
+		_notification.read( &protocol );
+	}
+	catch( std::exception& )
+	{
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,120 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// NotificationCapture.h: a recording of the notification stream (--capture)
+//
+// NotificationCapture appends every notification ozwd receives to a file, as
+// the RemoteNotification it publishes (type, homeId, node, byte, timestamp,
+// ValueID and the value read with it): after an 8-byte magic, each record is
+// a little-endian 32-bit length followed by the TCompactProtocol-serialized
+// struct. Record only appends to an in-memory buffer; a thread of the
+// capture swaps it for a second one every c_flushMs (or once c_writeChunk
+// bytes are waiting) and writes that out without holding the lock Record
+// takes, so the driver thread never waits for the disk, and a quiet
+// network's last notifications still reach it. If more than c_maxPending
+// bytes pile up (the disk stalls), the capture stops there, as it does when
+// a write fails; a record cut short by a crash simply ends the capture.
+//
+// CaptureReader reads a capture back, e.g. for ozwd-bench --replay, which
+// feeds it through ozwd's notification handling without a controller.
+//
+
+#ifndef _NotificationCapture_H
+#define _NotificationCapture_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <stdint.h>
+
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <transport/TBufferTransports.h>
+#include <protocol/TCompactProtocol.h>
+
+#include "ozw_types.h"
+
+class NotificationCapture : boost::noncopyable
+{
+public:
+	static uint32_t const c_flushMs = 1000;
+	static size_t const c_writeChunk = 1 << 16;
+	static size_t const c_maxPending = 1 << 24;
+
+	// create (or truncate) _path and start the flush thread; throws
+	// std::runtime_error if it can't
+	explicit NotificationCapture( std::string const& _path );
+	~NotificationCapture();
+
+	// append a notification, from any thread
+	void Record( OpenZWave::RemoteNotification const& _notification );
+	// write out and flush what was recorded so far
+	void Flush();
+
+	uint64_t GetRecords() const;
+	uint64_t GetBytes() const;
+
+	static char const c_magic[8];
+
+private:
+	void Run();
+	void WriteOut();
+
+	// the writer's, guarded by m_fileMutex (taken before m_mutex)
+	boost::mutex	m_fileMutex;
+	FILE*			m_file;
+	std::string		m_writing;
+
+	mutable boost::mutex	m_mutex;		// guards all of the below
+	boost::shared_ptr<apache::thrift::transport::TMemoryBuffer>	m_buffer;
+	boost::shared_ptr<apache::thrift::protocol::TCompactProtocol>	m_protocol;
+	std::string	m_pending;		// records not handed to the writer yet
+	uint64_t	m_records;
+	uint64_t	m_bytes;
+	bool		m_failed;		// a write failed, the capture stopped there
+	bool		m_stopping;
+	boost::condition_variable	m_wakeCond;
+	boost::thread				m_thread;
+};
+
+class CaptureReader : boost::noncopyable
+{
+public:
+	// throws std::runtime_error if _path can't be read or isn't a capture
+	explicit CaptureReader( std::string const& _path );
+	~CaptureReader();
+
+	// the next notification; false at the end of the capture (or of what
+	// is left of it)
+	bool Next( OpenZWave::RemoteNotification& _notification );
+
+private:
+	FILE*					m_file;
+	std::vector<uint8_t>	m_record;
+};
+
+#endif
@@ -0,0 +1,675 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// NotificationPublisher.cpp: asynchronous STOMP publisher for OpenZWave notifications
+//
+
+#include "NotificationPublisher.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+// max. number of events sent per publisher wakeup
+static const size_t c_batchSize = 64;
+// max. number of events kept for reuse
+static const size_t c_freeEvents = 256;
+// max. time the publisher thread sleeps between checks
+static const uint64_t c_idleMs = 100;
+static const uint64_t c_never = std::numeric_limits<uint64_t>::max();
+
+//-----------------------------------------------------------------------------
+// <NowMs>
+//-----------------------------------------------------------------------------
+static uint64_t NowMs()
+{
+	static boost::posix_time::ptime const start = boost::posix_time::microsec_clock::universal_time();
+	return (uint64_t)( boost::posix_time::microsec_clock::universal_time() - start ).total_milliseconds();
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::NotificationPublisher>
+//-----------------------------------------------------------------------------
+NotificationPublisher::NotificationPublisher
+(
+	STOMP::BoostStomp* _stomp,
+	std::string const& _topic,
+	uint32_t _capacity,
+	OverflowPolicy _policy
+):
+	m_stomp( _stomp ),
+	m_topic( _topic ),
+	m_capacity( _capacity ),
+	m_policy( _policy ),
+	m_queue( _capacity ),
+	m_free( c_freeEvents ),
+	m_overflowCount( 0 ),
+	m_interval( 0 ),
+	m_suppressUnchanged( false ),
+	m_heldCount( 0 ),
+	m_nextRelease( c_never ),
+	m_sleeping( false ),
+	m_running( false ),
+	m_depth( 0 ),
+	m_maxDepth( 0 ),
+	m_enqueued( 0 ),
+	m_published( 0 ),
+	m_dropped( 0 ),
+	m_coalesced( 0 ),
+	m_blocked( 0 ),
+	m_sendFailures( 0 ),
+	m_batches( 0 ),
+	m_rateLimited( 0 ),
+	m_suppressed( 0 )
+{
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::~NotificationPublisher>
+//-----------------------------------------------------------------------------
+NotificationPublisher::~NotificationPublisher()
+{
+	Stop();
+	StompEvent* event;
+	while( m_queue.pop( event ) )
+	{
+		delete event;
+	}
+	for( std::map<uint64_t, StompEvent*>::iterator it = m_overflow.begin(); it != m_overflow.end(); ++it )
+	{
+		delete it->second;
+	}
+	for( std::map<uint64_t, StompEvent*>::iterator it = m_held.begin(); it != m_held.end(); ++it )
+	{
+		delete it->second;
+	}
+	while( m_free.pop( event ) )
+	{
+		delete event;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::SetRateLimit>
+//-----------------------------------------------------------------------------
+void NotificationPublisher::SetRateLimit
+(
+	uint32_t _windowMs,
+	uint32_t _maxRate,
+	bool _suppressUnchanged
+)
+{
+	m_interval = _windowMs;
+	if( _maxRate > 0 )
+	{
+		uint32_t const spacing = ( 1000 + _maxRate - 1 ) / _maxRate;
+		if( spacing > m_interval )
+		{
+			m_interval = spacing;
+		}
+	}
+	m_suppressUnchanged = _suppressUnchanged;
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Start>
+//-----------------------------------------------------------------------------
+void NotificationPublisher::Start()
+{
+	m_running = true;
+	m_thread = boost::thread( boost::bind( &NotificationPublisher::Run, this ) );
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Stop>
+//-----------------------------------------------------------------------------
+void NotificationPublisher::Stop()
+{
+	if( !m_running.exchange( false ) )
+	{
+		return;
+	}
+	{
+		boost::lock_guard<boost::mutex> lock( m_wakeMutex );
+		m_wakeCond.notify_one();
+	}
+	m_thread.join();
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Acquire>
+// No allocation once the free list is warm: the strings keep their capacity
+//-----------------------------------------------------------------------------
+StompEvent* NotificationPublisher::Acquire()
+{
+	StompEvent* event;
+	if( !m_free.pop( event ) )
+	{
+		event = new StompEvent();
+		event->m_pooled = true;
+		return event;
+	}
+	event->m_body.clear();
+	event->m_coalesceKey = 0;
+	event->m_unchanged = false;
+	event->m_routes.clear();
+	event->m_nodeId = 0;
+	event->m_removal = Removal_None;
+	event->m_removedKey = 0;
+	event->m_receivedUs = MetricsNowUs();
+	return event;
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Recycle>
+// Done with an event: back to the free list if it came from there
+//-----------------------------------------------------------------------------
+void NotificationPublisher::Recycle
+(
+	StompEvent* _event
+)
+{
+	if( !_event->m_pooled || !m_free.bounded_push( _event ) )
+	{
+		delete _event;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Publish>
+// Called from the OpenZWave driver thread and the Thrift workers: never
+// touches the network, only blocks under Overflow_Block with a full queue
+//-----------------------------------------------------------------------------
+void NotificationPublisher::Publish
+(
+	StompEvent* _event
+)
+{
+	if( _event->m_unchanged && m_suppressUnchanged )
+	{
+		++m_suppressed;
+		Recycle( _event );
+		return;
+	}
+	if( _event->m_removal != Removal_None )
+	{
+		DropObsolete( _event );
+	}
+	if( ( m_interval > 0 ) && ( _event->m_coalesceKey != 0 ) && Hold( _event ) )
+	{
+		return;
+	}
+
+	bool const coalescable = ( m_policy == Overflow_Coalesce ) && ( _event->m_coalesceKey != 0 );
+	// keep per-key ordering: while older events for a key are parked, park the newer ones too
+	if( coalescable && ( m_overflowCount.load() > 0 ) )
+	{
+		Park( _event );
+		WakeUp();
+		return;
+	}
+
+	++m_depth;
+	while( !m_queue.bounded_push( _event ) )
+	{
+		if( m_policy == Overflow_DropOldest )
+		{
+			StompEvent* oldest;
+			if( m_queue.pop( oldest ) )
+			{
+				--m_depth;
+				++m_dropped;
+				Recycle( oldest );
+			}
+			continue;
+		}
+		if( coalescable )
+		{
+			--m_depth;
+			Park( _event );
+			WakeUp();
+			return;
+		}
+		// Overflow_Block (or a non-coalescable event): wait for the publisher to make room
+		++m_blocked;
+		WakeUp();
+		boost::unique_lock<boost::mutex> lock( m_wakeMutex );
+		m_roomCond.timed_wait( lock, boost::posix_time::milliseconds( 10 ) );
+	}
+	++m_enqueued;
+
+	uint32_t const depth = m_depth.load();
+	uint32_t maxDepth = m_maxDepth.load();
+	while( ( depth > maxDepth ) && !m_maxDepth.compare_exchange_weak( maxDepth, depth ) )
+	{
+	}
+	WakeUp();
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Park>
+// Overflow_Coalesce: keep only the latest event per key until there's room
+//-----------------------------------------------------------------------------
+void NotificationPublisher::Park
+(
+	StompEvent* _event
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_overflowMutex );
+	++m_enqueued;
+	std::map<uint64_t, StompEvent*>::iterator it = m_overflow.find( _event->m_coalesceKey );
+	if( it != m_overflow.end() )
+	{
+		Recycle( it->second );
+		it->second = _event;
+		++m_coalesced;
+	}
+	else
+	{
+		m_overflow[_event->m_coalesceKey] = _event;
+		++m_overflowCount;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Obsoletes>
+// Whether the update of value _key (of node _nodeId) is obsolete after _removal
+//-----------------------------------------------------------------------------
+bool NotificationPublisher::Obsoletes
+(
+	StompEvent const* _removal,
+	uint64_t _key,
+	uint8_t _nodeId
+)
+{
+	switch( _removal->m_removal )
+	{
+		case Removal_Value:		return _key == _removal->m_removedKey;
+		case Removal_Node:		return _nodeId == _removal->m_nodeId;
+		case Removal_Home:		return true;
+		default:				return false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::DropObsolete>
+// Before a removal is queued: the parked and held updates of what it
+// removes would go out after it (Drain sends them once the queue is empty),
+// drop them, and forget when its values last went out
+//-----------------------------------------------------------------------------
+void NotificationPublisher::DropObsolete
+(
+	StompEvent const* _removal
+)
+{
+	if( m_overflowCount.load() > 0 )
+	{
+		boost::lock_guard<boost::mutex> lock( m_overflowMutex );
+		std::map<uint64_t, StompEvent*>::iterator it = m_overflow.begin();
+		while( it != m_overflow.end() )
+		{
+			if( Obsoletes( _removal, it->first, it->second->m_nodeId ) )
+			{
+				Recycle( it->second );
+				m_overflow.erase( it++ );
+				++m_coalesced;
+			}
+			else
+			{
+				++it;
+			}
+		}
+		m_overflowCount = (uint32_t)m_overflow.size();
+	}
+	if( m_interval > 0 )
+	{
+		boost::lock_guard<boost::mutex> lock( m_holdMutex );
+		std::map<uint64_t, StompEvent*>::iterator it = m_held.begin();
+		while( it != m_held.end() )
+		{
+			if( Obsoletes( _removal, it->first, it->second->m_nodeId ) )
+			{
+				Recycle( it->second );
+				m_held.erase( it++ );
+				++m_rateLimited;
+			}
+			else
+			{
+				++it;
+			}
+		}
+		m_heldCount = (uint32_t)m_held.size();
+		boost::unordered_map<uint64_t, LastSent>::iterator last = m_lastSent.begin();
+		while( last != m_lastSent.end() )
+		{
+			if( Obsoletes( _removal, last->first, last->second.m_nodeId ) )
+			{
+				last = m_lastSent.erase( last );
+			}
+			else
+			{
+				++last;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Hold>
+// Rate limiting: returns false if the event's key is outside its window and
+// the event may go out right away, else keeps it as the latest one of the
+// window (superseding any event already held for that key)
+//-----------------------------------------------------------------------------
+bool NotificationPublisher::Hold
+(
+	StompEvent* _event
+)
+{
+	uint64_t const now = NowMs();
+	bool earlier = false;
+	{
+		boost::lock_guard<boost::mutex> lock( m_holdMutex );
+		std::map<uint64_t, StompEvent*>::iterator it = m_held.find( _event->m_coalesceKey );
+		if( it != m_held.end() )
+		{
+			Recycle( it->second );
+			it->second = _event;
+			++m_enqueued;
+			++m_rateLimited;
+			return true;
+		}
+
+		boost::unordered_map<uint64_t, LastSent>::iterator last = m_lastSent.find( _event->m_coalesceKey );
+		if( ( last == m_lastSent.end() ) || ( last->second.m_at + m_interval <= now ) )
+		{
+			LastSent const sent = { now, _event->m_nodeId };
+			m_lastSent[_event->m_coalesceKey] = sent;
+			return false;
+		}
+
+		m_held[_event->m_coalesceKey] = _event;
+		++m_heldCount;
+		++m_enqueued;
+		uint64_t const due = last->second.m_at + m_interval;
+		if( due < m_nextRelease.load() )
+		{
+			m_nextRelease = due;
+			earlier = true;
+		}
+	}
+	// the publisher thread may be sleeping past the end of this window
+	if( earlier )
+	{
+		WakeUp();
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::ReleaseHeld>
+// Send the held events whose window has closed (all of them once stopped)
+//-----------------------------------------------------------------------------
+size_t NotificationPublisher::ReleaseHeld()
+{
+	bool const all = !m_running.load();
+	uint64_t const now = NowMs();
+	if( !all && ( now < m_nextRelease.load() ) )
+	{
+		return 0;
+	}
+
+	std::vector<StompEvent*> due;
+	{
+		boost::lock_guard<boost::mutex> lock( m_holdMutex );
+		uint64_t next = c_never;
+		std::map<uint64_t, StompEvent*>::iterator it = m_held.begin();
+		while( it != m_held.end() )
+		{
+			LastSent& last = m_lastSent[it->first];
+			uint64_t& lastSent = last.m_at;
+			if( all || ( lastSent + m_interval <= now ) )
+			{
+				due.push_back( it->second );
+				lastSent = now;
+				last.m_nodeId = it->second->m_nodeId;
+				m_held.erase( it++ );
+			}
+			else
+			{
+				if( lastSent + m_interval < next )
+				{
+					next = lastSent + m_interval;
+				}
+				++it;
+			}
+		}
+		m_nextRelease = next;
+		m_heldCount = (uint32_t)m_held.size();
+	}
+
+	for( std::vector<StompEvent*>::iterator it = due.begin(); it != due.end(); ++it )
+	{
+		Send( *it );
+	}
+	return due.size();
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::WakeUp>
+//-----------------------------------------------------------------------------
+void NotificationPublisher::WakeUp()
+{
+	if( m_sleeping.load() )
+	{
+		boost::lock_guard<boost::mutex> lock( m_wakeMutex );
+		m_wakeCond.notify_one();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Run>
+// The publisher thread
+//-----------------------------------------------------------------------------
+void NotificationPublisher::Run()
+{
+	while( m_running.load() )
+	{
+		if( Drain() > 0 )
+		{
+			++m_batches;
+			m_roomCond.notify_all();
+			continue;
+		}
+		boost::unique_lock<boost::mutex> lock( m_wakeMutex );
+		m_sleeping = true;
+		if( m_queue.empty() && ( m_overflowCount.load() == 0 ) && m_running.load() )
+		{
+			// sleep until woken up, or until the next rate limit window closes
+			uint64_t timeout = c_idleMs;
+			uint64_t const next = m_nextRelease.load();
+			if( next != c_never )
+			{
+				uint64_t const now = NowMs();
+				timeout = ( next > now ) ? std::min( next - now, c_idleMs ) : 0;
+			}
+			m_wakeCond.timed_wait( lock, boost::posix_time::milliseconds( (long)timeout ) );
+		}
+		m_sleeping = false;
+	}
+	// flush what's left before leaving
+	while( Drain() > 0 )
+	{
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Drain>
+// Send up to one batch of events, parked (coalesced) ones go out only after
+// the queue has been emptied so that they are never overtaken by later
+// updates of their value (a removal drops them instead, see DropObsolete).
+// Each event is still a STOMP frame of its own: BoostStomp sends one frame
+// per send() call
+//-----------------------------------------------------------------------------
+size_t NotificationPublisher::Drain()
+{
+	size_t count = 0;
+	StompEvent* event;
+	while( ( count < c_batchSize ) && m_queue.pop( event ) )
+	{
+		--m_depth;
+		Send( event );
+		++count;
+	}
+
+	if( ( count < c_batchSize ) && ( m_overflowCount.load() > 0 ) )
+	{
+		std::map<uint64_t, StompEvent*> parked;
+		{
+			boost::lock_guard<boost::mutex> lock( m_overflowMutex );
+			parked.swap( m_overflow );
+			m_overflowCount = 0;
+		}
+		for( std::map<uint64_t, StompEvent*>::iterator it = parked.begin(); it != parked.end(); ++it )
+		{
+			Send( it->second );
+			++count;
+		}
+	}
+
+	// rate limited events, last so that they are never overtaken either
+	if( count < c_batchSize )
+	{
+		count += ReleaseHeld();
+	}
+	return count;
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::Send>
+//-----------------------------------------------------------------------------
+void NotificationPublisher::Send
+(
+	StompEvent* _event
+)
+{
+	ScopedLatency timer( m_sendLatency );
+	try
+	{
+		if( m_stomp->send( m_topic, _event->m_headers, _event->m_body ) )
+		{
+			++m_published;
+		}
+		else
+		{
+			++m_sendFailures;
+		}
+		// copies for the TopicRouter routes it matched (BoostStomp::send
+		// takes the topic by non-const reference)
+		for( std::vector<std::string>::iterator it = _event->m_routes.begin(); it != _event->m_routes.end(); ++it )
+		{
+			if( !m_stomp->send( *it, _event->m_headers, _event->m_body ) )
+			{
+				++m_sendFailures;
+			}
+		}
+	}
+	catch( std::exception& e )
+	{
+		++m_sendFailures;
+		std::cerr << "NotificationPublisher: STOMP send failed: " << e.what() << std::endl;
+	}
+	m_publishLatency.Record( MetricsNowUs() - _event->m_receivedUs );
+	Recycle( _event );
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::GetStatistics>
+//-----------------------------------------------------------------------------
+void NotificationPublisher::GetStatistics
+(
+	PublisherStatistics& _stats
+) const
+{
+	_stats.m_capacity = m_capacity;
+	_stats.m_depth = m_depth.load() + m_overflowCount.load() + m_heldCount.load();
+	_stats.m_maxDepth = m_maxDepth.load();
+	_stats.m_enqueued = m_enqueued.load();
+	_stats.m_published = m_published.load();
+	_stats.m_dropped = m_dropped.load();
+	_stats.m_coalesced = m_coalesced.load();
+	_stats.m_blocked = m_blocked.load();
+	_stats.m_sendFailures = m_sendFailures.load();
+	_stats.m_batches = m_batches.load();
+	_stats.m_rateLimited = m_rateLimited.load();
+	_stats.m_suppressed = m_suppressed.load();
+	m_sendLatency.GetSnapshot( _stats.m_sendLatency );
+	m_publishLatency.GetSnapshot( _stats.m_publishLatency );
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::ParsePolicy>
+//-----------------------------------------------------------------------------
+bool NotificationPublisher::ParsePolicy
+(
+	std::string const& _name,
+	OverflowPolicy& _policy
+)
+{
+	if( _name == "block" )
+	{
+		_policy = Overflow_Block;
+	}
+	else if( _name == "drop-oldest" )
+	{
+		_policy = Overflow_DropOldest;
+	}
+	else if( _name == "coalesce" )
+	{
+		_policy = Overflow_Coalesce;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationPublisher::PolicyName>
+//-----------------------------------------------------------------------------
+char const* NotificationPublisher::PolicyName
+(
+	OverflowPolicy _policy
+)
+{
+	switch( _policy )
+	{
+		case Overflow_Block:		return "block";
+		case Overflow_DropOldest:	return "drop-oldest";
+		case Overflow_Coalesce:		return "coalesce";
+	}
+	return "unknown";
+}
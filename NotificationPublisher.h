@@ -0,0 +1,219 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// NotificationPublisher.h: asynchronous STOMP publisher for OpenZWave notifications
+//
+// OnNotification (the OpenZWave driver thread) and the Thrift handlers only
+// capture events into a bounded lock-free queue; a dedicated thread drains
+// it (up to a batch of events per wakeup, each one STOMP frame) and talks to
+// the STOMP broker, so a slow or reconnecting broker can never stall the
+// driver nor the Thrift RPCs.
+//
+// Optionally, value updates are also rate limited per value (see
+// SetRateLimit): within a window only the first and the latest update of a
+// value go out, the ones in between are superseded.
+//
+
+#ifndef _NotificationPublisher_H
+#define _NotificationPublisher_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "BoostStomp.hpp"
+#include "Metrics.h"
+
+// what to do when the queue is full
+enum OverflowPolicy
+{
+	Overflow_Block = 0,		// the producer waits until the publisher makes room (lossless)
+	Overflow_DropOldest,	// discard the oldest queued event
+	Overflow_Coalesce		// keep only the latest event per coalesce key, block for the rest
+};
+
+// what a removal (ValueRemoved, NodeRemoved, DriverReset...) takes away
+enum RemovalScope
+{
+	Removal_None = 0,
+	Removal_Value,			// the value of m_removedKey
+	Removal_Node,			// every value of m_nodeId
+	Removal_Home			// every value of the network
+};
+
+// a captured notification, ready to be sent to the broker
+struct StompEvent
+{
+	STOMP::hdrmap	m_headers;
+	std::string		m_body;
+	// events with the same non-zero key supersede each other under
+	// Overflow_Coalesce (e.g. the ValueID of a ValueChanged notification)
+	uint64_t		m_coalesceKey;
+	// a value update that didn't change the cached value
+	bool			m_unchanged;
+	// the node the event is about (0: none)
+	uint8_t			m_nodeId;
+	// a removal: value updates of what it removes that still wait aside
+	// (parked by Overflow_Coalesce, held back by the rate limit) are
+	// obsolete, Publish drops them so that they can't follow the removal
+	RemovalScope	m_removal;
+	uint64_t		m_removedKey;
+	// further topics the event goes to (the TopicRouter routes it matched)
+	std::vector<std::string>	m_routes;
+	// when its notification came in (MetricsNowUs), for the end-to-end
+	// publish latency
+	int64_t			m_receivedUs;
+	// from NotificationPublisher::Acquire: goes back to its free list,
+	// headers and buffers included
+	bool			m_pooled;
+
+	StompEvent() : m_coalesceKey(0), m_unchanged(false), m_nodeId(0), m_removal(Removal_None), m_removedKey(0),
+		m_receivedUs(MetricsNowUs()), m_pooled(false) {}
+};
+
+// publisher counters (monotonic, except for m_depth)
+struct PublisherStatistics
+{
+	uint32_t	m_capacity;		// queue capacity
+	uint32_t	m_depth;		// events currently waiting
+	uint32_t	m_maxDepth;		// high watermark
+	uint64_t	m_enqueued;		// events accepted
+	uint64_t	m_published;	// events handed to the broker
+	uint64_t	m_dropped;		// events discarded by Overflow_DropOldest
+	uint64_t	m_coalesced;	// events superseded by Overflow_Coalesce (or by a removal)
+	uint64_t	m_blocked;		// times a producer had to wait for room
+	uint64_t	m_sendFailures;	// STOMP send errors
+	uint64_t	m_batches;		// publisher wakeups that sent something
+	uint64_t	m_rateLimited;	// value updates superseded within their rate limit window (or by a removal)
+	uint64_t	m_suppressed;	// value updates dropped because nothing changed
+	HistogramSnapshot	m_sendLatency;	// time spent in each STOMP send
+	HistogramSnapshot	m_publishLatency;	// from the notification to the end of its STOMP send
+};
+
+class NotificationPublisher
+{
+public:
+	// the queue is bounded to 'capacity' events (at most 65534, a limit of
+	// boost::lockfree's fixed-size node pool)
+	NotificationPublisher( STOMP::BoostStomp* _stomp, std::string const& _topic,
+		uint32_t _capacity, OverflowPolicy _policy );
+	~NotificationPublisher();
+
+	// rate limit value updates (events with a coalesce key): at most one per
+	// key every _windowMs ms and at most _maxRate per second (0: no limit),
+	// the latest one of a window being sent when it closes; drop unchanged
+	// updates altogether if _suppressUnchanged. Call before Start().
+	void SetRateLimit( uint32_t _windowMs, uint32_t _maxRate, bool _suppressUnchanged );
+
+	void Start();
+	// drain whatever is queued and stop the publisher thread
+	void Stop();
+
+	// an event for Publish, recycled from the free list if possible. Its
+	// headers are those of its previous use (to be overwritten, so that
+	// their nodes and strings are reused), everything else is reset.
+	StompEvent* Acquire();
+
+	// hand an event over to the publisher thread (takes ownership)
+	void Publish( StompEvent* _event );
+
+	void GetStatistics( PublisherStatistics& _stats ) const;
+	OverflowPolicy GetPolicy() const { return m_policy; }
+
+	static bool ParsePolicy( std::string const& _name, OverflowPolicy& _policy );
+	static char const* PolicyName( OverflowPolicy _policy );
+
+private:
+	void Run();
+	size_t Drain();
+	void Send( StompEvent* _event );
+	void Park( StompEvent* _event );
+	void Recycle( StompEvent* _event );
+	void DropObsolete( StompEvent const* _removal );
+	static bool Obsoletes( StompEvent const* _removal, uint64_t _key, uint8_t _nodeId );
+	void WakeUp();
+	bool Hold( StompEvent* _event );
+	size_t ReleaseHeld();
+
+	STOMP::BoostStomp*	m_stomp;
+	std::string			m_topic;
+	uint32_t			m_capacity;
+	OverflowPolicy		m_policy;
+
+	boost::lockfree::queue<StompEvent*, boost::lockfree::fixed_sized<true> >	m_queue;
+	// sent (or discarded) Acquire()d events, for reuse
+	boost::lockfree::queue<StompEvent*, boost::lockfree::fixed_sized<true> >	m_free;
+
+	// Overflow_Coalesce: events that did not fit, latest one per key
+	boost::mutex						m_overflowMutex;
+	std::map<uint64_t, StompEvent*>		m_overflow;
+	boost::atomic<uint32_t>				m_overflowCount;
+
+	// rate limiting: last time each key went out, and the latest update
+	// held back for each key whose window is still open
+	struct LastSent
+	{
+		uint64_t	m_at;		// ms
+		uint8_t		m_nodeId;
+	};
+	uint32_t								m_interval;		// ms, 0: disabled
+	bool									m_suppressUnchanged;
+	boost::mutex							m_holdMutex;
+	boost::unordered_map<uint64_t, LastSent>	m_lastSent;
+	std::map<uint64_t, StompEvent*>			m_held;
+	boost::atomic<uint32_t>					m_heldCount;
+	boost::atomic<uint64_t>					m_nextRelease;	// ms, earliest window end of m_held
+
+	// publisher thread parking
+	boost::mutex				m_wakeMutex;
+	boost::condition_variable	m_wakeCond;
+	boost::condition_variable	m_roomCond;
+	boost::atomic<bool>			m_sleeping;
+	boost::atomic<bool>			m_running;
+	boost::thread				m_thread;
+
+	boost::atomic<uint32_t>		m_depth;
+	boost::atomic<uint32_t>		m_maxDepth;
+	boost::atomic<uint64_t>		m_enqueued;
+	boost::atomic<uint64_t>		m_published;
+	boost::atomic<uint64_t>		m_dropped;
+	boost::atomic<uint64_t>		m_coalesced;
+	boost::atomic<uint64_t>		m_blocked;
+	boost::atomic<uint64_t>		m_sendFailures;
+	boost::atomic<uint64_t>		m_batches;
+	boost::atomic<uint64_t>		m_rateLimited;
+	boost::atomic<uint64_t>		m_suppressed;
+	LatencyHistogram			m_sendLatency;
+	LatencyHistogram			m_publishLatency;
+};
+
+#endif
@@ -0,0 +1,153 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// NotificationRing.cpp: the latest OpenZWave notifications, for long-polling
+// Thrift clients
+//
+
+#include "NotificationRing.h"
+
+#include <algorithm>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using OpenZWave::RemoteNotification;
+
+//-----------------------------------------------------------------------------
+// <NotificationRing::NotificationRing>
+//-----------------------------------------------------------------------------
+NotificationRing::NotificationRing
+(
+	uint32_t _capacity
+):
+	m_ring( _capacity ),
+	m_pushed( 0 ),
+	m_lost( 0 ),
+	m_epoch( ( boost::posix_time::microsec_clock::universal_time() -
+		boost::posix_time::ptime( boost::gregorian::date( 1970, 1, 1 ) ) ).total_milliseconds() )
+{
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationRing::Push>
+//-----------------------------------------------------------------------------
+void NotificationRing::Push
+(
+	RemoteNotification const& _notification
+)
+{
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		RemoteNotification& slot = m_ring[m_pushed % m_ring.size()];
+		if( m_pushed >= m_ring.size() )
+		{
+			m_lost = slot.m_sequence;
+		}
+		// assigning into the slot reuses its strings' storage
+		slot = _notification;
+		++m_pushed;
+	}
+	m_cond.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationRing::FirstAfter>
+// Logical position (0..m_pushed) of the first notification numbered above
+// _since, found by binary search since sequence numbers only grow
+//-----------------------------------------------------------------------------
+uint64_t NotificationRing::FirstAfter
+(
+	uint64_t _since
+) const
+{
+	uint64_t const size = m_ring.size();
+	uint64_t low = ( m_pushed > size ) ? m_pushed - size : 0;
+	uint64_t high = m_pushed;
+	while( low < high )
+	{
+		uint64_t const mid = low + ( high - low ) / 2;
+		if( (uint64_t)m_ring[mid % size].m_sequence > _since )
+		{
+			high = mid;
+		}
+		else
+		{
+			low = mid + 1;
+		}
+	}
+	return low;
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationRing::Wait>
+//-----------------------------------------------------------------------------
+bool NotificationRing::Wait
+(
+	uint64_t _epoch,
+	uint64_t& _since,
+	uint32_t _max,
+	uint32_t _timeoutMs,
+	std::vector<RemoteNotification>& _notifications
+)
+{
+	_notifications.clear();
+	boost::system_time const deadline = boost::get_system_time() + boost::posix_time::milliseconds( _timeoutMs );
+	boost::unique_lock<boost::mutex> lock( m_mutex );
+	bool complete = true;
+	uint64_t const latest = m_pushed ? m_ring[( m_pushed - 1 ) % m_ring.size()].m_sequence : 0;
+	if( _epoch && ( _epoch != m_epoch ) )
+	{
+		_since = 0;
+		complete = false;
+	}
+	else if( _since > latest )
+	{
+		_since = latest;
+		complete = false;
+	}
+	uint64_t first = FirstAfter( _since );
+	while( ( first == m_pushed ) && m_cond.timed_wait( lock, deadline ) )
+	{
+		first = FirstAfter( _since );
+	}
+	uint64_t const last = std::min<uint64_t>( m_pushed, first + _max );
+	_notifications.reserve( last - first );
+	for( uint64_t i = first; i < last; ++i )
+	{
+		_notifications.push_back( m_ring[i % m_ring.size()] );
+	}
+	return complete && ( _since >= m_lost );
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationRing::GetLastSequence>
+//-----------------------------------------------------------------------------
+uint64_t NotificationRing::GetLastSequence
+(
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	return m_pushed ? m_ring[( m_pushed - 1 ) % m_ring.size()].m_sequence : 0;
+}
@@ -0,0 +1,84 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// NotificationRing.h: the latest OpenZWave notifications, for long-polling
+// Thrift clients (WaitForNotifications)
+//
+// A fixed-size ring of RemoteNotification structs, numbered by their
+// sequence number (RemoteNotification::m_sequence, ascending). OnNotification
+// pushes into it and wakes up the waiting clients; a client that comes back
+// with the last sequence number it saw resumes without losing anything, as
+// long as the ring didn't wrap around in the meantime. Sequence numbers start
+// over with every ozwd process, so a client also hands back the epoch (the
+// process' start time) its sequence number belongs to.
+//
+
+#ifndef _NotificationRing_H
+#define _NotificationRing_H
+
+#include <vector>
+#include <stdint.h>
+
+#include <boost/thread.hpp>
+
+#include "ozw_types.h"
+
+class NotificationRing
+{
+public:
+	explicit NotificationRing( uint32_t _capacity );
+
+	// store a copy of the notification, overwriting the oldest one when full
+	void Push( OpenZWave::RemoteNotification const& _notification );
+
+	// the notifications numbered above _since, at most _max of them, waiting
+	// up to _timeoutMs for the first one; returns false if some of those
+	// were already overwritten (the client missed them). A _since of another
+	// _epoch (unless 0, a first call or an old client) was numbered by an
+	// earlier process: it is reset to 0 and false is returned as well; so is
+	// a _since above the latest sequence number, lowered to that number.
+	bool Wait( uint64_t _epoch, uint64_t& _since, uint32_t _max, uint32_t _timeoutMs,
+		std::vector<OpenZWave::RemoteNotification>& _notifications );
+
+	// sequence number of the latest notification pushed (0: none)
+	uint64_t GetLastSequence();
+
+	// when the ring (that is, ozwd) was started, ms since the epoch
+	uint64_t GetEpoch() const { return m_epoch; }
+
+private:
+	// position of the first notification numbered above _since (m_pushed if
+	// none), the caller holds m_mutex
+	uint64_t FirstAfter( uint64_t _since ) const;
+
+	std::vector<OpenZWave::RemoteNotification>	m_ring;
+	uint64_t									m_pushed;	// notifications ever pushed
+	uint64_t									m_lost;		// highest sequence number overwritten
+	uint64_t const								m_epoch;
+	boost::mutex								m_mutex;
+	boost::condition_variable					m_cond;
+};
+
+#endif
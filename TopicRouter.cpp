@@ -0,0 +1,478 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// TopicRouter.cpp: server-side subscription filters
+//
+
+#include "TopicRouter.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using OpenZWave::NotificationRoute;
+
+char const* const TopicRouter::c_defaultTopic = "/topic/zwave/{home}/{node}/{cc}";
+
+namespace
+{
+	// a number (decimal, or hex with 0x) up to _max
+	bool ParseNumber
+	(
+		std::string const& _text,
+		uint32_t const _max,
+		uint32_t& _value
+	)
+	{
+		if( _text.empty() )
+		{
+			return false;
+		}
+		char* end = NULL;
+		unsigned long const value = strtoul( _text.c_str(), &end, 0 );
+		if( *end || ( value > _max ) )
+		{
+			return false;
+		}
+		_value = (uint32_t)value;
+		return true;
+	}
+
+	// a value or a range a-b of them, genres also by name
+	bool ParseRange
+	(
+		std::string const& _key,
+		std::string const& _item,
+		uint32_t& _first,
+		uint32_t& _last
+	)
+	{
+		static char const* const genres[] = { "basic", "user", "config", "system" };
+		if( _key == "genre" )
+		{
+			for( uint32_t i = 0; i < sizeof(genres) / sizeof(genres[0]); ++i )
+			{
+				if( _item == genres[i] )
+				{
+					_first = _last = i;
+					return true;
+				}
+			}
+		}
+		size_t const dash = _item.find( '-', 1 );
+		if( dash == std::string::npos )
+		{
+			if( !ParseNumber( _item, 255, _first ) )
+			{
+				return false;
+			}
+			_last = _first;
+			return true;
+		}
+		return ParseNumber( _item.substr( 0, dash ), 255, _first )
+			&& ParseNumber( _item.substr( dash + 1 ), 255, _last )
+			&& ( _first <= _last );
+	}
+
+	// split _text at each _separator, dropping empty pieces
+	void Split
+	(
+		std::string const& _text,
+		char const _separator,
+		std::vector<std::string>& _pieces
+	)
+	{
+		size_t start = 0;
+		while( start <= _text.size() )
+		{
+			size_t end = _text.find( _separator, start );
+			if( end == std::string::npos )
+			{
+				end = _text.size();
+			}
+			if( end > start )
+			{
+				_pieces.push_back( _text.substr( start, end - start ) );
+			}
+			start = end + 1;
+		}
+	}
+
+	// set _bit in the masks of the values listed, or in all of them if none is
+	template<class T> void SetBits
+	(
+		std::vector<T> const& _values,
+		uint64_t* _masks,
+		uint64_t const _bit
+	)
+	{
+		if( _values.empty() )
+		{
+			for( uint32_t i = 0; i < 256; ++i )
+			{
+				_masks[i] |= _bit;
+			}
+			return;
+		}
+		for( size_t i = 0; i < _values.size(); ++i )
+		{
+			_masks[(uint8_t)_values[i]] |= _bit;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <TopicRouter::TopicRouter>
+//-----------------------------------------------------------------------------
+TopicRouter::TopicRouter
+(
+):
+	m_nextId( 1 )
+{
+	Table* table = new Table();
+	Compile( *table );
+	m_table.reset( table );
+}
+
+//-----------------------------------------------------------------------------
+// <TopicRouter::CompileTopic>
+// Split a topic template into text and fields
+//-----------------------------------------------------------------------------
+bool TopicRouter::CompileTopic
+(
+	std::string const& _topic,
+	std::vector<TopicPart>& _parts
+)
+{
+	static char const* const fields[] = { "{home}", "{node}", "{cc}", "{genre}", "{type}" };
+	static char const codes[] = { 'h', 'n', 'c', 'g', 't' };
+	_parts.clear();
+	if( _topic.empty() || ( _topic[0] != '/' ) )
+	{
+		return false;
+	}
+	size_t start = 0;
+	while( start < _topic.size() )
+	{
+		size_t const open = _topic.find( '{', start );
+		if( open != start )
+		{
+			TopicPart text = { _topic.substr( start, open - start ), 0 };
+			_parts.push_back( text );
+			if( open == std::string::npos )
+			{
+				break;
+			}
+		}
+		size_t const close = _topic.find( '}', open );
+		if( close == std::string::npos )
+		{
+			return false;
+		}
+		std::string const field = _topic.substr( open, close - open + 1 );
+		uint32_t i = 0;
+		while( ( i < sizeof(codes) ) && ( field != fields[i] ) )
+		{
+			++i;
+		}
+		if( i == sizeof(codes) )
+		{
+			return false;
+		}
+		TopicPart part = { std::string(), codes[i] };
+		_parts.push_back( part );
+		start = close + 1;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <TopicRouter::Compile>
+// Rebuild the bitmasks of a table from its routes
+//-----------------------------------------------------------------------------
+void TopicRouter::Compile
+(
+	Table& _table
+)
+{
+	_table.m_anyHome = 0;
+	_table.m_anyValue = 0;
+	_table.m_homes.clear();
+	memset( _table.m_nodes, 0, sizeof(_table.m_nodes) );
+	memset( _table.m_types, 0, sizeof(_table.m_types) );
+	memset( _table.m_commandClasses, 0, sizeof(_table.m_commandClasses) );
+	memset( _table.m_genres, 0, sizeof(_table.m_genres) );
+	for( uint32_t i = 0; i < c_maxRoutes; ++i )
+	{
+		uint64_t const bit = (uint64_t)1 << i;
+		if( !( _table.m_used & bit ) )
+		{
+			continue;
+		}
+		NotificationRoute const& route = _table.m_routes[i];
+		if( route.m_homeIds.empty() )
+		{
+			_table.m_anyHome |= bit;
+		}
+		for( size_t h = 0; h < route.m_homeIds.size(); ++h )
+		{
+			uint32_t const homeId = (uint32_t)route.m_homeIds[h];
+			size_t j = 0;
+			while( ( j < _table.m_homes.size() ) && ( _table.m_homes[j].first != homeId ) )
+			{
+				++j;
+			}
+			if( j == _table.m_homes.size() )
+			{
+				_table.m_homes.push_back( std::make_pair( homeId, (uint64_t)0 ) );
+			}
+			_table.m_homes[j].second |= bit;
+		}
+		SetBits( route.m_nodeIds, _table.m_nodes, bit );
+		SetBits( route.m_types, _table.m_types, bit );
+		SetBits( route.m_commandClasses, _table.m_commandClasses, bit );
+		SetBits( route.m_genres, _table.m_genres, bit );
+		if( route.m_commandClasses.empty() && route.m_genres.empty() )
+		{
+			_table.m_anyValue |= bit;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <TopicRouter::Add>
+//-----------------------------------------------------------------------------
+int32_t TopicRouter::Add
+(
+	NotificationRoute const& _route
+)
+{
+	std::vector<TopicPart> parts;
+	if( !CompileTopic( _route.m_topic, parts ) )
+	{
+		return -1;
+	}
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	uint32_t slot = 0;
+	while( ( slot < c_maxRoutes ) && ( m_table->m_used & ( (uint64_t)1 << slot ) ) )
+	{
+		++slot;
+	}
+	if( slot == c_maxRoutes )
+	{
+		return -1;
+	}
+	Table* table = new Table( *m_table );
+	table->m_routes[slot] = _route;
+	table->m_routes[slot].m_id = m_nextId++;
+	table->m_topics[slot].swap( parts );
+	table->m_used |= (uint64_t)1 << slot;
+	Compile( *table );
+	m_table.reset( table );
+	return table->m_routes[slot].m_id;
+}
+
+//-----------------------------------------------------------------------------
+// <TopicRouter::Remove>
+//-----------------------------------------------------------------------------
+bool TopicRouter::Remove
+(
+	int32_t _id
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	for( uint32_t slot = 0; slot < c_maxRoutes; ++slot )
+	{
+		uint64_t const bit = (uint64_t)1 << slot;
+		if( ( m_table->m_used & bit ) && ( m_table->m_routes[slot].m_id == _id ) )
+		{
+			Table* table = new Table( *m_table );
+			table->m_routes[slot] = NotificationRoute();
+			table->m_topics[slot].clear();
+			table->m_used &= ~bit;
+			Compile( *table );
+			m_table.reset( table );
+			return true;
+		}
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// <TopicRouter::GetRoutes>
+//-----------------------------------------------------------------------------
+void TopicRouter::GetRoutes
+(
+	std::vector<NotificationRoute>& _routes
+) const
+{
+	boost::shared_ptr<Table const> table;
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		table = m_table;
+	}
+	for( uint32_t slot = 0; slot < c_maxRoutes; ++slot )
+	{
+		if( table->m_used & ( (uint64_t)1 << slot ) )
+		{
+			_routes.push_back( table->m_routes[slot] );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <TopicRouter::Match>
+//-----------------------------------------------------------------------------
+void TopicRouter::Match
+(
+	uint32_t _homeId,
+	uint8_t _nodeId,
+	uint8_t _type,
+	bool _hasValue,
+	uint8_t _commandClass,
+	uint8_t _genre,
+	std::vector<std::string>& _topics
+) const
+{
+	boost::shared_ptr<Table const> table;
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		table = m_table;
+	}
+	uint64_t match = table->m_used & table->m_nodes[_nodeId] & table->m_types[_type];
+	if( !match )
+	{
+		return;
+	}
+	uint64_t homes = table->m_anyHome;
+	for( size_t i = 0; i < table->m_homes.size(); ++i )
+	{
+		if( table->m_homes[i].first == _homeId )
+		{
+			homes |= table->m_homes[i].second;
+		}
+	}
+	match &= homes;
+	if( _hasValue )
+	{
+		match &= table->m_commandClasses[_commandClass] & table->m_genres[_genre];
+	}
+	else
+	{
+		match &= table->m_anyValue;
+	}
+	while( match )
+	{
+		uint32_t const slot = __builtin_ctzll( match );
+		match &= match - 1;
+		_topics.push_back( std::string() );
+		std::string& topic = _topics.back();
+		std::vector<TopicPart> const& parts = table->m_topics[slot];
+		for( std::vector<TopicPart>::const_iterator it = parts.begin(); it != parts.end(); ++it )
+		{
+			char field[16];
+			switch( it->m_field )
+			{
+				case 'h':	snprintf( field, sizeof(field), "%x", _homeId );		break;
+				case 'n':	snprintf( field, sizeof(field), "%x", _nodeId );		break;
+				case 'c':	snprintf( field, sizeof(field), "%x", _commandClass );	break;
+				case 'g':	snprintf( field, sizeof(field), "%x", _genre );			break;
+				case 't':	snprintf( field, sizeof(field), "%x", _type );			break;
+				default:	topic += it->m_text;									continue;
+			}
+			topic += field;
+		}
+		// several routes may expand to the same topic, send it there once
+		if( std::find( _topics.begin(), _topics.end() - 1, topic ) != _topics.end() - 1 )
+		{
+			_topics.pop_back();
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <TopicRouter::Parse>
+//-----------------------------------------------------------------------------
+bool TopicRouter::Parse
+(
+	std::string const& _spec,
+	NotificationRoute& _route
+)
+{
+	_route = NotificationRoute();
+	size_t const at = _spec.find( '@' );
+	_route.m_topic = ( at == std::string::npos ) ? std::string( c_defaultTopic ) : _spec.substr( at + 1 );
+	std::vector<TopicPart> parts;
+	if( !CompileTopic( _route.m_topic, parts ) )
+	{
+		return false;
+	}
+	std::vector<std::string> criteria;
+	Split( _spec.substr( 0, at ), ';', criteria );
+	for( std::vector<std::string>::const_iterator it = criteria.begin(); it != criteria.end(); ++it )
+	{
+		size_t const equals = it->find( '=' );
+		if( equals == std::string::npos )
+		{
+			return false;
+		}
+		std::string const key = it->substr( 0, equals );
+		std::vector<std::string> items;
+		Split( it->substr( equals + 1 ), ',', items );
+		if( items.empty() )
+		{
+			return false;
+		}
+		for( std::vector<std::string>::const_iterator item = items.begin(); item != items.end(); ++item )
+		{
+			uint32_t first, last;
+			if( key == "home" )
+			{
+				if( !ParseNumber( *item, 0xffffffff, first ) )
+				{
+					return false;
+				}
+				_route.m_homeIds.push_back( (int32_t)first );
+				continue;
+			}
+			if( !ParseRange( key, *item, first, last ) )
+			{
+				return false;
+			}
+			std::vector<int8_t>* values;
+			if( key == "node" )			values = &_route.m_nodeIds;
+			else if( key == "cc" )		values = &_route.m_commandClasses;
+			else if( key == "genre" )	values = &_route.m_genres;
+			else if( key == "type" )	values = &_route.m_types;
+			else						return false;
+			for( uint32_t value = first; value <= last; ++value )
+			{
+				values->push_back( (int8_t)value );
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,109 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// TopicRouter.h: server-side subscription filters (--route and the
+// AddNotificationRoute RPC)
+//
+// A route also publishes the notifications that match all of its criteria
+// (homeIds, nodeIds, command classes, genres and notification types, an
+// empty list matching anything) to a topic of its own, such as
+// /topic/zwave/{home}/{node}/{cc}, so that a consumer only receives the
+// traffic it cares about. Routes are compiled into a bitmask per criterion
+// value, one bit per route: matching a notification takes a few table
+// lookups and ANDs, however many routes (at most c_maxRoutes) and criteria
+// there are. A change installs a new table, so matching never waits for one.
+//
+
+#ifndef _TopicRouter_H
+#define _TopicRouter_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "ozw_types.h"
+
+class TopicRouter
+{
+public:
+	static uint32_t const c_maxRoutes = 64;
+
+	TopicRouter();
+
+	// install a route; returns its id (> 0), or -1 if the route is invalid
+	// or there are c_maxRoutes already
+	int32_t Add( OpenZWave::NotificationRoute const& _route );
+	bool Remove( int32_t _id );
+	void GetRoutes( std::vector<OpenZWave::NotificationRoute>& _routes ) const;
+
+	// append the topics of the routes a notification matches to _topics.
+	// Only value notifications (_hasValue) can match routes that have
+	// command class or genre criteria.
+	void Match( uint32_t _homeId, uint8_t _nodeId, uint8_t _type, bool _hasValue,
+		uint8_t _commandClass, uint8_t _genre, std::vector<std::string>& _topics ) const;
+
+	// a --route: criteria[@topic], the criteria being key=list pairs
+	// separated by ';' (keys home, node, cc, genre and type, lists of
+	// comma-separated numbers or ranges a-b), the topic c_defaultTopic if
+	// not given
+	static bool Parse( std::string const& _spec, OpenZWave::NotificationRoute& _route );
+
+	static char const* const c_defaultTopic;
+
+private:
+	// a piece of a topic template: literal text, or a field of the
+	// notification ({home}, {node}, {cc}, {genre} or {type}, in hex)
+	struct TopicPart
+	{
+		std::string	m_text;
+		char		m_field;	// 0 for text, else 'h', 'n', 'c', 'g' or 't'
+	};
+
+	struct Table
+	{
+		OpenZWave::NotificationRoute	m_routes[c_maxRoutes];
+		std::vector<TopicPart>			m_topics[c_maxRoutes];
+		uint64_t						m_used;					// a bit per route in use
+		uint64_t						m_anyHome;				// routes without homeIds
+		std::vector< std::pair<uint32_t, uint64_t> >	m_homes;	// routes of each homeId
+		uint64_t						m_nodes[256];
+		uint64_t						m_types[256];
+		uint64_t						m_commandClasses[256];
+		uint64_t						m_genres[256];
+		uint64_t						m_anyValue;				// routes without command class and genre criteria
+	};
+
+	static bool CompileTopic( std::string const& _topic, std::vector<TopicPart>& _parts );
+	static void Compile( Table& _table );
+
+	boost::shared_ptr<Table const>	m_table;
+	mutable boost::mutex			m_mutex;		// guards m_table (the pointer) and m_nextId
+	int32_t							m_nextId;
+};
+
+#endif
@@ -0,0 +1,241 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// TopologyMap.cpp: the mesh of a Z-Wave network as a bitset adjacency matrix
+//
+
+#include "TopologyMap.h"
+
+#include <algorithm>
+
+using OpenZWave::NetworkTopology;
+
+uint32_t const TopologyMap::c_maxNodes;
+uint8_t const TopologyMap::c_unreachable;
+
+//-----------------------------------------------------------------------------
+// <TopologyMap::TopologyMap>
+//-----------------------------------------------------------------------------
+TopologyMap::TopologyMap():
+	m_controller( 0 )
+{
+	std::fill( m_hops, m_hops + c_maxNodes, c_unreachable );
+}
+
+//-----------------------------------------------------------------------------
+// <TopologyMap::AddNode>
+//-----------------------------------------------------------------------------
+void TopologyMap::AddNode
+(
+	uint8_t _nodeId
+)
+{
+	if( Valid( _nodeId ) )
+	{
+		m_nodes.set( _nodeId - 1 );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <TopologyMap::SetNeighbors>
+//-----------------------------------------------------------------------------
+void TopologyMap::SetNeighbors
+(
+	uint8_t _nodeId,
+	uint8_t const* _neighbors,
+	uint32_t _count
+)
+{
+	if( !Valid( _nodeId ) )
+	{
+		return;
+	}
+	NodeSet& row = m_neighbors[_nodeId - 1];
+	row.reset();
+	for( uint32_t i = 0; i < _count; ++i )
+	{
+		if( Valid( _neighbors[i] ) && ( _neighbors[i] != _nodeId ) )
+		{
+			row.set( _neighbors[i] - 1 );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <TopologyMap::Analyze>
+//-----------------------------------------------------------------------------
+void TopologyMap::Analyze
+(
+	uint8_t _controllerNodeId
+)
+{
+	m_controller = _controllerNodeId;
+	// links between known nodes, whichever of the two reported them
+	for( uint32_t i = 0; i < c_maxNodes; ++i )
+	{
+		m_links[i] = m_neighbors[i] & m_nodes;
+	}
+	for( uint32_t i = 0; i < c_maxNodes; ++i )
+	{
+		if( !m_nodes[i] )
+		{
+			m_links[i].reset();
+			continue;
+		}
+		for( uint32_t j = 0; j < c_maxNodes; ++j )
+		{
+			if( m_neighbors[i][j] && m_nodes[j] )
+			{
+				m_links[j].set( i );
+			}
+		}
+	}
+
+	// breadth-first from the controller, a frontier at a time
+	std::fill( m_hops, m_hops + c_maxNodes, c_unreachable );
+	m_weak.reset();
+	m_critical.reset();
+	if( !Valid( _controllerNodeId ) || !m_nodes[_controllerNodeId - 1] )
+	{
+		m_weak = m_nodes;
+		return;
+	}
+	uint32_t const root = _controllerNodeId - 1;
+	NodeSet visited;
+	NodeSet frontier;
+	frontier.set( root );
+	for( uint8_t hops = 0; frontier.any(); ++hops )
+	{
+		NodeSet next;
+		for( uint32_t i = 0; i < c_maxNodes; ++i )
+		{
+			if( frontier[i] )
+			{
+				m_hops[i] = hops;
+				next |= m_links[i];
+			}
+		}
+		visited |= frontier;
+		frontier = next & ~visited;
+	}
+
+	// a single link (or none) to the rest of the mesh
+	for( uint32_t i = 0; i < c_maxNodes; ++i )
+	{
+		if( m_nodes[i] && ( i != root ) && ( ( m_hops[i] == c_unreachable ) || ( m_links[i].count() < 2 ) ) )
+		{
+			m_weak.set( i );
+		}
+	}
+
+	// articulation points of the controller's component (Tarjan), the
+	// controller itself aside
+	std::vector<uint32_t> discovered( c_maxNodes, 0 );
+	std::vector<uint32_t> low( c_maxNodes, 0 );
+	uint32_t time = 0;
+	FindCritical( root, c_maxNodes, time, discovered, low );
+	m_critical.reset( root );
+}
+
+//-----------------------------------------------------------------------------
+// <TopologyMap::FindCritical>
+// Depth-first search numbering the nodes (_discovered, from 1) and the lowest
+// number reachable from each subtree through one back link (_low); the
+// recursion is at most c_maxNodes deep
+//-----------------------------------------------------------------------------
+void TopologyMap::FindCritical
+(
+	uint32_t _node,
+	uint32_t _parent,
+	uint32_t& _time,
+	std::vector<uint32_t>& _discovered,
+	std::vector<uint32_t>& _low
+)
+{
+	_discovered[_node] = _low[_node] = ++_time;
+	for( uint32_t next = 0; next < c_maxNodes; ++next )
+	{
+		if( !m_links[_node][next] || ( next == _parent ) )
+		{
+			continue;
+		}
+		if( _discovered[next] )
+		{
+			_low[_node] = std::min( _low[_node], _discovered[next] );
+			continue;
+		}
+		FindCritical( next, _node, _time, _discovered, _low );
+		_low[_node] = std::min( _low[_node], _low[next] );
+		// next's subtree has no other way up than through _node (the root
+		// is excluded by the caller)
+		if( _low[next] >= _discovered[_node] )
+		{
+			m_critical.set( _node );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <TopologyMap::Fill>
+//-----------------------------------------------------------------------------
+void TopologyMap::Fill
+(
+	NetworkTopology& _topology
+) const
+{
+	_topology.m_controllerNodeId = (int8_t)m_controller;
+	_topology.m_nodeIds.clear();
+	_topology.m_hops.clear();
+	_topology.m_weakNodes.clear();
+	_topology.m_criticalNodes.clear();
+	// row-major, bit ( a - 1 ) * c_maxNodes + ( b - 1 ) set if node a
+	// reported node b, least significant bit first
+	_topology.m_adjacency.assign( ( c_maxNodes * c_maxNodes + 7 ) / 8, '\0' );
+	for( uint32_t i = 0; i < c_maxNodes; ++i )
+	{
+		if( !m_nodes[i] )
+		{
+			continue;
+		}
+		_topology.m_nodeIds.push_back( (int8_t)( i + 1 ) );
+		_topology.m_hops.push_back( (int8_t)m_hops[i] );
+		if( m_weak[i] )
+		{
+			_topology.m_weakNodes.push_back( (int8_t)( i + 1 ) );
+		}
+		if( m_critical[i] )
+		{
+			_topology.m_criticalNodes.push_back( (int8_t)( i + 1 ) );
+		}
+		for( uint32_t j = 0; j < c_maxNodes; ++j )
+		{
+			if( m_neighbors[i][j] )
+			{
+				uint32_t const bit = i * c_maxNodes + j;
+				_topology.m_adjacency[bit / 8] |= (char)( 1 << ( bit % 8 ) );
+			}
+		}
+	}
+}
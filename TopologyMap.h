@@ -0,0 +1,89 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// TopologyMap.h: the mesh of a Z-Wave network as a bitset adjacency matrix
+// (GetNetworkTopology)
+//
+// Built from every node's neighbor list (Manager::GetNodeNeighbors), then
+// analyzed from the controller's point of view:
+//
+// - hops: breadth-first over the links, a whole frontier per step as bitset
+//   ORs of the adjacency rows;
+// - weak nodes: reachable through a single neighbor at most (or not at all);
+// - critical nodes: articulation points of the controller's component, the
+//   nodes whose failure cuts others off the controller.
+//
+// A link is a neighbor relation reported by either of its two nodes: sleeping
+// nodes often report no neighbors until they have been queried.
+//
+
+#ifndef _TopologyMap_H
+#define _TopologyMap_H
+
+#include <bitset>
+#include <vector>
+#include <stdint.h>
+
+#include "ozw_types.h"
+
+class TopologyMap
+{
+public:
+	static uint32_t const c_maxNodes = 232;		// Z-Wave node ids 1..232
+	static uint8_t const c_unreachable = 0xff;
+
+	typedef std::bitset<c_maxNodes> NodeSet;	// bit i: node i + 1
+
+	TopologyMap();
+
+	void AddNode( uint8_t _nodeId );
+	// the neighbor list OpenZWave reports for a node
+	void SetNeighbors( uint8_t _nodeId, uint8_t const* _neighbors, uint32_t _count );
+
+	// hop counts, weak and critical nodes, from the controller
+	void Analyze( uint8_t _controllerNodeId );
+
+	// the matrix and the analysis, into GetNetworkTopology's struct
+	void Fill( OpenZWave::NetworkTopology& _topology ) const;
+
+	uint8_t GetHops( uint8_t _nodeId ) const { return Valid( _nodeId ) ? m_hops[_nodeId - 1] : c_unreachable; }
+	NodeSet const& GetWeakNodes() const { return m_weak; }
+	NodeSet const& GetCriticalNodes() const { return m_critical; }
+
+private:
+	static bool Valid( uint8_t _nodeId ) { return ( _nodeId >= 1 ) && ( _nodeId <= c_maxNodes ); }
+	void FindCritical( uint32_t _node, uint32_t _parent, uint32_t& _time,
+		std::vector<uint32_t>& _discovered, std::vector<uint32_t>& _low );
+
+	NodeSet		m_nodes;
+	NodeSet		m_neighbors[c_maxNodes];	// as reported, row per node
+	NodeSet		m_links[c_maxNodes];		// symmetric closure of m_neighbors
+	uint8_t		m_controller;
+	uint8_t		m_hops[c_maxNodes];
+	NodeSet		m_weak;
+	NodeSet		m_critical;
+};
+
+#endif
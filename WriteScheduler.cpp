@@ -0,0 +1,432 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// WriteScheduler.cpp: a write queue in front of OpenZWave's Manager::SetValue
+//
+
+#include "WriteScheduler.h"
+
+#include <algorithm>
+#include <iostream>
+
+using OpenZWave::RemoteValueID;
+using OpenZWave::RemoteValue;
+using OpenZWave::WriteStatus;
+using OpenZWave::WriteTicket;
+using OpenZWave::WriteSchedulerStatistics;
+
+// how often writes held back by admission control look at the send queue again
+static const uint64_t c_pollMs = 50;
+// max. time the scheduler thread sleeps between checks for unconfirmed writes
+static const uint64_t c_idleMs = 1000;
+
+//-----------------------------------------------------------------------------
+// <NowMs>
+//-----------------------------------------------------------------------------
+static uint64_t NowMs()
+{
+	static boost::posix_time::ptime const start = boost::posix_time::microsec_clock::universal_time();
+	return (uint64_t)( boost::posix_time::microsec_clock::universal_time() - start ).total_milliseconds();
+}
+
+//-----------------------------------------------------------------------------
+// <MakeReport>
+//-----------------------------------------------------------------------------
+static WriteReport MakeReport
+(
+	uint64_t _ticket,
+	WriteStatus::type _status,
+	RemoteValueID const& _id
+)
+{
+	WriteReport report;
+	report.m_ticket = _ticket;
+	report.m_status = _status;
+	report.m_id = _id;
+	return report;
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::WriteScheduler>
+//-----------------------------------------------------------------------------
+WriteScheduler::WriteScheduler
+(
+	Dispatch _dispatch,
+	QueueDepth _queueDepth,
+	Report _report,
+	uint32_t _capacity,
+	uint32_t const _limits[c_priorities],
+	uint32_t _timeoutMs
+):
+	m_dispatch( _dispatch ),
+	m_queueDepth( _queueDepth ),
+	m_report( _report ),
+	m_capacity( _capacity ),
+	m_timeoutMs( _timeoutMs ),
+	m_lastTicket( 0 ),
+	m_running( false ),
+	m_scheduled( 0 ),
+	m_superseded( 0 ),
+	m_rejected( 0 ),
+	m_deferred( 0 ),
+	m_dispatched( 0 ),
+	m_failed( 0 ),
+	m_confirmed( 0 ),
+	m_unconfirmed( 0 )
+{
+	for( uint32_t i = 0; i < c_priorities; ++i )
+	{
+		m_limits[i] = _limits[i];
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::~WriteScheduler>
+//-----------------------------------------------------------------------------
+WriteScheduler::~WriteScheduler()
+{
+	Stop();
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::Start>
+//-----------------------------------------------------------------------------
+void WriteScheduler::Start()
+{
+	m_running = true;
+	m_thread = boost::thread( boost::bind( &WriteScheduler::Run, this ) );
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::Stop>
+//-----------------------------------------------------------------------------
+void WriteScheduler::Stop()
+{
+	if( !m_running.exchange( false ) )
+	{
+		return;
+	}
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		m_cond.notify_one();
+	}
+	m_thread.join();
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::Key>
+//-----------------------------------------------------------------------------
+WriteScheduler::ValueKey WriteScheduler::Key
+(
+	RemoteValueID const& _id
+)
+{
+	return ValueKey( (uint32_t)_id._homeId, _id.toValueID().GetId() );
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::Schedule>
+// Called from the Thrift workers, never waits for the network
+//-----------------------------------------------------------------------------
+WriteTicket WriteScheduler::Schedule
+(
+	RemoteValueID const& _id,
+	RemoteValue const& _value,
+	uint32_t _priority
+)
+{
+	WriteTicket ticket;
+	ticket.m_ticket = 0;
+	ticket.m_status = WriteStatus::Write_Rejected;
+	_priority = std::min( _priority, c_priorities - 1 );
+	std::vector<WriteReport> reports;
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		ValueKey const key = Key( _id );
+		std::map<ValueKey, Pending>::iterator it = m_pending.find( key );
+		if( it == m_pending.end() )
+		{
+			if( m_pending.size() >= m_capacity )
+			{
+				++m_rejected;
+				return ticket;
+			}
+			it = m_pending.insert( std::make_pair( key, Pending() ) ).first;
+			it->second.m_priority = c_priorities;	// not queued yet
+		}
+		else
+		{
+			// last writer wins, the one it replaces never goes out
+			++m_superseded;
+			reports.push_back( MakeReport( it->second.m_ticket, WriteStatus::Write_Superseded, it->second.m_id ) );
+		}
+		Pending& pending = it->second;
+		pending.m_ticket = ++m_lastTicket;
+		pending.m_id = _id;
+		pending.m_value = _value;
+		if( _priority < pending.m_priority )
+		{
+			// new, or more urgent than the write it replaces
+			pending.m_priority = _priority;
+			m_queues[_priority].push_back( key );
+		}
+		++m_scheduled;
+		ticket.m_ticket = pending.m_ticket;
+		ticket.m_status = WriteStatus::Write_Queued;
+		m_cond.notify_one();
+	}
+	Deliver( reports );
+	return ticket;
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::OnValueReported>
+// Called from the OpenZWave driver thread, outside of the network's lock
+//-----------------------------------------------------------------------------
+void WriteScheduler::OnValueReported
+(
+	uint32_t _homeId,
+	uint64_t _valueId
+)
+{
+	std::vector<WriteReport> reports;
+	{
+		boost::lock_guard<boost::mutex> lock( m_mutex );
+		std::map<ValueKey, Sent>::iterator it = m_sent.find( ValueKey( _homeId, _valueId ) );
+		// a report arriving while SetValue is still running predates the write
+		if( ( it == m_sent.end() ) || !it->second.m_sentAt )
+		{
+			return;
+		}
+		++m_confirmed;
+		reports.push_back( MakeReport( it->second.m_ticket, WriteStatus::Write_Confirmed, it->second.m_id ) );
+		m_sent.erase( it );
+	}
+	Deliver( reports );
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::GetStatistics>
+//-----------------------------------------------------------------------------
+void WriteScheduler::GetStatistics
+(
+	WriteSchedulerStatistics& _stats
+)
+{
+	boost::lock_guard<boost::mutex> lock( m_mutex );
+	_stats.m_pending.assign( c_priorities, 0 );
+	for( std::map<ValueKey, Pending>::const_iterator it = m_pending.begin(); it != m_pending.end(); ++it )
+	{
+		++_stats.m_pending[it->second.m_priority];
+	}
+	_stats.m_capacity = m_capacity;
+	_stats.m_limits.assign( m_limits, m_limits + c_priorities );
+	_stats.m_awaiting = m_sent.size();
+	_stats.m_scheduled = m_scheduled;
+	_stats.m_superseded = m_superseded;
+	_stats.m_rejected = m_rejected;
+	_stats.m_deferred = m_deferred;
+	_stats.m_dispatched = m_dispatched;
+	_stats.m_failed = m_failed;
+	_stats.m_confirmed = m_confirmed;
+	_stats.m_unconfirmed = m_unconfirmed;
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::Next>
+// The most urgent waiting write whose network admits it, the oldest first;
+// the caller holds m_mutex
+//-----------------------------------------------------------------------------
+bool WriteScheduler::Next
+(
+	std::map<uint32_t, uint32_t> const& _depths,
+	Pending& _write
+)
+{
+	for( uint32_t priority = 0; priority < c_priorities; ++priority )
+	{
+		std::deque<ValueKey>& queue = m_queues[priority];
+		std::deque<ValueKey>::iterator it = queue.begin();
+		while( it != queue.end() )
+		{
+			std::map<ValueKey, Pending>::iterator pending = m_pending.find( *it );
+			if( ( pending == m_pending.end() ) || ( pending->second.m_priority != priority ) )
+			{
+				// raised to a more urgent queue, or gone already
+				it = queue.erase( it );
+				continue;
+			}
+			// a network that showed up since its send queue was read waits a round
+			std::map<uint32_t, uint32_t>::const_iterator depth = _depths.find( it->first );
+			if( ( depth != _depths.end() ) && ( depth->second < m_limits[priority] ) )
+			{
+				_write = pending->second;
+				m_pending.erase( pending );
+				queue.erase( it );
+				return true;
+			}
+			++it;
+		}
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::Expire>
+// Sent writes the node didn't report back in time; the caller holds m_mutex
+//-----------------------------------------------------------------------------
+void WriteScheduler::Expire
+(
+	std::vector<WriteReport>& _reports
+)
+{
+	uint64_t const now = NowMs();
+	std::map<ValueKey, Sent>::iterator it = m_sent.begin();
+	while( it != m_sent.end() )
+	{
+		if( it->second.m_sentAt && ( now - it->second.m_sentAt > m_timeoutMs ) )
+		{
+			++m_unconfirmed;
+			_reports.push_back( MakeReport( it->second.m_ticket, WriteStatus::Write_Unconfirmed, it->second.m_id ) );
+			m_sent.erase( it++ );
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::Deliver>
+// Report status changes, never under m_mutex
+//-----------------------------------------------------------------------------
+void WriteScheduler::Deliver
+(
+	std::vector<WriteReport>& _reports
+)
+{
+	for( std::vector<WriteReport>::const_iterator it = _reports.begin(); it != _reports.end(); ++it )
+	{
+		try
+		{
+			m_report( *it );
+		}
+		catch( std::exception& e )
+		{
+			std::cerr << "WriteScheduler: reporting ticket " << it->m_ticket << " failed: " << e.what() << std::endl;
+		}
+	}
+	_reports.clear();
+}
+
+//-----------------------------------------------------------------------------
+// <WriteScheduler::Run>
+// The scheduler thread: dispatches one write at a time, reading the send
+// queue of the networks concerned (and calling OpenZWave) without m_mutex
+//-----------------------------------------------------------------------------
+void WriteScheduler::Run()
+{
+	std::vector<WriteReport> reports;
+	std::map<uint32_t, uint32_t> depths;
+	boost::unique_lock<boost::mutex> lock( m_mutex );
+	while( m_running )
+	{
+		Expire( reports );
+		depths.clear();
+		for( std::map<ValueKey, Pending>::const_iterator it = m_pending.begin(); it != m_pending.end(); ++it )
+		{
+			depths[it->first.first] = 0;
+		}
+		lock.unlock();
+		Deliver( reports );
+		for( std::map<uint32_t, uint32_t>::iterator it = depths.begin(); it != depths.end(); ++it )
+		{
+			it->second = m_queueDepth( it->first );
+		}
+		lock.lock();
+
+		Pending write;
+		if( !Next( depths, write ) )
+		{
+			if( m_running )
+			{
+				if( !m_pending.empty() )
+				{
+					// held back until the send queues drain
+					++m_deferred;
+				}
+				m_cond.timed_wait( lock, boost::posix_time::milliseconds( m_pending.empty() ? std::min<uint64_t>( c_idleMs, m_timeoutMs ) : c_pollMs ) );
+			}
+			continue;
+		}
+
+		// a write still awaiting confirmation is replaced by this one
+		ValueKey const key = Key( write.m_id );
+		std::map<ValueKey, Sent>::iterator sent = m_sent.find( key );
+		if( sent != m_sent.end() )
+		{
+			++m_superseded;
+			reports.push_back( MakeReport( sent->second.m_ticket, WriteStatus::Write_Superseded, sent->second.m_id ) );
+		}
+		Sent& entry = m_sent[key];
+		entry.m_ticket = write.m_ticket;
+		entry.m_sentAt = 0;
+		entry.m_id = write.m_id;
+		lock.unlock();
+
+		bool accepted = false;
+		try
+		{
+			accepted = m_dispatch( write.m_id, write.m_value );
+		}
+		catch( std::exception& e )
+		{
+			std::cerr << "WriteScheduler: ticket " << write.m_ticket << " failed: " << e.what() << std::endl;
+		}
+		// reported before a confirmation can be
+		reports.push_back( MakeReport( write.m_ticket, accepted ? WriteStatus::Write_Sent : WriteStatus::Write_Failed, write.m_id ) );
+		Deliver( reports );
+
+		lock.lock();
+		sent = m_sent.find( key );
+		if( accepted )
+		{
+			++m_dispatched;
+			if( ( sent != m_sent.end() ) && ( sent->second.m_ticket == write.m_ticket ) )
+			{
+				sent->second.m_sentAt = std::max<uint64_t>( NowMs(), 1 );
+			}
+		}
+		else
+		{
+			++m_failed;
+			if( ( sent != m_sent.end() ) && ( sent->second.m_ticket == write.m_ticket ) )
+			{
+				m_sent.erase( sent );
+			}
+		}
+	}
+}
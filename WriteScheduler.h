@@ -0,0 +1,156 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// WriteScheduler.h: a write queue in front of OpenZWave's Manager::SetValue
+// (ScheduleValueWrite)
+//
+// A dimmer slider sends dozens of intermediate levels for one value, and
+// OpenZWave's send queue would play every one of them out over the radio.
+// Writes scheduled here wait in one queue per WritePriority instead:
+//
+// - a write replaces the one still waiting for the same value (last writer
+//   wins), keeping its place in the queue;
+// - the most urgent waiting write goes first;
+// - a write is only handed to OpenZWave while the driver's send queue is
+//   shorter than the limit of its priority (admission control), so bulk
+//   writes never bury the interactive ones under a long send queue.
+//
+// Every write gets a ticket; its progress (WriteStatus) is reported through
+// the callback given at construction, ozwd publishes it on the network's
+// notification topic.
+//
+
+#ifndef _WriteScheduler_H
+#define _WriteScheduler_H
+
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+
+#include "ozw_types.h"
+
+// a change in the status of a write ticket
+struct WriteReport
+{
+	uint64_t							m_ticket;
+	OpenZWave::WriteStatus::type		m_status;
+	OpenZWave::RemoteValueID			m_id;
+};
+
+class WriteScheduler
+{
+public:
+	static uint32_t const c_priorities = 3;		// WritePriority values
+
+	// hands a write to OpenZWave, false if refused
+	typedef boost::function<bool( OpenZWave::RemoteValueID const&, OpenZWave::RemoteValue const& )>	Dispatch;
+	// length of a network's send queue
+	typedef boost::function<uint32_t( uint32_t _homeId )>												QueueDepth;
+	typedef boost::function<void( WriteReport const& )>												Report;
+
+	// at most _capacity writes wait (to distinct values); a write of priority
+	// p is dispatched while the send queue is shorter than _limits[p]; a write
+	// not reported back by the node within _timeoutMs is Write_Unconfirmed
+	WriteScheduler( Dispatch _dispatch, QueueDepth _queueDepth, Report _report,
+		uint32_t _capacity, uint32_t const _limits[c_priorities], uint32_t _timeoutMs );
+	~WriteScheduler();
+
+	void Start();
+	// stop the scheduler thread, the writes still waiting are dropped
+	void Stop();
+
+	// queue a write (Write_Queued), or Write_Rejected with ticket 0 if full
+	OpenZWave::WriteTicket Schedule( OpenZWave::RemoteValueID const& _id,
+		OpenZWave::RemoteValue const& _value, uint32_t _priority );
+
+	// OpenZWave reported the value (ValueChanged/ValueRefreshed): confirms
+	// the write sent to it, if any
+	void OnValueReported( uint32_t _homeId, uint64_t _valueId );
+
+	void GetStatistics( OpenZWave::WriteSchedulerStatistics& _stats );
+
+private:
+	typedef std::pair<uint32_t, uint64_t> ValueKey;		// homeId, ValueID
+
+	struct Pending
+	{
+		uint64_t					m_ticket;
+		uint32_t					m_priority;
+		OpenZWave::RemoteValueID	m_id;
+		OpenZWave::RemoteValue		m_value;
+	};
+
+	struct Sent
+	{
+		uint64_t					m_ticket;
+		uint64_t					m_sentAt;		// ms, 0 while OpenZWave has it
+		OpenZWave::RemoteValueID	m_id;
+	};
+
+	void Run();
+	bool Next( std::map<uint32_t, uint32_t> const& _depths, Pending& _write );
+	void Expire( std::vector<WriteReport>& _reports );
+	void Deliver( std::vector<WriteReport>& _reports );
+	static ValueKey Key( OpenZWave::RemoteValueID const& _id );
+
+	Dispatch		m_dispatch;
+	QueueDepth		m_queueDepth;
+	Report			m_report;
+	uint32_t		m_capacity;
+	uint32_t		m_limits[c_priorities];
+	uint32_t		m_timeoutMs;
+
+	// guards everything below
+	boost::mutex						m_mutex;
+	boost::condition_variable			m_cond;
+	std::map<ValueKey, Pending>			m_pending;
+	// FIFO per priority; a key whose write was raised to a more urgent
+	// priority (or already sent) is skipped when met
+	std::deque<ValueKey>				m_queues[c_priorities];
+	// writes handed to OpenZWave, until the node reports the value
+	std::map<ValueKey, Sent>			m_sent;
+	uint64_t							m_lastTicket;
+
+	boost::atomic<bool>		m_running;
+	boost::thread			m_thread;
+
+	uint64_t		m_scheduled;
+	uint64_t		m_superseded;
+	uint64_t		m_rejected;
+	uint64_t		m_deferred;
+	uint64_t		m_dispatched;
+	uint64_t		m_failed;
+	uint64_t		m_confirmed;
+	uint64_t		m_unconfirmed;
+};
+
+#endif
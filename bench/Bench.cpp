@@ -0,0 +1,752 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// Bench.cpp: ozwd-bench, RPC and notification throughput of ozwd
+//
+// Runs ozwd (Main.cpp, built with -Dmain=ozwd_main) in-process against the
+// fake OpenZWave network of FakeManager.cpp and a local STOMP sink, then
+// 1. hammers the Thrift interface with --clients concurrent clients, one
+//    RPC at a time for --duration seconds each, and
+// 2. fires a storm of --storm ValueChanged notifications, measuring how fast
+//    ozwd takes them and how fast they come out at the STOMP sink.
+// With --replay, it instead feeds a capture of a real network (ozwd
+// --capture) through ozwd, at --speed times the captured pace, and reports
+// the notification callback throughput, lock hold times and end-to-end
+// publish latency over the replay (from GetServerMetrics).
+// The results go to stdout (or --output) as one JSON document, so that runs
+// can be compared by scripts.
+//
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <stdexcept>
+
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/program_options.hpp>
+
+#include <transport/TSocket.h>
+#include <transport/TBufferTransports.h>
+#include <protocol/TBinaryProtocol.h>
+
+#include "RemoteManager.h"
+
+#include "NotificationCapture.h"
+
+#include "FakeManager.h"
+#include "StompSink.h"
+
+using namespace std;
+using namespace ::apache::thrift;
+using namespace ::apache::thrift::protocol;
+using namespace ::apache::thrift::transport;
+using boost::shared_ptr;
+
+namespace po = boost::program_options;
+
+// Main.cpp's main()
+extern int ozwd_main( int argc, char* argv[] );
+
+namespace
+{
+	typedef boost::function<void( OpenZWave::RemoteManagerClient& )> Call;
+
+	struct CaseResult
+	{
+		string		m_name;
+		uint64_t	m_calls;
+		uint64_t	m_errors;
+		double		m_seconds;
+		uint32_t	m_p50;		// latencies in µs
+		uint32_t	m_p99;
+		uint32_t	m_p999;
+		uint32_t	m_max;
+	};
+
+	struct Client
+	{
+		shared_ptr<TTransport>					m_transport;
+		shared_ptr<OpenZWave::RemoteManagerClient>	m_client;
+		vector<uint32_t>						m_latencies;
+		uint64_t								m_errors;
+	};
+
+	inline int64_t NowUs()
+	{
+		return ( boost::posix_time::microsec_clock::universal_time() -
+			boost::posix_time::ptime( boost::gregorian::date( 1970, 1, 1 ) ) ).total_microseconds();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <Connect>
+//-----------------------------------------------------------------------------
+static bool Connect
+(
+	Client& _client,
+	int _port
+)
+{
+	shared_ptr<TSocket> socket( new TSocket( "127.0.0.1", _port ) );
+	socket->setNoDelay( true );
+	_client.m_transport.reset( new TBufferedTransport( socket ) );
+	shared_ptr<TProtocol> protocol( new TBinaryProtocol( _client.m_transport ) );
+	_client.m_client.reset( new OpenZWave::RemoteManagerClient( protocol ) );
+	_client.m_errors = 0;
+	try
+	{
+		_client.m_transport->open();
+		return true;
+	}
+	catch( TException& e )
+	{
+		return false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <ClientLoop>
+// Call _call back to back until _deadline, recording each latency
+//-----------------------------------------------------------------------------
+static void ClientLoop
+(
+	Client* _client,
+	Call _call,
+	int64_t _deadline
+)
+{
+	_client->m_latencies.clear();
+	_client->m_latencies.reserve( 1 << 16 );
+	while( NowUs() < _deadline )
+	{
+		int64_t const start = NowUs();
+		try
+		{
+			_call( *_client->m_client );
+		}
+		catch( TException& e )
+		{
+			_client->m_errors++;
+			continue;
+		}
+		_client->m_latencies.push_back( (uint32_t)( NowUs() - start ) );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <Percentile>
+//-----------------------------------------------------------------------------
+static uint32_t Percentile
+(
+	vector<uint32_t> const& _sorted,
+	double _p
+)
+{
+	if( _sorted.empty() )
+	{
+		return 0;
+	}
+	size_t index = (size_t)( _p * ( _sorted.size() - 1 ) + 0.5 );
+	return _sorted[index];
+}
+
+//-----------------------------------------------------------------------------
+// <RunCase>
+// All clients call the same RPC for _seconds
+//-----------------------------------------------------------------------------
+static CaseResult RunCase
+(
+	string const& _name,
+	Call _call,
+	vector<Client>& _clients,
+	int _seconds
+)
+{
+	int64_t const start = NowUs();
+	int64_t const deadline = start + (int64_t)_seconds * 1000000;
+	boost::thread_group threads;
+	for( size_t i = 0; i < _clients.size(); ++i )
+	{
+		_clients[i].m_errors = 0;
+		threads.create_thread( boost::bind( ClientLoop, &_clients[i], _call, deadline ) );
+	}
+	threads.join_all();
+
+	CaseResult result;
+	result.m_name = _name;
+	result.m_seconds = ( NowUs() - start ) / 1e6;
+	result.m_errors = 0;
+	vector<uint32_t> all;
+	for( size_t i = 0; i < _clients.size(); ++i )
+	{
+		all.insert( all.end(), _clients[i].m_latencies.begin(), _clients[i].m_latencies.end() );
+		result.m_errors += _clients[i].m_errors;
+	}
+	sort( all.begin(), all.end() );
+	result.m_calls = all.size();
+	result.m_p50 = Percentile( all, 0.50 );
+	result.m_p99 = Percentile( all, 0.99 );
+	result.m_p999 = Percentile( all, 0.999 );
+	result.m_max = all.empty() ? 0 : all.back();
+	cerr << "ozwd-bench: " << setw( 20 ) << left << _name << right
+		<< setw( 10 ) << (uint64_t)( result.m_calls / result.m_seconds ) << " calls/s"
+		<< ", p50 " << result.m_p50 << "us, p99 " << result.m_p99 << "us, p99.9 " << result.m_p999 << "us" << endl;
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// The RPCs under test
+//-----------------------------------------------------------------------------
+static void CallGetValueAsBool( OpenZWave::RemoteManagerClient& _client, OpenZWave::RemoteValueID const& _id )
+{
+	OpenZWave::Bool_Bool result;
+	_client.GetValueAsBool( result, _id );
+}
+
+static void CallGetValueAsInt( OpenZWave::RemoteManagerClient& _client, OpenZWave::RemoteValueID const& _id )
+{
+	OpenZWave::Bool_Int result;
+	_client.GetValueAsInt( result, _id );
+}
+
+static void CallGetValueAsString( OpenZWave::RemoteManagerClient& _client, OpenZWave::RemoteValueID const& _id )
+{
+	OpenZWave::Bool_String result;
+	_client.GetValueAsString( result, _id );
+}
+
+static void CallSetValueInt32( OpenZWave::RemoteManagerClient& _client, OpenZWave::RemoteValueID const& _id )
+{
+	_client.SetValue_int32( _id, (int32_t)NowUs() );
+}
+
+static void CallScheduleValueWrite( OpenZWave::RemoteManagerClient& _client, OpenZWave::RemoteValueID const& _id )
+{
+	OpenZWave::RemoteValue value;
+	value.__set_m_int( (int32_t)NowUs() );
+	OpenZWave::WriteTicket ticket;
+	_client.ScheduleValueWrite( ticket, _id, value, OpenZWave::WritePriority::Write_Interactive );
+}
+
+static void CallGetNodeNeighbors( OpenZWave::RemoteManagerClient& _client, int8_t _nodeId )
+{
+	OpenZWave::UInt32_ListByte result;
+	_client.GetNodeNeighbors( result, FakeNetwork::c_homeId, _nodeId );
+}
+
+static void CallGetNetworkTopology( OpenZWave::RemoteManagerClient& _client )
+{
+	OpenZWave::NetworkTopology result;
+	_client.GetNetworkTopology( result, FakeNetwork::c_homeId );
+}
+
+static void CallGetValues( OpenZWave::RemoteManagerClient& _client, vector<OpenZWave::RemoteValueID> const& _ids )
+{
+	vector<OpenZWave::CachedValue> result;
+	_client.GetValues( result, _ids );
+}
+
+static void CallSendAllValues( OpenZWave::RemoteManagerClient& _client )
+{
+	_client.SendAllValues();
+}
+
+//-----------------------------------------------------------------------------
+// <LoadCapture>
+// The notifications of a capture's first network (the others are counted
+// in _skipped); returns its homeId
+//-----------------------------------------------------------------------------
+static uint32_t LoadCapture
+(
+	string const& _path,
+	vector<FakeNotification>& _notifications,
+	uint64_t& _skipped
+)
+{
+	CaptureReader reader( _path );
+	OpenZWave::RemoteNotification notification;
+	uint32_t homeId = 0;
+	_skipped = 0;
+	while( reader.Next( notification ) )
+	{
+		if( !homeId )
+		{
+			homeId = (uint32_t)notification.m_homeId;
+		}
+		if( (uint32_t)notification.m_homeId != homeId )
+		{
+			++_skipped;
+			continue;
+		}
+		OpenZWave::RemoteValue const& value = notification.m_value;
+		FakeNotification fake;
+		fake.m_type = (uint8_t)notification.m_type;
+		fake.m_nodeId = (uint8_t)notification.m_nodeId;
+		fake.m_byte = (uint8_t)notification.m_byte;
+		fake.m_timestamp = notification.m_timestamp;
+		fake.m_hasValueId = notification.__isset.m_valueId;
+		if( fake.m_hasValueId )
+		{
+			fake.m_id = notification.m_valueId.toValueID();
+		}
+		fake.m_hasValue = notification.__isset.m_value;
+		fake.m_bool = value.m_bool;
+		fake.m_byteValue = (uint8_t)value.m_byte;
+		fake.m_float = (float)value.m_decimal;
+		fake.m_int = value.m_int;
+		fake.m_short = value.m_short;
+		fake.m_string = value.__isset.m_listSelection ? value.m_listSelection : ( value.__isset.m_raw ? value.m_raw : value.m_string );
+		_notifications.push_back( fake );
+	}
+	if( _notifications.empty() )
+	{
+		throw runtime_error( _path + " holds no notifications" );
+	}
+	return homeId;
+}
+
+//-----------------------------------------------------------------------------
+// <HistogramJson>
+// The samples _after recorded since _before: their count, mean and p50/p99
+// (bucket bounds); the max is that of all samples
+//-----------------------------------------------------------------------------
+static string HistogramJson
+(
+	OpenZWave::MetricHistogram const& _before,
+	OpenZWave::MetricHistogram const& _after
+)
+{
+	int64_t const count = _after.m_count - _before.m_count;
+	uint64_t percentiles[2] = { 0, 0 };
+	double const quantiles[2] = { 0.50, 0.99 };
+	for( int q = 0; q < 2; ++q )
+	{
+		int64_t const rank = std::max<int64_t>( 1, (int64_t)ceil( quantiles[q] * count ) );
+		int64_t seen = 0;
+		for( size_t i = 0; ( count > 0 ) && ( i < _after.m_buckets.size() ); ++i )
+		{
+			seen += _after.m_buckets[i] - ( ( i < _before.m_buckets.size() ) ? _before.m_buckets[i] : 0 );
+			if( seen >= rank )
+			{
+				// bucket i holds [2^(i-1), 2^i) µs, the last one anything slower
+				percentiles[q] = ( i + 1 < _after.m_buckets.size() ) ? std::min<uint64_t>( (uint64_t)1 << i, _after.m_maxUs ) : _after.m_maxUs;
+				break;
+			}
+		}
+	}
+	ostringstream json;
+	json << "{ \"count\": " << count
+		<< ", \"meanUs\": " << ( ( count > 0 ) ? ( _after.m_sumUs - _before.m_sumUs ) / count : 0 )
+		<< ", \"p50Us\": " << percentiles[0] << ", \"p99Us\": " << percentiles[1]
+		<< ", \"maxUs\": " << _after.m_maxUs << " }";
+	return json.str();
+}
+
+//-----------------------------------------------------------------------------
+// <RunReplay>
+// Feed the capture through ozwd and wait for the publishers to drain;
+// returns the results as JSON
+//-----------------------------------------------------------------------------
+static string RunReplay
+(
+	Client& _client,
+	StompSink const& _sink,
+	string const& _path,
+	vector<FakeNotification> const& _notifications,
+	uint64_t _skipped,
+	double _speed
+)
+{
+	OpenZWave::ServerMetrics before, after;
+	_client.m_client->GetServerMetrics( before );
+	uint64_t const sent_before = _sink.GetMessages();
+	int64_t const start = NowUs();
+	FakeNetwork::Replay( _notifications, _speed );
+	double const replay_seconds = std::max( ( NowUs() - start ) / 1e6, 1e-6 );
+	OpenZWave::NotificationQueueStatistics queue;
+	bool drained = false;
+	int64_t const give_up = NowUs() + 60 * 1000000LL;
+	for( ;; )
+	{
+		_client.m_client->GetNotificationQueueStatistics( queue );
+		if( queue.m_depth == 0 )
+		{
+			drained = true;
+			break;
+		}
+		if( NowUs() > give_up )
+		{
+			break;
+		}
+		boost::this_thread::sleep( boost::posix_time::milliseconds( 1 ) );
+	}
+	double const drain_seconds = std::max( ( NowUs() - start ) / 1e6, 1e-6 );
+	uint64_t const published = _sink.GetMessages() - sent_before;
+	_client.m_client->GetServerMetrics( after );
+	double const captured_seconds = ( _notifications.back().m_timestamp - _notifications.front().m_timestamp ) / 1e3;
+	uint64_t const count = _notifications.size();
+	cerr << "ozwd-bench: replayed " << count << " notifications (" << captured_seconds << "s captured) in "
+		<< replay_seconds << "s: " << (uint64_t)( count / replay_seconds ) << " notifications/s in, "
+		<< (uint64_t)( published / drain_seconds ) << " messages/s out to STOMP" << endl;
+
+	ostringstream json;
+	json << "  \"replay\": { \"capture\": \"" << _path << "\", \"speed\": ";
+	if( _speed > 0 )
+	{
+		json << _speed;
+	}
+	else
+	{
+		json << "\"max\"";
+	}
+	json << ", \"notifications\": " << count << ", \"skipped\": " << _skipped
+		<< ", \"capturedSeconds\": " << captured_seconds << ", \"seconds\": " << replay_seconds
+		<< ", \"notificationsPerSecond\": " << (uint64_t)( count / replay_seconds )
+		<< ", \"published\": " << published
+		<< ", \"publishedPerSecond\": " << (uint64_t)( published / drain_seconds )
+		<< ", \"drained\": " << ( drained ? "true" : "false" ) << ",\n";
+	json << "    \"callback\": " << HistogramJson( before.m_notificationCallback, after.m_notificationCallback ) << ",\n";
+	json << "    \"publish\": " << HistogramJson( before.m_notificationPublish, after.m_notificationPublish ) << ",\n";
+	json << "    \"locks\": [\n";
+	OpenZWave::LockMetrics const none;
+	for( size_t i = 0; i < after.m_locks.size(); ++i )
+	{
+		OpenZWave::LockMetrics const& lock = after.m_locks[i];
+		OpenZWave::LockMetrics const& old = ( i < before.m_locks.size() ) ? before.m_locks[i] : none;
+		json << "      { \"name\": \"" << lock.m_name << "\", \"contended\": " << ( lock.m_contended - old.m_contended )
+			<< ",\n        \"writeHold\": " << HistogramJson( old.m_writeHold, lock.m_writeHold )
+			<< ",\n        \"readHold\": " << HistogramJson( old.m_readHold, lock.m_readHold )
+			<< " }" << ( ( i + 1 < after.m_locks.size() ) ? "," : "" ) << "\n";
+	}
+	json << "    ] }";
+	return json.str();
+}
+
+//-----------------------------------------------------------------------------
+// <WriteResults>
+//-----------------------------------------------------------------------------
+static void WriteResults
+(
+	string const& _json,
+	string const& _output
+)
+{
+	if( _output.empty() )
+	{
+		cout << _json;
+		cout.flush();
+	}
+	else
+	{
+		ofstream( _output.c_str() ) << _json;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <FirstOfType>
+//-----------------------------------------------------------------------------
+static OpenZWave::RemoteValueID FirstOfType
+(
+	vector<OpenZWave::ValueID> const& _ids,
+	OpenZWave::ValueID::ValueType _type
+)
+{
+	for( size_t i = 0; i < _ids.size(); ++i )
+	{
+		if( _ids[i].GetType() == _type )
+		{
+			return OpenZWave::RemoteValueID( _ids[i] );
+		}
+	}
+	return OpenZWave::RemoteValueID( _ids[0] );
+}
+
+//-----------------------------------------------------------------------------
+// <RunOzwd>
+//-----------------------------------------------------------------------------
+static void RunOzwd
+(
+	vector<string> _args
+)
+{
+	vector<char*> argv;
+	for( size_t i = 0; i < _args.size(); ++i )
+	{
+		argv.push_back( const_cast<char*>( _args[i].c_str() ) );
+	}
+	argv.push_back( NULL );
+	int const rc = ozwd_main( (int)_args.size(), &argv[0] );
+	cerr << "ozwd-bench: ozwd exited with " << rc << endl;
+	exit( 10 + rc );
+}
+
+int main( int argc, char* argv[] )
+{
+	int nodes, values, clients, duration, storm, thrift_port, stomp_port;
+	string output, replay, speed_name;
+	double speed = 0;
+	vector<string> ozwd_args;
+
+	po::options_description desc("ozwd-bench: Thrift RPC and STOMP notification benchmark of ozwd on a simulated network\n"
+		"usage: ozwd-bench [options] [-- ozwd options]\noptions");
+	desc.add_options()
+		("help,?", "print this help message")
+		("nodes,n",      po::value<int>(&nodes)->default_value(32), "simulated nodes (1..232)")
+		("values,v",     po::value<int>(&values)->default_value(16), "values per node")
+		("clients,k",    po::value<int>(&clients)->default_value(4), "concurrent Thrift clients")
+		("duration,d",   po::value<int>(&duration)->default_value(5), "seconds per RPC case")
+		("storm",        po::value<int>(&storm)->default_value(100000), "ValueChanged notifications in the notification storm (0: skip it)")
+		("thriftport,t", po::value<int>(&thrift_port)->default_value(19090), "ozwd's Thrift port")
+		("stompport,s",  po::value<int>(&stomp_port)->default_value(16613), "the STOMP sink's port")
+		("output,o",     po::value<string>(&output)->default_value(""), "write the JSON results to this file instead of stdout")
+		("replay",       po::value<string>(&replay)->default_value(""), "instead of the RPC cases and the storm, replay this capture (ozwd --capture), the network being the captured one")
+		("speed",        po::value<string>(&speed_name)->default_value("max"), "--replay pace: a multiple of the captured pace (e.g. 1 or 10), or max")
+	;
+	// everything after "--" is for ozwd
+	int bench_argc = argc;
+	for( int i = 1; i < argc; ++i )
+	{
+		if( string( argv[i] ) == "--" )
+		{
+			bench_argc = i;
+			ozwd_args.assign( argv + i + 1, argv + argc );
+			break;
+		}
+	}
+	try
+	{
+		po::variables_map vm;
+		po::store( po::parse_command_line( bench_argc, argv, desc ), vm );
+		po::notify( vm );
+		if( vm.count( "help" ) )
+		{
+			cout << desc << "\n";
+			return 1;
+		}
+		if( ( nodes < 1 ) || ( nodes > 232 ) || ( values < 1 ) || ( clients < 1 ) || ( duration < 1 ) || ( storm < 0 ) )
+		{
+			throw po::invalid_option_value( "--nodes/--values/--clients/--duration/--storm" );
+		}
+		if( speed_name != "max" )
+		{
+			char* end = NULL;
+			speed = strtod( speed_name.c_str(), &end );
+			if( *end || !( speed > 0 ) )
+			{
+				throw po::invalid_option_value( speed_name );
+			}
+		}
+	}
+	catch( exception& e )
+	{
+		cerr << "ozwd-bench: " << e.what() << endl;
+		return 2;
+	}
+
+	// the fake network (or the captured one), the STOMP sink and ozwd
+	vector<FakeNotification> captured;
+	uint64_t skipped = 0;
+	if( replay.empty() )
+	{
+		FakeNetwork::Configure( nodes, values );
+	}
+	else
+	{
+		try
+		{
+			uint32_t const homeId = LoadCapture( replay, captured, skipped );
+			FakeNetwork::Load( homeId, captured );
+		}
+		catch( exception& e )
+		{
+			cerr << "ozwd-bench: " << e.what() << endl;
+			return 2;
+		}
+	}
+	StompSink sink( (uint16_t)stomp_port );
+	vector<string> args;
+	args.push_back( "ozwd" );
+	args.push_back( "--thriftport" );
+	args.push_back( boost::lexical_cast<string>( thrift_port ) );
+	args.push_back( "--stomphost" );
+	args.push_back( "127.0.0.1" );
+	args.push_back( "--stompport" );
+	args.push_back( boost::lexical_cast<string>( stomp_port ) );
+	args.push_back( "--ozwport" );
+	args.push_back( "fake" );
+	args.insert( args.end(), ozwd_args.begin(), ozwd_args.end() );
+	boost::thread ozwd( boost::bind( RunOzwd, args ) );
+
+	if( !FakeNetwork::WaitReady( 30000 ) )
+	{
+		cerr << "ozwd-bench: the fake network was never queried" << endl;
+		exit( 3 );
+	}
+	vector<Client> connections( clients );
+	for( int attempt = 0; ; ++attempt )
+	{
+		if( Connect( connections[0], thrift_port ) )
+		{
+			break;
+		}
+		if( attempt == 100 )
+		{
+			cerr << "ozwd-bench: can't connect to ozwd on port " << thrift_port << endl;
+			exit( 4 );
+		}
+		boost::this_thread::sleep( boost::posix_time::milliseconds( 100 ) );
+	}
+	for( int i = 1; i < clients; ++i )
+	{
+		if( !Connect( connections[i], thrift_port ) )
+		{
+			cerr << "ozwd-bench: client " << i << " can't connect" << endl;
+			exit( 4 );
+		}
+	}
+
+	vector<OpenZWave::ValueID> ids;
+	FakeNetwork::GetValueIDs( ids );
+	if( !replay.empty() )
+	{
+		ostringstream json;
+		json << "{\n  \"values\": " << ids.size() << ",\n"
+			<< RunReplay( connections[0], sink, replay, captured, skipped, speed ) << "\n}\n";
+		WriteResults( json.str(), output );
+		// ozwd's servers never return
+		exit( 0 );
+	}
+
+	// 1. RPCs
+	vector<OpenZWave::RemoteValueID> node_ids;
+	for( size_t i = 0; i < ids.size(); ++i )
+	{
+		if( ids[i].GetNodeId() == ids[0].GetNodeId() )
+		{
+			node_ids.push_back( OpenZWave::RemoteValueID( ids[i] ) );
+		}
+	}
+	vector<CaseResult> results;
+	results.push_back( RunCase( "GetValueAsBool",
+		boost::bind( CallGetValueAsBool, _1, FirstOfType( ids, OpenZWave::ValueID::ValueType_Bool ) ), connections, duration ) );
+	results.push_back( RunCase( "GetValueAsInt",
+		boost::bind( CallGetValueAsInt, _1, FirstOfType( ids, OpenZWave::ValueID::ValueType_Int ) ), connections, duration ) );
+	results.push_back( RunCase( "GetValueAsString",
+		boost::bind( CallGetValueAsString, _1, FirstOfType( ids, OpenZWave::ValueID::ValueType_String ) ), connections, duration ) );
+	results.push_back( RunCase( "SetValue_int32",
+		boost::bind( CallSetValueInt32, _1, FirstOfType( ids, OpenZWave::ValueID::ValueType_Int ) ), connections, duration ) );
+	results.push_back( RunCase( "ScheduleValueWrite",
+		boost::bind( CallScheduleValueWrite, _1, FirstOfType( ids, OpenZWave::ValueID::ValueType_Int ) ), connections, duration ) );
+	results.push_back( RunCase( "GetNodeNeighbors",
+		boost::bind( CallGetNodeNeighbors, _1, (int8_t)ids[0].GetNodeId() ), connections, duration ) );
+	results.push_back( RunCase( "GetNetworkTopology", CallGetNetworkTopology, connections, duration ) );
+	results.push_back( RunCase( "GetValues",
+		boost::bind( CallGetValues, _1, node_ids ), connections, duration ) );
+	// publishes every value, i.e. also loads the STOMP path
+	results.push_back( RunCase( "SendAllValues", CallSendAllValues, connections, duration ) );
+
+	// 2. notification storm: how fast does OnNotification take them, and how
+	// fast does the publisher get them out to STOMP
+	OpenZWave::NotificationQueueStatistics before, after;
+	double storm_seconds = 0, drain_seconds = 0;
+	uint64_t delivered = 0;
+	bool drained = false;
+	if( storm > 0 )
+	{
+		connections[0].m_client->GetNotificationQueueStatistics( before );
+		while( before.m_depth > 0 )
+		{
+			boost::this_thread::sleep( boost::posix_time::milliseconds( 10 ) );
+			connections[0].m_client->GetNotificationQueueStatistics( before );
+		}
+		uint64_t const sent_before = sink.GetMessages();
+		int64_t const start = NowUs();
+		FakeNetwork::Storm( storm );
+		storm_seconds = ( NowUs() - start ) / 1e6;
+		int64_t const give_up = NowUs() + 60 * 1000000LL;
+		for( ;; )
+		{
+			connections[0].m_client->GetNotificationQueueStatistics( after );
+			if( after.m_depth == 0 )
+			{
+				drained = true;
+				break;
+			}
+			if( NowUs() > give_up )
+			{
+				break;
+			}
+			boost::this_thread::sleep( boost::posix_time::milliseconds( 1 ) );
+		}
+		drain_seconds = ( NowUs() - start ) / 1e6;
+		delivered = sink.GetMessages() - sent_before;
+		cerr << "ozwd-bench: notification storm: " << (uint64_t)( storm / storm_seconds ) << " notifications/s in, "
+			<< (uint64_t)( delivered / drain_seconds ) << " messages/s out to STOMP" << endl;
+	}
+
+	ostringstream json;
+	json << "{\n";
+	json << "  \"nodes\": " << nodes << ", \"values\": " << ids.size() << ", \"clients\": " << clients
+		<< ", \"duration\": " << duration << ",\n";
+	json << "  \"rpc\": [\n";
+	for( size_t i = 0; i < results.size(); ++i )
+	{
+		CaseResult const& r = results[i];
+		json << "    { \"name\": \"" << r.m_name << "\", \"calls\": " << r.m_calls << ", \"errors\": " << r.m_errors
+			<< ", \"callsPerSecond\": " << (uint64_t)( r.m_calls / r.m_seconds )
+			<< ", \"p50Us\": " << r.m_p50 << ", \"p99Us\": " << r.m_p99 << ", \"p999Us\": " << r.m_p999
+			<< ", \"maxUs\": " << r.m_max << " }" << ( ( i + 1 < results.size() ) ? "," : "" ) << "\n";
+	}
+	json << "  ]";
+	if( storm > 0 )
+	{
+		json << ",\n  \"storm\": { \"notifications\": " << storm
+			<< ", \"notificationsPerSecond\": " << (uint64_t)( storm / storm_seconds )
+			<< ", \"published\": " << delivered
+			<< ", \"publishedPerSecond\": " << (uint64_t)( delivered / drain_seconds )
+			<< ", \"drained\": " << ( drained ? "true" : "false" )
+			<< ", \"coalesced\": " << ( after.m_coalesced - before.m_coalesced )
+			<< ", \"dropped\": " << ( after.m_dropped - before.m_dropped )
+			<< ", \"blocked\": " << ( after.m_blocked - before.m_blocked )
+			<< ", \"maxDepth\": " << after.m_maxDepth << " }";
+	}
+	json << "\n}\n";
+	WriteResults( json.str(), output );
+	// ozwd's servers never return
+	exit( 0 );
+}
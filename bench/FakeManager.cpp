@@ -0,0 +1,583 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// FakeManager.cpp: a simulated OpenZWave network for ozwd-bench
+//
+
+#include <string>
+#include <list>
+#include <deque>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "Defs.h"
+#include "ValueID.h"
+// only OpenZWave's Driver may create notifications, and the fake plays its part
+#define private public
+#include "Notification.h"
+#undef private
+#include "Manager.h"
+#include "Options.h"
+#include "Log.h"
+#include "Node.h"
+
+#include "FakeManager.h"
+
+using namespace OpenZWave;
+using std::string;
+
+namespace
+{
+	struct FakeValue
+	{
+		ValueID		m_id;
+		bool		m_bool;
+		uint8		m_byte;
+		float		m_float;
+		int32		m_int;
+		int16		m_short;
+		string		m_string;
+
+		FakeValue( ValueID const& _id ):
+			m_id( _id ), m_bool( false ), m_byte( 0 ), m_float( 0 ), m_int( 0 ), m_short( 0 ) {}
+	};
+
+	struct Watcher
+	{
+		pfnOnNotification_t	m_callback;
+		void*				m_context;
+	};
+
+	// a notification waiting for the fake driver thread
+	struct Pending
+	{
+		Notification::NotificationType	m_type;
+		uint8							m_nodeId;
+		ValueID							m_id;
+	};
+
+	// value types of a node's values, in turn
+	ValueID::ValueType const c_types[] =
+	{
+		ValueID::ValueType_Bool, ValueID::ValueType_Byte, ValueID::ValueType_Decimal,
+		ValueID::ValueType_Int, ValueID::ValueType_Short, ValueID::ValueType_String
+	};
+
+	uint32									s_homeId = FakeNetwork::c_homeId;
+	uint32									s_nodes = 8;
+	uint32									s_valuesPerNode = 12;
+	bool									s_replay = false;	// Load()ed, the driver thread only gets ready
+	std::vector<ValueID>					s_ids;
+	boost::unordered_map<uint64, FakeValue*>	s_values;
+	boost::mutex							s_valueMutex;	// OpenZWave's own locking
+	std::vector<Watcher>					s_watchers;
+
+	boost::mutex							s_driverMutex;
+	boost::condition_variable				s_driverCond;
+	std::deque<Pending>						s_pending;
+	bool									s_ready = false;
+	boost::thread							s_driver;
+	string									s_controllerPath;
+}
+
+//-----------------------------------------------------------------------------
+// <Notify>
+// Hand a notification to every watcher, like Manager::NotifyWatchers
+//-----------------------------------------------------------------------------
+static void Notify
+(
+	Notification::NotificationType _type,
+	uint8 _nodeId,
+	ValueID const* _id,
+	uint8 _byte = 0
+)
+{
+	Notification notification( _type );
+	notification.SetHomeAndNodeIds( s_homeId, _nodeId );
+	if( _id )
+	{
+		notification.SetValueId( *_id );
+	}
+	notification.m_byte = _byte;
+	for( std::vector<Watcher>::iterator it = s_watchers.begin(); it != s_watchers.end(); ++it )
+	{
+		it->m_callback( &notification, it->m_context );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <GetFakeValue>
+//-----------------------------------------------------------------------------
+static FakeValue* GetFakeValue
+(
+	ValueID const& _id
+)
+{
+	boost::unordered_map<uint64, FakeValue*>::iterator it = s_values.find( _id.GetId() );
+	return ( it != s_values.end() ) ? it->second : NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <Change>
+// A new value, as if the network had reported it (caller holds s_valueMutex)
+//-----------------------------------------------------------------------------
+static void Change
+(
+	FakeValue* _value,
+	uint32 _seed
+)
+{
+	_value->m_bool = ( _seed & 1 ) != 0;
+	_value->m_byte = (uint8)_seed;
+	_value->m_float = _seed * 0.1f;
+	_value->m_int = (int32)_seed;
+	_value->m_short = (int16)_seed;
+	std::ostringstream str;
+	str << "value " << _seed;
+	_value->m_string = str.str();
+}
+
+//-----------------------------------------------------------------------------
+// <SetCaptured>
+// The value a capture recorded (caller holds s_valueMutex)
+//-----------------------------------------------------------------------------
+static void SetCaptured
+(
+	FakeValue* _value,
+	FakeNotification const& _notification
+)
+{
+	_value->m_bool = _notification.m_bool;
+	_value->m_byte = _notification.m_byteValue;
+	_value->m_float = _notification.m_float;
+	_value->m_int = _notification.m_int;
+	_value->m_short = _notification.m_short;
+	_value->m_string = _notification.m_string;
+}
+
+//-----------------------------------------------------------------------------
+// <DriverThread>
+// Reports the network, then delivers the notifications queued by SetValue
+//-----------------------------------------------------------------------------
+static void DriverThread()
+{
+	// ozwd waits for DriverReady only once its Thrift server is set up
+	boost::this_thread::sleep( boost::posix_time::milliseconds( 500 ) );
+	// a capture reports its network itself
+	if( !s_replay )
+	{
+		Notify( Notification::Type_DriverReady, 1, NULL );
+		for( uint32 node = 1; node <= s_nodes; ++node )
+		{
+			Notify( Notification::Type_NodeAdded, node, NULL );
+			for( uint32 i = 0; i < s_ids.size(); ++i )
+			{
+				if( s_ids[i].GetNodeId() == node )
+				{
+					Notify( Notification::Type_ValueAdded, node, &s_ids[i] );
+				}
+			}
+			Notify( Notification::Type_NodeQueriesComplete, node, NULL );
+		}
+		Notify( Notification::Type_AllNodesQueried, 1, NULL );
+	}
+	{
+		boost::lock_guard<boost::mutex> lock( s_driverMutex );
+		s_ready = true;
+	}
+	s_driverCond.notify_all();
+
+	for( ;; )
+	{
+		Pending pending;
+		{
+			boost::unique_lock<boost::mutex> lock( s_driverMutex );
+			while( s_pending.empty() )
+			{
+				s_driverCond.wait( lock );
+			}
+			pending = s_pending.front();
+			s_pending.pop_front();
+		}
+		Notify( pending.m_type, pending.m_nodeId, &pending.m_id );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <QueueValueChanged>
+// OpenZWave reports a new value once the device confirmed it, never from
+// inside the SetValue call
+//-----------------------------------------------------------------------------
+static void QueueValueChanged
+(
+	ValueID const& _id
+)
+{
+	Pending pending = { Notification::Type_ValueChanged, _id.GetNodeId(), _id };
+	{
+		boost::lock_guard<boost::mutex> lock( s_driverMutex );
+		s_pending.push_back( pending );
+	}
+	s_driverCond.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// <FakeNetwork::Configure>
+//-----------------------------------------------------------------------------
+void FakeNetwork::Configure
+(
+	uint32 _nodes,
+	uint32 _valuesPerNode
+)
+{
+	s_nodes = std::min<uint32>( std::max<uint32>( _nodes, 1 ), 232 );
+	s_valuesPerNode = std::max<uint32>( _valuesPerNode, 1 );
+	s_ids.clear();
+	for( uint32 node = 1; node <= s_nodes; ++node )
+	{
+		for( uint32 i = 0; i < s_valuesPerNode; ++i )
+		{
+			ValueID::ValueType const type = c_types[i % ( sizeof(c_types) / sizeof(c_types[0]) )];
+			// 256 values per instance of the multilevel sensor class
+			ValueID id( c_homeId, (uint8)node, ValueID::ValueGenre_User, 0x31, (uint8)( 1 + i / 256 ), (uint8)( i % 256 ), type );
+			s_ids.push_back( id );
+			FakeValue* value = new FakeValue( id );
+			Change( value, node * 1000 + i );
+			s_values[id.GetId()] = value;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <FakeNetwork::WaitReady>
+//-----------------------------------------------------------------------------
+bool FakeNetwork::WaitReady
+(
+	uint32 _timeoutMs
+)
+{
+	boost::system_time const deadline = boost::get_system_time() + boost::posix_time::milliseconds( _timeoutMs );
+	boost::unique_lock<boost::mutex> lock( s_driverMutex );
+	while( !s_ready )
+	{
+		if( !s_driverCond.timed_wait( lock, deadline ) )
+		{
+			return s_ready;
+		}
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <FakeNetwork::GetValueIDs>
+//-----------------------------------------------------------------------------
+void FakeNetwork::GetValueIDs
+(
+	std::vector<ValueID>& _values
+)
+{
+	_values = s_ids;
+}
+
+//-----------------------------------------------------------------------------
+// <FakeNetwork::Storm>
+//-----------------------------------------------------------------------------
+void FakeNetwork::Storm
+(
+	uint32 _count
+)
+{
+	for( uint32 i = 0; i < _count; ++i )
+	{
+		ValueID const& id = s_ids[i % s_ids.size()];
+		{
+			boost::lock_guard<boost::mutex> lock( s_valueMutex );
+			Change( GetFakeValue( id ), i );
+		}
+		Notify( Notification::Type_ValueChanged, id.GetNodeId(), &id );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <FakeNetwork::Load>
+//-----------------------------------------------------------------------------
+void FakeNetwork::Load
+(
+	uint32 _homeId,
+	std::vector<FakeNotification> const& _notifications
+)
+{
+	s_homeId = _homeId;
+	s_replay = true;
+	s_nodes = 1;
+	s_ids.clear();
+	s_values.clear();
+	for( std::vector<FakeNotification>::const_iterator it = _notifications.begin(); it != _notifications.end(); ++it )
+	{
+		s_nodes = std::max<uint32>( s_nodes, it->m_nodeId );
+		if( !it->m_hasValueId || ( it->m_id.GetHomeId() != _homeId ) || GetFakeValue( it->m_id ) )
+		{
+			continue;
+		}
+		s_ids.push_back( it->m_id );
+		FakeValue* value = new FakeValue( it->m_id );
+		if( it->m_hasValue )
+		{
+			SetCaptured( value, *it );
+		}
+		s_values[it->m_id.GetId()] = value;
+	}
+	s_nodes = std::min<uint32>( s_nodes, 232 );
+}
+
+//-----------------------------------------------------------------------------
+// <FakeNetwork::Replay>
+//-----------------------------------------------------------------------------
+void FakeNetwork::Replay
+(
+	std::vector<FakeNotification> const& _notifications,
+	double _speed
+)
+{
+	if( _notifications.empty() )
+	{
+		return;
+	}
+	boost::system_time const start = boost::get_system_time();
+	int64 const first = _notifications.front().m_timestamp;
+	for( std::vector<FakeNotification>::const_iterator it = _notifications.begin(); it != _notifications.end(); ++it )
+	{
+		if( _speed > 0 )
+		{
+			boost::system_time const due = start + boost::posix_time::microseconds( (int64)( ( it->m_timestamp - first ) * 1000 / _speed ) );
+			if( due > boost::get_system_time() )
+			{
+				boost::this_thread::sleep( due );
+			}
+		}
+		if( it->m_hasValue )
+		{
+			boost::lock_guard<boost::mutex> lock( s_valueMutex );
+			if( FakeValue* value = GetFakeValue( it->m_id ) )
+			{
+				SetCaptured( value, *it );
+			}
+		}
+		Notify( (Notification::NotificationType)it->m_type, it->m_nodeId, it->m_hasValueId ? &it->m_id : NULL, it->m_byte );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// OpenZWave::Manager, the parts ozwd-bench exercises
+// (fake_manager.rb leaves these out of FakeManager_stubs.cpp)
+//-----------------------------------------------------------------------------
+Manager* Manager::s_instance = NULL;
+
+Manager* Manager::Create()
+{
+	if( !s_instance )
+	{
+		s_instance = new Manager();
+	}
+	return s_instance;
+}
+
+bool Manager::AddWatcher( pfnOnNotification_t _watcher, void* _context )
+{
+	Watcher watcher = { _watcher, _context };
+	s_watchers.push_back( watcher );
+	return true;
+}
+
+bool Manager::AddDriver( string const& _controllerPath, Driver::ControllerInterface const& _interface )
+{
+	s_controllerPath = _controllerPath;
+	s_driver = boost::thread( DriverThread );
+	return true;
+}
+
+string Manager::GetControllerPath( uint32 const _homeId )
+{
+	return s_controllerPath;
+}
+
+#define FAKE_GETTER( _name, _type, _member )								\
+bool Manager::_name( ValueID const& _id, _type* o_value )					\
+{																			\
+	boost::lock_guard<boost::mutex> lock( s_valueMutex );					\
+	FakeValue* value = GetFakeValue( _id );									\
+	if( !value || ( _id.GetType() != value->m_id.GetType() ) )				\
+	{																		\
+		return false;														\
+	}																		\
+	*o_value = value->_member;												\
+	return true;															\
+}
+
+#define FAKE_SETTER( _type, _member )										\
+bool Manager::SetValue( ValueID const& _id, _type _value )					\
+{																			\
+	{																		\
+		boost::lock_guard<boost::mutex> lock( s_valueMutex );				\
+		FakeValue* value = GetFakeValue( _id );								\
+		if( !value )														\
+		{																	\
+			return false;													\
+		}																	\
+		value->_member = _value;											\
+	}																		\
+	QueueValueChanged( _id );												\
+	return true;															\
+}
+
+FAKE_GETTER( GetValueAsBool, bool, m_bool )
+FAKE_GETTER( GetValueAsByte, uint8, m_byte )
+FAKE_GETTER( GetValueAsFloat, float, m_float )
+FAKE_GETTER( GetValueAsInt, int32, m_int )
+FAKE_GETTER( GetValueAsShort, int16, m_short )
+FAKE_GETTER( GetValueListSelection, int32, m_int )
+FAKE_GETTER( GetValueListSelection, string, m_string )
+
+FAKE_SETTER( bool const, m_bool )
+FAKE_SETTER( uint8 const, m_byte )
+FAKE_SETTER( float const, m_float )
+FAKE_SETTER( int32 const, m_int )
+FAKE_SETTER( int16 const, m_short )
+FAKE_SETTER( string const&, m_string )
+
+bool Manager::SetValue( ValueID const& _id, uint8 const* _value, uint8 const _length )
+{
+	return SetValue( _id, string( (char const*)_value, _length ) );
+}
+
+bool Manager::GetValueAsString( ValueID const& _id, string* o_value )
+{
+	boost::lock_guard<boost::mutex> lock( s_valueMutex );
+	FakeValue* value = GetFakeValue( _id );
+	if( !value )
+	{
+		return false;
+	}
+	std::ostringstream str;
+	switch( _id.GetType() )
+	{
+		case ValueID::ValueType_Bool:		str << ( value->m_bool ? "True" : "False" );	break;
+		case ValueID::ValueType_Byte:		str << (uint32)value->m_byte;					break;
+		case ValueID::ValueType_Decimal:	str << value->m_float;							break;
+		case ValueID::ValueType_Int:		str << value->m_int;							break;
+		case ValueID::ValueType_Short:		str << value->m_short;							break;
+		default:							str << value->m_string;							break;
+	}
+	*o_value = str.str();
+	return true;
+}
+
+bool Manager::GetValueAsRaw( ValueID const& _id, uint8** o_value, uint8* o_length )
+{
+	boost::lock_guard<boost::mutex> lock( s_valueMutex );
+	FakeValue* value = GetFakeValue( _id );
+	if( !value )
+	{
+		return false;
+	}
+	*o_length = (uint8)std::min<size_t>( value->m_string.size(), 255 );
+	*o_value = new uint8[*o_length];
+	memcpy( *o_value, value->m_string.data(), *o_length );
+	return true;
+}
+
+// node 1 is the controller
+uint8 Manager::GetControllerNodeId( uint32 const _homeId )
+{
+	return 1;
+}
+
+// every node hears its two neighbours on either side
+uint32 Manager::GetNodeNeighbors( uint32 const _homeId, uint8 const _nodeId, uint8** o_associations )
+{
+	std::vector<uint8> neighbors;
+	for( int delta = -2; delta <= 2; ++delta )
+	{
+		int const node = _nodeId + delta;
+		if( delta && ( node >= 1 ) && ( node <= (int)s_nodes ) )
+		{
+			neighbors.push_back( (uint8)node );
+		}
+	}
+	*o_associations = new uint8[neighbors.size()];
+	std::copy( neighbors.begin(), neighbors.end(), *o_associations );
+	return neighbors.size();
+}
+
+string Manager::GetNodeType( uint32 const _homeId, uint8 const _nodeId ) { return "Multilevel Sensor"; }
+string Manager::GetNodeManufacturerName( uint32 const _homeId, uint8 const _nodeId ) { return "Thrift4OZW"; }
+string Manager::GetNodeProductName( uint32 const _homeId, uint8 const _nodeId ) { return "Fake Sensor"; }
+string Manager::GetNodeLocation( uint32 const _homeId, uint8 const _nodeId ) { return "bench"; }
+uint8 Manager::GetNodeBasic( uint32 const _homeId, uint8 const _nodeId ) { return 0x04; }
+uint8 Manager::GetNodeGeneric( uint32 const _homeId, uint8 const _nodeId ) { return 0x21; }
+uint8 Manager::GetNodeSpecific( uint32 const _homeId, uint8 const _nodeId ) { return 0x01; }
+bool Manager::IsNodeListeningDevice( uint32 const _homeId, uint8 const _nodeId ) { return true; }
+
+string Manager::GetNodeName( uint32 const _homeId, uint8 const _nodeId )
+{
+	std::ostringstream str;
+	str << "node " << (uint32)_nodeId;
+	return str.str();
+}
+
+void Manager::GetNodeStatistics( uint32 const _homeId, uint8 const _nodeId, Node::NodeData* _data )
+{
+	memset( _data->m_lastReceivedMessage, 0, sizeof(_data->m_lastReceivedMessage) );
+	_data->m_sentCnt = _data->m_receivedCnt = 100;
+	_data->m_sentFailed = _data->m_retries = _data->m_receivedDups = 0;
+	_data->m_rtt = _data->m_lastRTT = _data->m_averageRTT = 20;
+	_data->m_quality = 100;
+	_data->m_ccData.clear();
+}
+
+//-----------------------------------------------------------------------------
+// OpenZWave::Options and OpenZWave::Log, as used by ozwd's main()
+//-----------------------------------------------------------------------------
+Options* Options::s_instance = NULL;
+
+Options* Options::Create( string const& _configPath, string const& _userPath, string const& _commandLine )
+{
+	if( !s_instance )
+	{
+		s_instance = new Options( _configPath, _userPath, _commandLine );
+	}
+	return s_instance;
+}
+
+Options::Options( string const& _configPath, string const& _userPath, string const& _commandLine ) {}
+Options::~Options() {}
+bool Options::Lock() { return true; }
+
+void Log::SetLoggingState( LogLevel _saveLevel, LogLevel _queueLevel, LogLevel _dumpTrigger ) {}
@@ -0,0 +1,93 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// FakeManager.h: a simulated OpenZWave network for ozwd-bench
+//
+// FakeManager.cpp implements the OpenZWave::Manager calls that ozwd relies
+// on against an in-memory network of N nodes with M values each, and
+// FakeManager_stubs.cpp (generated by fake_manager.rb from Manager.h) the
+// rest of them as no-ops; ozwd-bench links against both instead of
+// libopenzwave, so that no Z-Wave controller is needed.
+//
+// AddDriver() starts a fake driver thread that reports the network
+// (DriverReady, NodeAdded, ValueAdded..., AllNodesQueried) to the watchers,
+// and later the ValueChanged notifications caused by SetValue().
+//
+// Instead of Configure(), Load() makes it the network of a capture
+// (ozwd --capture), which the driver thread doesn't report: Replay() plays
+// the captured notifications, values included, on the calling thread.
+//
+
+#ifndef _FakeManager_H
+#define _FakeManager_H
+
+#include <string>
+#include <vector>
+
+#include "Defs.h"
+#include "ValueID.h"
+
+// a notification of a capture, for FakeNetwork::Load() and Replay()
+struct FakeNotification
+{
+	uint8				m_type;			// OpenZWave::Notification::NotificationType
+	uint8				m_nodeId;
+	uint8				m_byte;
+	int64				m_timestamp;	// ms
+	bool				m_hasValueId;
+	OpenZWave::ValueID	m_id;
+	// the value OpenZWave had when the notification came in, if any
+	bool				m_hasValue;
+	bool				m_bool;
+	uint8				m_byteValue;
+	float				m_float;
+	int32				m_int;
+	int16				m_short;
+	std::string			m_string;		// also list selections and raw values
+};
+
+class FakeNetwork
+{
+public:
+	static uint32 const c_homeId = 0x0ca1ab1e;
+
+	// the network reported by the next AddDriver()
+	static void Configure( uint32 _nodes, uint32 _valuesPerNode );
+	// wait until AllNodesQueried was delivered
+	static bool WaitReady( uint32 _timeoutMs );
+	static void GetValueIDs( std::vector<OpenZWave::ValueID>& _values );
+	// change _count values back to back and deliver their ValueChanged
+	// notifications on the calling thread
+	static void Storm( uint32 _count );
+
+	// the nodes and values a capture of network _homeId mentions, instead of
+	// Configure(): the next AddDriver() reports nothing, it is only ready
+	static void Load( uint32 _homeId, std::vector<FakeNotification> const& _notifications );
+	// deliver the notifications on the calling thread, paced _speed times
+	// as fast as they were captured (0: as fast as possible)
+	static void Replay( std::vector<FakeNotification> const& _notifications, double _speed );
+};
+
+#endif
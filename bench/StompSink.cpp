@@ -0,0 +1,196 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// StompSink.cpp: a minimal STOMP broker for ozwd-bench
+//
+
+#include <cstdlib>
+#include <iostream>
+
+#include "StompSink.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+//-----------------------------------------------------------------------------
+// <StompSink::StompSink>
+//-----------------------------------------------------------------------------
+StompSink::StompSink
+(
+	uint16_t _port
+):
+	m_acceptor( m_io, tcp::endpoint( boost::asio::ip::address_v4::loopback(), _port ) ),
+	m_messages( 0 ),
+	m_bytes( 0 )
+{
+	Accept();
+	m_acceptThread = boost::thread( boost::bind( &boost::asio::io_service::run, &m_io ) );
+}
+
+//-----------------------------------------------------------------------------
+// <StompSink::~StompSink>
+// Connection threads are detached, the benchmark exits with them running
+//-----------------------------------------------------------------------------
+StompSink::~StompSink
+(
+)
+{
+	m_io.stop();
+	m_acceptThread.join();
+}
+
+//-----------------------------------------------------------------------------
+// <StompSink::Accept>
+//-----------------------------------------------------------------------------
+void StompSink::Accept
+(
+)
+{
+	boost::shared_ptr<tcp::socket> socket( new tcp::socket( m_io ) );
+	m_acceptor.async_accept( *socket, boost::bind( &StompSink::OnAccept, this, socket, boost::asio::placeholders::error ) );
+}
+
+//-----------------------------------------------------------------------------
+// <StompSink::OnAccept>
+// Every connection gets a thread of its own, blocking reads keep it simple
+//-----------------------------------------------------------------------------
+void StompSink::OnAccept
+(
+	boost::shared_ptr<tcp::socket> _socket,
+	boost::system::error_code const& _error
+)
+{
+	if( _error )
+	{
+		return;
+	}
+	boost::system::error_code ec;
+	_socket->set_option( tcp::no_delay( true ), ec );
+	boost::thread( boost::bind( &StompSink::Serve, this, _socket ) ).detach();
+	Accept();
+}
+
+//-----------------------------------------------------------------------------
+// <StompSink::Serve>
+// One frame at a time: command line, headers, blank line, then the body up
+// to content-length or the terminating NUL
+//-----------------------------------------------------------------------------
+void StompSink::Serve
+(
+	boost::shared_ptr<tcp::socket> _socket
+)
+{
+	boost::asio::streambuf buffer;
+	istream in( &buffer );
+	boost::system::error_code ec;
+	for( ;; )
+	{
+		in.clear();
+		boost::asio::read_until( *_socket, buffer, "\n\n", ec );
+		if( ec )
+		{
+			return;
+		}
+		string command, line, receipt;
+		size_t length = string::npos;
+		// heart-beats are bare newlines between frames
+		while( getline( in, command ) && command.empty() ) {}
+		while( getline( in, line ) && !line.empty() )
+		{
+			string::size_type colon = line.find( ':' );
+			if( colon == string::npos )
+			{
+				continue;
+			}
+			string const name = line.substr( 0, colon );
+			if( name == "content-length" )
+			{
+				length = strtoul( line.c_str() + colon + 1, NULL, 10 );
+			}
+			else if( name == "receipt" )
+			{
+				receipt = line.substr( colon + 1 );
+			}
+		}
+		// the body and its NUL
+		size_t const need = ( length == string::npos ) ? 0 : length + 1;
+		if( buffer.size() < need )
+		{
+			boost::asio::read( *_socket, buffer, boost::asio::transfer_at_least( need - buffer.size() ), ec );
+			if( ec )
+			{
+				return;
+			}
+		}
+		size_t body = 0;
+		if( length != string::npos )
+		{
+			buffer.consume( need );
+			body = length;
+		}
+		else
+		{
+			boost::asio::read_until( *_socket, buffer, '\0', ec );
+			if( ec )
+			{
+				return;
+			}
+			string rest;
+			getline( in, rest, '\0' );
+			body = rest.size();
+		}
+
+		string reply;
+		if( ( command == "CONNECT" ) || ( command == "STOMP" ) )
+		{
+			reply = "CONNECTED\nversion:1.1\nheart-beat:0,0\n\n";
+		}
+		else
+		{
+			if( command == "SEND" )
+			{
+				m_messages++;
+				m_bytes += body;
+			}
+			if( !receipt.empty() )
+			{
+				reply = "RECEIPT\nreceipt-id:" + receipt + "\n\n";
+			}
+		}
+		if( !reply.empty() )
+		{
+			reply.push_back( '\0' );
+			boost::asio::write( *_socket, boost::asio::buffer( reply ), ec );
+			if( ec )
+			{
+				return;
+			}
+		}
+		if( command == "DISCONNECT" )
+		{
+			return;
+		}
+	}
+}
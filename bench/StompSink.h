@@ -0,0 +1,65 @@
+/*
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+*/
+
+//
+// StompSink.h: a minimal STOMP broker for ozwd-bench
+//
+// Accepts ozwd's connection, acknowledges CONNECT and any frame asking for
+// a receipt, and counts (then drops) the SEND frames, so that the benchmark
+// measures ozwd's publishing path and not a real broker.
+//
+
+#ifndef _StompSink_H
+#define _StompSink_H
+
+#include <string>
+#include <stdint.h>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+class StompSink
+{
+public:
+	StompSink( uint16_t _port );
+	~StompSink();
+
+	// SEND frames received so far, from all connections
+	uint64_t GetMessages() const { return m_messages.load(); }
+	uint64_t GetBytes() const { return m_bytes.load(); }
+
+private:
+	void Accept();
+	void OnAccept( boost::shared_ptr<boost::asio::ip::tcp::socket> _socket, boost::system::error_code const& _error );
+	void Serve( boost::shared_ptr<boost::asio::ip::tcp::socket> _socket );
+
+	boost::asio::io_service			m_io;
+	boost::asio::ip::tcp::acceptor	m_acceptor;
+	boost::thread					m_acceptThread;
+	boost::atomic<uint64_t>			m_messages;
+	boost::atomic<uint64_t>			m_bytes;
+};
+
+#endif
@@ -0,0 +1,124 @@
+=begin
+Thrift4OZW - An Apache Thrift wrapper for OpenZWave
+----------------------------------------------------
+Copyright (c) 2011 Elias Karakoulakis <elias.karakoulakis@gmail.com>
+
+SOFTWARE NOTICE AND LICENSE
+
+Thrift4OZW is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License,
+or (at your option) any later version.
+
+Thrift4OZW is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Thrift4OZW.  If not, see <http://www.gnu.org/licenses/>.
+
+for more information on the LGPL, see:
+http://en.wikipedia.org/wiki/GNU_Lesser_General_Public_License
+=end
+
+# --------------------------
+#
+# fake_manager.rb: no-op definitions for every OpenZWave::Manager method that
+# bench/FakeManager.cpp doesn't simulate, so that ozwd-bench links without
+# libopenzwave. Parses the Manager.h of the OpenZWave tree ozwd is built
+# against, thus the stubs always match its signatures.
+#
+# ---------------------------
+
+require 'getoptlong'
+
+# implemented by hand in FakeManager.cpp (all overloads)
+SIMULATED = %w(
+    Create AddWatcher AddDriver GetControllerPath
+    GetValueAsBool GetValueAsByte GetValueAsFloat GetValueAsInt GetValueAsShort
+    GetValueAsString GetValueAsRaw GetValueListSelection SetValue
+    GetControllerNodeId GetNodeNeighbors GetNodeType GetNodeManufacturerName GetNodeProductName
+    GetNodeName GetNodeLocation GetNodeBasic GetNodeGeneric GetNodeSpecific
+    IsNodeListeningDevice GetNodeStatistics
+)
+# storage class & friends, not part of a definition
+DECL_ONLY = /\b(static|virtual|inline|explicit|DEPRECATED|OPENZWAVE_DEPRECATED|OPENZWAVE_EXPORT)\s+/
+
+ozwroot, output = nil, nil
+GetoptLong.new(
+  [ "--ozwroot", "-o", GetoptLong::REQUIRED_ARGUMENT ],
+  [ "--output",  "-O", GetoptLong::REQUIRED_ARGUMENT ]
+).each { |opt, arg|
+    case opt
+        when '--ozwroot' then ozwroot = File.expand_path(arg)
+        when '--output' then output = arg
+    end
+}
+raise "Usage: #{$0} --ozwroot <path to open-zwave> --output <file>" unless ozwroot and output
+
+header = File.join(ozwroot, "cpp", "src", "Manager.h")
+src = File.read(header).gsub(%r{/\*.*?\*/}m, '').gsub(%r{//[^\n]*}, '')
+
+# the body of class Manager
+start = (src =~ /class\s+(OPENZWAVE_EXPORT\s+)?Manager\b[^;{]*\{/) or raise "no class Manager in #{header}"
+pos = src.index('{', start) + 1
+
+# split it into top-level statements, dropping those with a body of their
+# own (inline methods, nested structs)
+statements, current, depth, had_body = [], '', 0, false
+while depth >= 0 and pos < src.length
+    c = src[pos]
+    pos += 1
+    if c == '{' then
+        depth += 1
+        had_body = true
+    elsif c == '}' then
+        depth -= 1
+        if depth == 0 and had_body and current =~ /\)\s*(const\s*)?(:.*)?\z/m then
+            # an inline method, no ';' follows
+            current, had_body = '', false
+        end
+    elsif depth == 0 then
+        if c == ';' then
+            statements << current unless had_body
+            current, had_body = '', false
+        else
+            current << c
+        end
+    end
+end
+
+stubs = []
+statements.each { |stmt|
+    stmt = stmt.gsub(/\b(public|protected|private)\s*:/, '').gsub(/\s+/, ' ').strip
+    next if stmt =~ /\A(typedef|friend|using|enum|class|struct|template)\b/
+    next unless md = /\A(.*?)(~?\b\w+)\s*\((.*)\)\s*(const)?\z/.match(stmt)
+    rettype, name, params, const = md[1].gsub(DECL_ONLY, '').strip, md[2], md[3], md[4]
+    next if SIMULATED.include?(name)
+    # default arguments only belong in the declaration
+    params = params.split(',').map { |p| p.sub(/\s*=.*\z/, '').strip }.join(', ')
+    body = if rettype.empty? or rettype == 'void' then
+        '{}'
+    elsif rettype.end_with?('*') then
+        '{ return NULL; }'
+    elsif rettype.end_with?('&') then
+        "{ static #{rettype.chomp('&').sub(/\Aconst\s+/, '').sub(/\s+const\z/, '').strip} dummy; return dummy; }"
+    else
+        "{ return #{rettype.sub(/\Aconst\s+/, '')}(); }"
+    end
+    stubs << "#{rettype.empty? ? '' : rettype + ' '}Manager::#{name}( #{params} )#{const ? ' const' : ''} #{body}"
+}
+
+File.open(output, 'w') { |f|
+    f.puts "// Automatically generated by bench/fake_manager.rb from #{header}"
+    f.puts "// no-op OpenZWave::Manager methods for ozwd-bench, do not edit"
+    f.puts
+    f.puts '#include "Manager.h"'
+    f.puts
+    f.puts 'using namespace std;'
+    f.puts 'using namespace OpenZWave;'
+    f.puts
+    stubs.each { |s| f.puts s }
+}
+puts "#{output}: #{stubs.length} Manager stubs"
@@ -66,6 +66,29 @@ options.each { |opt, arg|
 
 # OverloadedRE = /([^_]*)(?:_(.*))/
 
+# API calls that only read OpenZWave state: these are wrapped in a shared
+# (reader) lock so that they can run in parallel, all the rest grab the
+# exclusive (writer) lock. Anything not matching is considered mutating.
+MANAGER_API_READONLY = /^(Get|Is|is|SceneGet|SceneExists$)/
+
+def readonly_api?(method_name)
+    return !(method_name =~ MANAGER_API_READONLY).nil?
+end
+
+# The Z-Wave network a RemoteManagerHandler method works on, as an expression
+# of its arguments: calls on a network only lock that network (HomeReadLock/
+# HomeWriteLock in Main.cpp). nil for calls that aren't bound to a network,
+# and for scene calls (the scenes are shared by all networks), which lock
+# g_criticalSection itself.
+def home_id_expression(meth)
+    return nil if meth.name =~ /Scene/
+    return "_homeId" if meth.arguments.find(:name => "_homeId").is_a?RbGCCXML::Argument
+    meth.arguments.each { |arg|
+        return "#{arg.name}._homeId" if arg.cpp_type.to_cpp =~ /RemoteValueID/
+    }
+    return nil
+end
+
 MANAGER_INCLUDES = [
     "gen_cpp",
     ThriftInc,
@@ -251,9 +274,9 @@ begin
 				argmap[a][:descriptor] = "&#{target_method.name}_callback"
 			#
 			elsif (a.name =~ /context/) then
-				# pass the Thrift server singleton instance as the callback context
+				# pass the network's shard (see Main.cpp) as the callback context
 				argmap[a] = {}
-				argmap[a][:descriptor] = "(void*) this"
+				argmap[a][:descriptor] = "(void*) find_shard(_homeId)"
 			else
 				raise "Reverse argument mapping: couldn't resolve #{a.name} in #{CGI.unescapeHTML meth['demangled']}"
 			end
@@ -306,8 +329,16 @@ begin
 	    puts messages.join("\n") if $DEBUG
 	    messages.clear
 	    
-	    # Get me the manager, and lock the criticalsection
-	    output[lineno] = "\tManager* mgr = Manager::Get();\n\tg_criticalSection.lock();\n"
+	    # Get me the manager, and lock the network (or the criticalsection)
+	    # (RAII guard: shared for getters, exclusive for everything else)
+	    lock_type = readonly_api?(target_method.name) ? "ReadLock" : "WriteLock"
+	    if (home_id = home_id_expression(meth)) then
+		lock_decl = "Home#{lock_type} lock(#{home_id})"
+	    else
+		lock_decl = "#{lock_type} lock(g_criticalSection)"
+	    end
+	    messages << "  #{target_method.name}: #{lock_decl}"
+	    output[lineno] = "\tManager* mgr = Manager::Get();\n\t#{lock_decl};\n"
 	    fcall = "#{function_return_clause} mgr->#{target_method.name}(#{arg_array.compact.join(', ')})"
 	    case meth.return_type.name 
 	    when "void"
@@ -315,8 +346,9 @@ begin
 	    else
 		output[lineno+1] = "\t#{meth.return_type.to_cpp} function_result = #{fcall};\n"
 	    end
-	    # unlock the critical section
-	    output[lineno+1] << "\tg_criticalSection.unlock();\n" 
+	    # release the lock right after the call, so that any post-call 
+	    # marshalling (see RemoteManager_server.cpp.patch) runs unlocked
+	    output[lineno+1] << "\tlock.unlock();\n" 
 	    # output return statement (unless rettype == void)
 	    unless meth.return_type.name == "void"
 		output[lineno+1] << "\treturn(function_result);\n"
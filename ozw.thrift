@@ -107,6 +107,25 @@ enum DriverControllerInterface {
 	ControllerInterface_Hid
 }
 
+// Used in ScheduleValueWrite: the more urgent writes go out first, and are
+// handed to OpenZWave while its send queue is longer (--writelimits)
+enum WritePriority {
+	Write_Interactive = 0,		// user-facing control (a dimmer slider)
+	Write_Normal = 1,
+	Write_Bulk = 2			// configuration, batch updates
+}
+
+// The progress of a ScheduleValueWrite ticket
+enum WriteStatus {
+	Write_Queued = 0,		// waiting for its turn
+	Write_Sent = 1,			// handed to OpenZWave
+	Write_Confirmed = 2,		// the node reported the value after it was sent
+	Write_Superseded = 3,		// replaced by a later write to the same value
+	Write_Failed = 4,		// refused by OpenZWave (unknown value, value of the wrong type, raw data over 255 bytes)
+	Write_Rejected = 5,		// too many writes waiting (--writequeue)
+	Write_Unconfirmed = 6		// sent, but the node didn't report the value within --writetimeout
+}
+
 struct RemoteValueID {
     1:i32   _homeId,
     2:byte  _nodeId,
@@ -239,6 +258,255 @@ struct SceneGetValuesReturnStruct {
     2: list<RemoteValueID> o_value;
 }
 
+// Used in GetValues/GetAllValuesForNode and RemoteNotification: exactly one member is set, according to the value's type
+union RemoteValue {
+    1:bool m_bool;			// ValueType_Bool, ValueType_Button (written: true presses, false releases)
+    2:byte m_byte;			// ValueType_Byte
+    3:double m_decimal;			// ValueType_Decimal
+    4:i32 m_int;			// ValueType_Int
+    5:i16 m_short;			// ValueType_Short
+    6:string m_string;			// ValueType_String, ValueType_Schedule
+    7:string m_listSelection;		// ValueType_List (the selected item)
+    8:binary m_raw;			// ValueType_Raw
+}
+
+// A value as last reported by OpenZWave notifications (served from ozwd's cache)
+struct CachedValue {
+    1:RemoteValueID _id;
+    2:bool retval;			// false if the ValueID is unknown or its value was never read
+    3:RemoteValue o_value;
+    4:i64 m_changedAt;			// ms since the epoch, last time the value changed
+    5:i64 m_refreshedAt;		// ms since the epoch, last time the network reported it
+    6:bool m_stale;			// restored from ozwd's --snapshot, not reported by OpenZWave yet
+}
+
+// Used in GetNodeSnapshots: everything a client needs to render a node, in one call
+struct NodeSnapshot {
+    1:byte m_nodeId;
+    2:bool retval;			// false if the node is unknown (nothing else is set)
+    3:i64 m_version;			// changes whenever a notification touched the node
+    4:string m_type;
+    5:string m_manufacturerName;
+    6:string m_productName;
+    7:string m_name;
+    8:string m_location;
+    9:byte m_basic;
+    10:byte m_generic;
+    11:byte m_specific;
+    12:bool m_listening;
+    13:list<byte> m_neighbors;
+    14:NodeData m_statistics;
+    15:bool m_stale;			// restored from ozwd's --snapshot, not reported by OpenZWave yet
+}
+
+// The --snapshot file (TCompactProtocol): ozwd's registry when it was saved
+struct HomeSnapshot {
+    1:i32 m_homeId;
+    2:list<NodeSnapshot> m_nodes;
+    3:list<CachedValue> m_values;
+    4:map<i64,i32> m_listIndexes;	// selected index of the List values, by ValueID
+    5:string m_controllerPath;		// the --ozwport of the network
+}
+
+struct RegistrySnapshot {
+    1:i32 m_version;			// format version, see c_snapshotVersion in Main.cpp
+    2:i64 m_savedAt;			// ms since the epoch
+    3:list<HomeSnapshot> m_homes;
+}
+
+// The STOMP message body with --payload compact|binary: an OpenZWave notification,
+// serialized with TCompactProtocol or TBinaryProtocol respectively
+struct RemoteNotification {
+    1:i32 m_type;			// OpenZWave::Notification::NotificationType
+    2:i32 m_homeId;
+    3:byte m_nodeId;
+    4:byte m_byte;			// Notification::GetByte()
+    5:i64 m_timestamp;			// ms since the epoch
+    6:optional RemoteValueID m_valueId;	// value notifications only
+    7:optional RemoteValue m_value;	// the value itself, if it could be read
+    8:i64 m_sequence;			// notification sequence number (see SendValuesSnapshot)
+}
+
+// Used in WaitForNotifications: the notifications numbered above _sinceSeq
+struct NotificationBatch {
+    1:bool retval;			// false if ozwd keeps no notifications (--ringsize 0)
+    2:list<RemoteNotification> m_notifications;	// ascending m_sequence
+    3:i64 m_lastSequence;		// the _sinceSeq of the next call
+    4:bool m_complete;			// false if some notifications were overwritten, or _sinceSeq predates a restart: resync the values
+    5:i64 m_epoch;			// when this ozwd process started (ms since the epoch), the _epoch of the next call
+}
+
+// Used in GetValuesPage: a page of a network's cached values, by ascending ValueID
+struct ValuesPage {
+    1:list<CachedValue> m_values;
+    2:i64 m_nextCursor;			// the _cursor of the next page
+    3:bool m_more;			// false on the last page
+    4:i64 m_sequence;			// the last notification applied to the values of this page
+}
+
+// Used in GetValueHistory: the recorded samples of a numeric value (bools as 0/1,
+// lists as the selected index), oldest first
+struct ValueHistory {
+    1:bool retval;			// false if ozwd doesn't record history (--history)
+    2:list<i64> m_timestamps;		// ms since the epoch
+    3:list<double> m_values;
+    4:bool m_truncated;			// more samples than _maxPoints, only the latest were returned
+}
+
+// Used in GetValueHistoryAggregate: the samples of a value within a time bucket
+struct HistoryBucket {
+    1:i64 m_start;			// ms since the epoch
+    2:i32 m_count;			// 0: no samples (the other members are 0)
+    3:double m_min;
+    4:double m_max;
+    5:double m_avg;
+    6:double m_last;
+}
+
+// The STOMP message body of a SendValuesSnapshot chunk
+struct ValuesSnapshotChunk {
+    1:i64 m_sequence;			// the last notification applied to the snapshot
+    2:i32 m_chunk;			// 0-based
+    3:list<CachedValue> m_values;
+}
+
+// Used in GetNotificationQueueStatistics: state of ozwd's asynchronous STOMP publisher
+struct NotificationQueueStatistics {
+    1:i32 m_capacity;			// queue capacity (events)
+    2:i32 m_depth;			// events currently waiting to be published
+    3:i32 m_maxDepth;			// queue depth high watermark
+    4:string m_overflowPolicy;		// "block", "drop-oldest" or "coalesce"
+    5:i64 m_enqueued;			// events accepted
+    6:i64 m_published;			// events handed to the STOMP broker
+    7:i64 m_dropped;			// events discarded (drop-oldest)
+    8:i64 m_coalesced;			// events superseded by a newer one for the same value (coalesce)
+    9:i64 m_blocked;			// times a producer had to wait for room (block)
+    10:i64 m_sendFailures;		// STOMP send errors
+    11:i64 m_rateLimited;		// value updates superseded within their rate limit window (--ratewindow/--maxrate)
+    12:i64 m_suppressed;		// value updates dropped because the value didn't change (--suppressunchanged)
+}
+
+// Used in AddNotificationRoute/GetNotificationRoutes: the notifications that
+// match all criteria (an empty list matches anything) are also published to
+// m_topic. Command class and genre criteria only match value notifications.
+struct NotificationRoute {
+    1:i32 m_id;				// assigned by AddNotificationRoute
+    2:list<i32> m_homeIds;
+    3:list<byte> m_nodeIds;
+    4:list<byte> m_commandClasses;
+    5:list<byte> m_genres;		// ValueID::ValueGenre
+    6:list<byte> m_types;		// Notification::NotificationType
+    7:string m_topic;			// may contain {home}, {node}, {cc}, {genre} and {type}, replaced by their hex value
+}
+
+// Used in GetServerMetrics: a latency distribution, in µs
+struct MetricHistogram {
+    1:string m_name;			// RPC method, or what was timed
+    2:i64 m_count;
+    3:i64 m_sumUs;
+    4:i64 m_maxUs;
+    5:i64 m_p50Us;			// percentiles, rounded up to the bucket bound
+    6:i64 m_p99Us;
+    7:i64 m_p999Us;
+    8:list<i64> m_buckets;		// m_buckets[0]: 0µs, m_buckets[i]: [2^(i-1), 2^i) µs, the last one: anything slower
+    9:i64 m_errors;			// RPCs only: calls that failed
+}
+
+// Used in GetServerMetrics: how long ozwd's locks were waited for and held
+struct LockMetrics {
+    1:string m_name;			// "openzwave" (the Manager lock) or "registry" (the value cache)
+    2:MetricHistogram m_readWait;
+    3:MetricHistogram m_writeWait;
+    4:MetricHistogram m_readHold;
+    5:MetricHistogram m_writeHold;
+    6:i64 m_contended;			// acquisitions that had to wait
+}
+
+// Used in GetServerMetrics: ozwd's built-in instrumentation (also --metricsport)
+struct ServerMetrics {
+    1:i64 m_uptimeMs;
+    2:list<MetricHistogram> m_rpcs;	// every RemoteManager method called so far
+    3:list<LockMetrics> m_locks;
+    4:MetricHistogram m_notificationCallback;	// OnNotification, including its lock wait
+    5:map<string,i64> m_notifications;	// notifications received, by type
+    6:MetricHistogram m_stompSend;	// time spent handing each message to STOMP (empty with --nostomp)
+    7:i64 m_stompSendFailures;
+    8:MetricHistogram m_notificationPublish;	// from a notification's arrival (or a message's creation) to the end of its STOMP send
+}
+
+// Used in GetDriverHealth: one of ozwd's Z-Wave networks (--ozwport)
+struct DriverHealth {
+    1:string m_controllerPath;
+    2:i32 m_homeId;			// 0 until the driver is ready
+    3:string m_state;			// "starting", "ready" or "failed"
+    4:i64 m_readyAt;			// when the driver got ready (ms since the epoch), 0 if never
+    5:i64 m_lastNotificationAt;		// ms since the epoch, 0 if none
+    6:i64 m_notifications;		// notifications received from this network
+    7:i32 m_nodes;			// in the value cache
+    8:i32 m_values;
+    9:string m_topic;			// STOMP topic of its notifications (empty with --nostomp)
+    10:NotificationQueueStatistics m_queue;	// its STOMP publisher
+    11:DriverData m_driverStatistics;	// Manager::GetDriverStatistics, once ready
+}
+
+// Used in GetNetworkTopology: the mesh of a network in one call
+struct NetworkTopology {
+    1:bool retval;			// false if the network is unknown
+    2:i32 m_homeId;
+    3:byte m_controllerNodeId;
+    4:list<byte> m_nodeIds;		// the nodes ozwd knows of, ascending
+    5:binary m_adjacency;		// 232x232 bits, row-major: bit (a-1)*232+(b-1), least significant first, is set if node a reports node b as a neighbor
+    6:list<byte> m_hops;		// hops from the controller, for each of m_nodeIds (-1: unreachable)
+    7:list<byte> m_weakNodes;		// with a single link to the mesh at most, or unreachable
+    8:list<byte> m_criticalNodes;	// whose failure cuts other nodes off the controller
+    9:i64 m_version;			// changes whenever a node or its neighbors may have changed
+    10:i64 m_builtAt;			// ms since the epoch, when the neighbor lists were read
+}
+
+// Used in GetAdaptivePollPlan: a value ozwd polls itself (EnableAdaptivePoll)
+struct AdaptivePollEntry {
+    1:RemoteValueID m_valueId;
+    2:i32 m_intervalMs;			// the value is polled when older than this
+    3:i32 m_effectiveIntervalMs;	// longer while its node is unreliable
+    4:i64 m_lastReportAgeMs;		// since OpenZWave last reported the value, -1 if unknown
+    5:i64 m_nextPollInMs;		// unless the value is reported first
+    6:i64 m_polls;			// RefreshValue calls
+    7:i64 m_saved;			// polls a fixed interval would have made on top of these
+}
+
+// Used in GetAdaptivePollPlan: the adaptive polling of a network
+struct AdaptivePollPlan {
+    1:list<AdaptivePollEntry> m_entries;	// in the order they are due
+    2:i32 m_spacingMs;			// min. time between two polls of the network
+    3:map<byte,i32> m_nodeBackoff;	// the nodes polled less often (2, 4 or 8 times) for their retries and failed sends
+    4:i64 m_polls;			// RefreshValue calls, including the values no longer polled
+    5:i64 m_saved;			// polls saved thanks to fresh reports and backoff
+    6:i64 m_failed;			// RefreshValue calls OpenZWave refused
+}
+
+// Used in ScheduleValueWrite: further progress is published on the network's
+// STOMP topic ("WriteTicket" and "WriteStatus" headers)
+struct WriteTicket {
+    1:i64 m_ticket;			// 0 if rejected
+    2:WriteStatus m_status;		// Write_Queued or Write_Rejected
+}
+
+// Used in GetWriteSchedulerStatistics
+struct WriteSchedulerStatistics {
+    1:list<i32> m_pending;		// writes waiting, by WritePriority
+    2:i32 m_capacity;			// max. writes waiting (--writequeue)
+    3:list<i32> m_limits;		// send queue length below which each WritePriority is dispatched (--writelimits)
+    4:i32 m_awaiting;			// writes sent, waiting for the node to report the value
+    5:i64 m_scheduled;			// writes accepted
+    6:i64 m_superseded;			// writes replaced by a later one to the same value
+    7:i64 m_rejected;			// writes refused, too many waiting
+    8:i64 m_deferred;			// times waiting writes were held back by a long send queue
+    9:i64 m_dispatched;			// writes handed to OpenZWave
+    10:i64 m_failed;			// writes refused by OpenZWave
+    11:i64 m_confirmed;
+    12:i64 m_unconfirmed;
+}
+
 /*-------------------------------------*/
 service RemoteManager {
 /*-------------------------------------*/
@@ -785,4 +1053,39 @@ service RemoteManager {
     // ----------------------- ekarak: and a little extra candy server for missing functionality from OZW
     void SendAllValues();
     void ping();
+    // ----------------------- ozwd value cache: last known values, no round trip to OpenZWave::Manager
+    list<CachedValue> GetValues( 1:list<RemoteValueID> _ids );
+    list<CachedValue> GetAllValuesForNode( 1:i32 _homeId, 2:byte _nodeId );
+    // ----------------------- ozwd value snapshots: a start _cursor of 0 returns the first page
+    ValuesPage GetValuesPage( 1:i32 _homeId, 2:i64 _cursor, 3:i32 _limit );
+    // publish all cached values in chunks of _chunkSize (at most 4096), returns the snapshot's sequence number (-1 with --nostomp)
+    i64 SendValuesSnapshot( 1:i32 _chunkSize );
+    // ----------------------- ozwd value history (--history), _from and _to in ms since the epoch
+    // GetValueHistoryAggregate returns an empty list for more than 4096 _buckets
+    ValueHistory GetValueHistory( 1:RemoteValueID _valueId, 2:i64 _from, 3:i64 _to, 4:i32 _maxPoints );
+    list<HistoryBucket> GetValueHistoryAggregate( 1:RemoteValueID _valueId, 2:i64 _from, 3:i64 _to, 4:i32 _buckets );
+    // ----------------------- ozwd node snapshots (an empty _nodeIds list means all known nodes)
+    list<NodeSnapshot> GetNodeSnapshots( 1:i32 _homeId, 2:list<byte> _nodeIds );
+    // ----------------------- ozwd long-poll notifications, without a STOMP broker (start with _sinceSeq 0 and _epoch 0)
+    NotificationBatch WaitForNotifications( 1:i64 _sinceSeq, 2:i32 _maxBatch, 3:i32 _timeoutMs, 4:i64 _epoch );
+    // ----------------------- ozwd internals
+    NotificationQueueStatistics GetNotificationQueueStatistics();
+    ServerMetrics GetServerMetrics();
+    list<DriverHealth> GetDriverHealth();
+    // ----------------------- server-side subscription filters
+    // returns the new route's id, -1 if the route is invalid (the topic must
+    // start with '/') or there are 64 routes already
+    i32 AddNotificationRoute( 1:NotificationRoute _route );
+    bool RemoveNotificationRoute( 1:i32 _id );
+    list<NotificationRoute> GetNotificationRoutes();
+    // ----------------------- scheduled value writes: coalesced per value, by priority, admitted by send queue length
+    WriteTicket ScheduleValueWrite( 1:RemoteValueID _id, 2:RemoteValue _value, 3:WritePriority _priority );
+    WriteSchedulerStatistics GetWriteSchedulerStatistics();
+    // ----------------------- the whole mesh: every node's neighbors, cached until a node or its neighbors change
+    NetworkTopology GetNetworkTopology( 1:i32 _homeId );
+    // ----------------------- adaptive polling: poll a value only when it wasn't reported within _intervalMs (at least 1000)
+    // the value is no longer polled by OpenZWave itself (DisablePoll); false if the value is unknown
+    bool EnableAdaptivePoll( 1:RemoteValueID _valueId, 2:i32 _intervalMs );
+    bool DisableAdaptivePoll( 1:RemoteValueID _valueId );
+    AdaptivePollPlan GetAdaptivePollPlan( 1:i32 _homeId );
 }